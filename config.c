@@ -5,6 +5,9 @@
 #include <errno.h>
 
 #include "hits.h"
+#include "writeback.h"
+#include "slowlog.h"
+#include "prefetch.h"
 #include "interface.h"
 #include "source.h"
 #include "running.h"
@@ -23,6 +26,7 @@ struct log_dest {
 };
 
 static struct log_dest *main_log=0,*requests_log=0,*stats_log=0;
+static struct log_dest *slow_log=0;
 
 static void configure_logging_levels(struct jpf_value *raw) {
   enum log_level level;
@@ -124,6 +128,9 @@ void rotate_logs(struct running *rr) {
   if(stats_log) {
     rr->stats_fd = rotate_log_dest(rr,stats_log);
   }
+  if(slow_log && sl_get_slowlog(rr->sl)) {
+    slowlog_reset_fd(sl_get_slowlog(rr->sl),rotate_log_dest(rr,slow_log));
+  }
   if(main_log) {
     logging_fd(rotate_log_dest(rr,main_log));
   }
@@ -204,6 +211,102 @@ static void configure_hits(struct running *rr,struct jpf_value *raw) {
   sl_set_hits(rr->sl,hits_new(rr->eb,fd,val));
 }
 
+static int config_int(struct jpf_value *raw,char *key,int def) {
+  int val;
+
+  if(!raw) { return def; }
+  switch(jpfv_int(jpfv_lookup(raw,key),&val)) {
+  case -2: return def;
+  case -1:
+    log_error(("Bad value for '%s'",key));
+    die("Bad config value");
+    break;
+  default: break;
+  }
+  return val;
+}
+
+/* Write-back is always queued; the section just tunes it */
+static void configure_writeback(struct running *rr,struct jpf_value *raw) {
+  struct writeback *wb;
+  struct jpf_value *v;
+  int max_requests,max_mb,batch,max_active,budget_ms;
+
+  log_debug(("configuring writeback"));
+  max_requests = config_int(raw,"max_requests",256);
+  max_mb = config_int(raw,"max_mb",64);
+  batch = config_int(raw,"batch",16);
+  max_active = config_int(raw,"max_active",4);
+  budget_ms = config_int(raw,"budget_ms",5);
+  if(max_requests<1 || max_mb<1 || batch<1 || max_active<1 || budget_ms<0) {
+    die("Bad writeback section");
+  }
+  wb = wb_new(rr->eb);
+  wb_set_limits(wb,max_requests,((int64_t)max_mb)*1024*1024);
+  wb_set_batch(wb,batch,max_active,((int64_t)budget_ms)*1000);
+  v = raw?jpfv_lookup(raw,"drop"):0;
+  if(v) {
+    if(v->type!=JPFV_STRING) { die("Bad writeback drop policy"); }
+    if(!strcmp(v->v.string,"oldest")) { wb_set_drop_oldest(wb,1); }
+    else if(!strcmp(v->v.string,"newest")) { wb_set_drop_oldest(wb,0); }
+    else { die("Bad writeback drop policy"); }
+  }
+  sl_set_writeback(rr->sl,wb);
+}
+
+/* Off unless configured: tracing costs a little on every request */
+static void configure_slowlog(struct running *rr,struct jpf_value *raw) {
+  int fd,threshold_ms;
+
+  if(!raw) { return; }
+  log_debug(("configuring slow request log"));
+  slow_log = create_log_dest(raw);
+  fd = open_log_dest(slow_log);
+  threshold_ms = config_int(raw,"threshold_ms",1000);
+  if(threshold_ms<0) { die("Bad slowlog threshold"); }
+  log_debug(("slow log fd=%d threshold=%dms",fd,threshold_ms));
+  sl_set_slowlog(rr->sl,slowlog_new(fd,((int64_t)threshold_ms)*1000));
+}
+
+/* Off unless configured: only worth it in front of a slow source */
+static void configure_prefetch(struct running *rr,struct jpf_value *raw) {
+  struct prefetch *pf;
+  int max_active,busy,min_kb,max_mb,chunk_kb;
+
+  if(!raw) { return; }
+  log_debug(("configuring prefetch"));
+  max_active = config_int(raw,"max_active",4);
+  busy = config_int(raw,"busy",16);
+  min_kb = config_int(raw,"min_window_kb",1024);
+  max_mb = config_int(raw,"max_window_mb",64);
+  chunk_kb = config_int(raw,"chunk_kb",1024);
+  if(max_active<1 || busy<1 || min_kb<1 || chunk_kb<1 ||
+     ((int64_t)max_mb)*1024<min_kb) {
+    die("Bad prefetch section");
+  }
+  pf = pf_new(rr->eb);
+  pf_set_limits(pf,max_active,busy,((int64_t)min_kb)*1024,
+                ((int64_t)max_mb)*1024*1024,((int64_t)chunk_kb)*1024);
+  sl_set_prefetch(rr->sl,pf);
+}
+
+/* Limits a source (typically a cache) to specs with these prefixes */
+static void configure_prefixes(struct source *src,struct jpf_value *v) {
+  int i;
+
+  if(!v) { return; }
+  if(v->type==JPFV_STRING) {
+    src_add_prefix(src,v->v.string);
+  } else if(v->type==JPFV_ARRAY) {
+    for(i=0;i<v->v.array.len;i++) {
+      if(v->v.array.v[i]->type!=JPFV_STRING) { die("Bad prefix"); }
+      src_add_prefix(src,v->v.array.v[i]->v.string);
+    }
+  } else {
+    die("Bad prefix");
+  }
+}
+
 // XXX don't rely on jpf ordering
 static void configure_source(struct running *rr,char *name,
                              struct jpf_value *conf) {
@@ -225,6 +328,7 @@ static void configure_source(struct running *rr,char *name,
   log_debug(("Creating source of type '%s'",name));
   src = creator(rr,conf);
   src_set_name(src,name);
+  configure_prefixes(src,jpfv_lookup(conf,"prefix"));
   v = jpfv_lookup(conf,"fail_timeout");
   if(v) {
     if(jpfv_int(v,&timeout)) { die("Bad timeout"); }
@@ -292,6 +396,9 @@ int load_config(struct running *rr,char *path) {
   configure_logging(rr,jpfv_lookup(raw,"logging"));
   configure_stats(rr,jpfv_lookup(raw,"stats"));
   configure_hits(rr,jpfv_lookup(raw,"hits"));
+  configure_writeback(rr,jpfv_lookup(raw,"writeback"));
+  configure_slowlog(rr,jpfv_lookup(raw,"slowlog"));
+  configure_prefetch(rr,jpfv_lookup(raw,"prefetch"));
   configure_sources(rr,jpfv_lookup(raw,"sources"));
   configure_interfaces(rr,jpfv_lookup(raw,"interfaces"));
   val = jpfv_lookup(raw,"pidfile");
@@ -308,6 +415,8 @@ void config_finished(void) {
   free_log_dest(stats_log);
   free_log_dest(requests_log);
   free_log_dest(main_log);
+  free_log_dest(slow_log);
+  slow_log = 0;
   stats_log = 0;
   requests_log = 0;
   main_log = 0;
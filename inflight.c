@@ -0,0 +1,119 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "inflight.h"
+
+#include "util/misc.h"
+#include "util/assoc.h"
+#include "util/buffer.h"
+#include "util/logging.h"
+#include "request.h"
+
+CONFIG_LOGGING(inflight)
+
+struct waiter {
+  inflight_fn fn;
+  void *priv;
+  struct waiter *next;
+};
+
+struct pending {
+  struct waiter *first,**lastp;
+};
+
+struct inflight {
+  struct assoc *pending;
+};
+
+static void pending_free(void *target,void *priv) {
+  struct pending *p = (struct pending *)target;
+  struct waiter *w;
+
+  while(p->first) {
+    w = p->first->next;
+    free(p->first);
+    p->first = w;
+  }
+  free(p);
+}
+
+struct inflight * inflight_new(void) {
+  struct inflight *f;
+
+  f = safe_malloc(sizeof(struct inflight));
+  f->pending = assoc_create(type_free,0,pending_free,0);
+  return f;
+}
+
+void inflight_free(struct inflight *f) {
+  if(assoc_len(f->pending)) {
+    log_warn(("freeing with %d fetches in flight",assoc_len(f->pending)));
+  }
+  assoc_release(f->pending);
+  free(f);
+}
+
+static char * make_key(char *spec,int64_t version,int64_t block) {
+  return make_string("%"PRId64":%"PRId64":%s",block,version,spec);
+}
+
+/* Returns 1 if this is the first wait, and so the caller must fetch */
+int inflight_wait(struct inflight *f,char *spec,int64_t version,
+                  int64_t block,inflight_fn fn,void *priv) {
+  struct pending *p;
+  struct waiter *w;
+  char *key;
+  int first;
+
+  key = make_key(spec,version,block);
+  p = (struct pending *)assoc_lookup(f->pending,key);
+  first = !p;
+  if(first) {
+    p = safe_malloc(sizeof(struct pending));
+    p->first = 0;
+    p->lastp = &(p->first);
+    assoc_set(f->pending,key,p);
+  } else {
+    log_debug(("joining fetch of '%s'",key));
+    free(key);
+  }
+  w = safe_malloc(sizeof(struct waiter));
+  w->fn = fn;
+  w->priv = priv;
+  w->next = 0;
+  *(p->lastp) = w;
+  p->lastp = &(w->next);
+  return first;
+}
+
+void inflight_complete(struct inflight *f,char *spec,int64_t version,
+                       int64_t block,struct source *src,
+                       struct buffer *buf,char *data,int64_t length,
+                       int eof,int failed_errno) {
+  struct pending *p;
+  struct waiter *w,*wn;
+  struct chunk *ck;
+  char *key;
+
+  key = make_key(spec,version,block);
+  p = (struct pending *)assoc_lookup(f->pending,key);
+  if(!p) {
+    log_warn(("completion of '%s' which was not in flight",key));
+    free(key);
+    return;
+  }
+  /* Detach first: waiters may start new fetches of their own */
+  w = p->first;
+  p->first = 0;
+  assoc_set(f->pending,key,0);
+  free(key);
+  for(;w;w=wn) {
+    wn = w->next;
+    ck = 0;
+    if(!failed_errno) {
+      ck = rq_chunk(src,buf,data,block,length,eof,0);
+    }
+    w->fn(ck,failed_errno,w->priv);
+    free(w);
+  }
+}
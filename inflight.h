@@ -0,0 +1,27 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <inttypes.h>
+
+#include "types.h"
+
+/* Blocks currently being fetched by a source, so that concurrent requests
+ * for the same block can wait on the one fetch rather than each making
+ * their own.
+ */
+
+struct inflight;
+
+/* ck is 0 on failure, otherwise ownership passes to the callback */
+typedef void (*inflight_fn)(struct chunk *ck,int failed_errno,void *priv);
+
+struct inflight * inflight_new(void);
+void inflight_free(struct inflight *f);
+int inflight_wait(struct inflight *f,char *spec,int64_t version,
+                  int64_t block,inflight_fn fn,void *priv);
+void inflight_complete(struct inflight *f,char *spec,int64_t version,
+                       int64_t block,struct source *src,
+                       struct buffer *buf,char *data,int64_t length,
+                       int eof,int failed_errno);
+
+#endif
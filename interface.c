@@ -3,6 +3,7 @@
 #include "util/misc.h"
 #include "interface.h"
 #include "request.h"
+#include "latency.h"
 
 CONFIG_LOGGING(interface)
 
@@ -10,6 +11,7 @@ static void ic_ref_free(void *data) {
   struct interface *ic = (struct interface *)data;
 
   log_debug(("intefrace free"));
+  latency_free(ic->lat);
   free(ic);
 }
 
@@ -27,6 +29,7 @@ struct interface * ic_create(void) {
   ic->bytes = 0;
   ic->hits = 0;
   ic->errors = 0;
+  ic->lat = latency_new();
   ref_create(&(ic->r));
   ref_on_release(&(ic->r),ic_ref_release,ic);
   ref_on_free(&(ic->r),ic_ref_free,ic);
@@ -45,10 +48,19 @@ void ic_collect(struct interface *ic,int64_t length) {
   }
 }
 
+void ic_collect_time(struct interface *ic,int64_t usecs) {
+  latency_record(ic->lat,usecs);
+}
+
 void ic_global_stats(struct interface *ic,struct jpf_value *out) {
+  struct jpf_value *v;
+
   jpfv_assoc_add(out,"hits_total",jpfv_number_int(ic->hits));
   jpfv_assoc_add(out,"errors_total",jpfv_number_int(ic->errors));
   jpfv_assoc_add(out,"bytes_total",jpfv_number_int(ic->bytes));
+  v = jpfv_assoc();
+  latency_stats(ic->lat,v);
+  jpfv_assoc_add(out,"time_us",v);
 }
 
 void ic_quit(struct interface *ic) { ic->quit(ic); }
@@ -10,6 +10,7 @@ void ic_release(struct interface *ic);
 void ic_quit(struct interface *ic);
 struct ref * ic_ref(struct interface *ic);
 void ic_collect(struct interface *ic,int64_t length);
+void ic_collect_time(struct interface *ic,int64_t usecs);
 void ic_global_stats(struct interface *ic,struct jpf_value *out);
 
 #endif
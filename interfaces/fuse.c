@@ -45,6 +45,7 @@ struct fuse_req {
   char *uri;
   fuse_req_t req;
   size_t size;
+  int64_t start;
 };
 
 static void fi_quit(struct interface *ic) {
@@ -215,6 +216,7 @@ static void read_done(int failed_errno,char *data,void *priv) {
   struct fuse_req *fr;
 
   fr = (struct fuse_req *)priv;
+  ic_collect_time(fr->fi->ic,microtime()-fr->start);
   if(!fr->fi->did_quit) {
     if(failed_errno) {
       // XXX better reporting
@@ -251,6 +253,7 @@ static void fuse_read(fuse_req_t req,fuse_ino_t ino,size_t size,
   fr->fi = fi;
   fr->req = req;
   fr->size = size;
+  fr->start = microtime();
   fr->uri = strdup(uri);
   ic_acquire(fi->ic);
   si_read(fi->si,fi->sl,uri,stat.version,off,size,read_done,fr);
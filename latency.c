@@ -0,0 +1,55 @@
+#include <inttypes.h>
+
+#include "latency.h"
+
+#include "util/misc.h"
+#include "util/histogram.h"
+#include "jpf/jpf.h"
+
+struct latency {
+  struct histogram *total,*mark,*interval;
+};
+
+struct latency * latency_new(void) {
+  struct latency *l;
+
+  l = safe_malloc(sizeof(struct latency));
+  l->total = histogram_create();
+  l->mark = histogram_create();
+  l->interval = histogram_create();
+  return l;
+}
+
+void latency_free(struct latency *l) {
+  histogram_free(l->total);
+  histogram_free(l->mark);
+  histogram_free(l->interval);
+  free(l);
+}
+
+void latency_record(struct latency *l,int64_t usecs) {
+  if(usecs < 0) { usecs = 0; }
+  histogram_record(l->total,usecs);
+}
+
+static struct jpf_value * summary(struct histogram *h) {
+  struct jpf_value *out;
+
+  out = jpfv_assoc();
+  jpfv_assoc_add(out,"n",jpfv_number_int(histogram_count(h)));
+  jpfv_assoc_add(out,"mean",jpfv_number_int(histogram_mean(h)));
+  jpfv_assoc_add(out,"p50",jpfv_number_int(histogram_percentile(h,50)));
+  jpfv_assoc_add(out,"p90",jpfv_number_int(histogram_percentile(h,90)));
+  jpfv_assoc_add(out,"p99",jpfv_number_int(histogram_percentile(h,99)));
+  jpfv_assoc_add(out,"p999",jpfv_number_int(histogram_percentile(h,99.9)));
+  jpfv_assoc_add(out,"max",jpfv_number_int(histogram_max(h)));
+  return out;
+}
+
+/* Also starts a new interval */
+void latency_stats(struct latency *l,struct jpf_value *out) {
+  histogram_diff(l->interval,l->total,l->mark);
+  histogram_copy(l->mark,l->total);
+  jpfv_assoc_add(out,"total",summary(l->total));
+  jpfv_assoc_add(out,"interval",summary(l->interval));
+}
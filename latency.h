@@ -0,0 +1,19 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <inttypes.h>
+
+#include "jpf/jpf.h"
+
+/* Latency distribution for the stats log. Each emission reports the
+ * whole run and the interval since the previous emission.
+ */
+
+struct latency;
+
+struct latency * latency_new(void);
+void latency_free(struct latency *l);
+void latency_record(struct latency *l,int64_t usecs);
+void latency_stats(struct latency *l,struct jpf_value *out);
+
+#endif
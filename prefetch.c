@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <event2/event.h>
+
+#include "prefetch.h"
+
+#include "util/misc.h"
+#include "util/queue.h"
+#include "util/ranges.h"
+#include "util/logging.h"
+#include "request.h"
+#include "sourcelist.h"
+
+CONFIG_LOGGING(prefetch)
+
+#define STREAMS 64
+#define TRIGGER 2 /* reads fitting the pattern before prefetching starts */
+#define MAX_STRIDES 32 /* strided reads ahead, at most */
+#define MAX_QUEUED 256
+#define RATE_SLICE 100000 /* us */
+#define RETRY 10000 /* us, when held off by demand */
+
+struct stream {
+  char *spec; /* 0 if unused */
+  int64_t version;
+  int64_t last,end,stride; /* of the last read; stride 0 if following on */
+  int run;
+  int64_t ahead,limit; /* prefetched up to; no further than */
+  struct ranges fetched; /* prefetched, not yet read */
+  struct ranges pending; /* prefetches not yet back */
+  int64_t window,floor;
+  double rate; /* reader's, bytes/us */
+  int64_t mark,mark_bytes;
+  uint64_t used;
+};
+
+struct fetch {
+  struct prefetch *pf;
+  char *spec;
+  int64_t version,offset,length;
+  uint64_t started;
+};
+
+struct prefetch {
+  struct sourcelist *sl; /* borrowed: it owns us */
+  struct event *retry;
+  struct queue *q;
+  struct stream streams[STREAMS];
+  int active,scheduled;
+  uint64_t clock;
+  double latency; /* of a prefetch, us */
+
+  /* config */
+  int max_active,busy;
+  int64_t min_window,max_window,chunk;
+
+  /* stats */
+  uint64_t fetches,bytes,hit_bytes,wasted_bytes,failed,dropped;
+  int64_t window_peak;
+};
+
+static void fetch_free(void *target,void *priv) {
+  struct fetch *f = (struct fetch *)target;
+
+  free(f->spec);
+  free(f);
+}
+
+static int64_t overlap(struct ranges *rr,int64_t a,int64_t b) {
+  struct rangei ri;
+  int64_t x,y,n = 0;
+
+  ranges_start(rr,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    if(x<a) { x = a; }
+    if(y>b) { y = b; }
+    if(y>x) { n += y-x; }
+  }
+  return n;
+}
+
+/* Prefetched data in [a,b) which won't now be read */
+static void waste(struct prefetch *pf,struct stream *s,int64_t a,int64_t b) {
+  pf->wasted_bytes += overlap(&(s->fetched),a,b);
+  ranges_remove(&(s->fetched),a,b);
+}
+
+static void stream_drop(struct prefetch *pf,struct stream *s) {
+  if(!s->spec) { return; }
+  waste(pf,s,0,INT64_MAX);
+  ranges_free(&(s->fetched));
+  ranges_free(&(s->pending));
+  free(s->spec);
+  s->spec = 0;
+}
+
+static struct stream * find_stream(struct prefetch *pf,char *spec,
+                                   int64_t version) {
+  int i;
+
+  for(i=0;i<STREAMS;i++) {
+    if(pf->streams[i].spec && pf->streams[i].version==version &&
+       !strcmp(pf->streams[i].spec,spec)) {
+      return pf->streams+i;
+    }
+  }
+  return 0;
+}
+
+/* Taking over the least recently read */
+static struct stream * new_stream(struct prefetch *pf,char *spec,
+                                  int64_t version) {
+  struct stream *s;
+  int i;
+
+  s = pf->streams;
+  for(i=1;i<STREAMS;i++) {
+    if(pf->streams[i].used<s->used) { s = pf->streams+i; }
+  }
+  stream_drop(pf,s);
+  s->spec = strdup(spec);
+  s->version = version;
+  s->last = s->end = -1;
+  s->stride = INT64_MIN;
+  s->run = 0;
+  s->ahead = 0;
+  s->limit = INT64_MAX;
+  ranges_init(&(s->fetched));
+  ranges_init(&(s->pending));
+  s->window = s->floor = pf->min_window;
+  s->rate = 0;
+  s->mark = microtime();
+  s->mark_bytes = 0;
+  return s;
+}
+
+static void dispatch(evutil_socket_t fd,short what,void *arg);
+
+static void schedule(struct prefetch *pf,int64_t delay) {
+  struct timeval tv = {0,0};
+
+  if(pf->scheduled) { return; }
+  pf->scheduled = 1;
+  tv.tv_usec = delay;
+  event_add(pf->retry,&tv);
+}
+
+static void fetch_done(int failed_errno,char *data,void *priv) {
+  struct fetch *f = (struct fetch *)priv;
+  struct prefetch *pf = f->pf;
+  struct stream *s;
+  int64_t taken;
+
+  taken = microtime()-f->started;
+  pf->latency = pf->latency?(7*pf->latency+taken)/8:taken;
+  pf->active--;
+  s = find_stream(pf,f->spec,f->version);
+  if(s) { ranges_remove(&(s->pending),f->offset,f->offset+f->length); }
+  if(failed_errno) {
+    /* Most likely past the end of the file */
+    log_debug(("prefetch failed errno=%d",failed_errno));
+    pf->failed++;
+    if(s) {
+      if(f->offset<s->limit) { s->limit = f->offset; }
+      ranges_remove(&(s->fetched),f->offset,f->offset+f->length);
+    }
+  }
+  fetch_free(f,0);
+  schedule(pf,0);
+}
+
+static void start(struct prefetch *pf,struct fetch *f) {
+  struct request *rq;
+
+  log_debug(("prefetching %s %"PRId64"+%"PRId64,
+             f->spec,f->offset,f->length));
+  pf->active++;
+  pf->fetches++;
+  pf->bytes += f->length;
+  f->started = microtime();
+  rq = rq_create(pf->sl,f->spec,f->version,f->offset,f->length,
+                 fetch_done,f);
+  rq->background = 1;
+  rq_run(rq);
+  rq_release(rq);
+}
+
+static void dispatch(evutil_socket_t fd,short what,void *arg) {
+  struct prefetch *pf = (struct prefetch *)arg;
+
+  pf->scheduled = 0;
+  while(queue_length(pf->q) && pf->active<pf->max_active) {
+    if(sl_demand(pf->sl)>=pf->busy) {
+      log_debug(("held off by demand"));
+      schedule(pf,RETRY);
+      return;
+    }
+    start(pf,(struct fetch *)queue_remove(pf->q));
+  }
+}
+
+static void enqueue(struct prefetch *pf,struct stream *s,int64_t offset,
+                    int64_t length) {
+  struct fetch *f;
+
+  if(queue_length(pf->q)>=MAX_QUEUED) {
+    pf->dropped++;
+    return;
+  }
+  f = safe_malloc(sizeof(struct fetch));
+  f->pf = pf;
+  f->spec = strdup(s->spec);
+  f->version = s->version;
+  f->offset = offset;
+  f->length = length;
+  ranges_add(&(s->fetched),offset,offset+length);
+  ranges_add(&(s->pending),offset,offset+length);
+  queue_add(pf->q,f);
+}
+
+/* Twice what the reader gets through while a prefetch is out, but that's
+ * circular while the window is what's holding the reader back: so too
+ * at least double whatever it was when the reader last caught up with
+ * prefetches still out.
+ */
+static void size_window(struct prefetch *pf,struct stream *s,int64_t length,
+                        int caught_up) {
+  int64_t now;
+  double rate,w;
+
+  now = microtime();
+  s->mark_bytes += length;
+  if(now-s->mark>=RATE_SLICE) {
+    rate = ((double)s->mark_bytes)/(now-s->mark);
+    s->rate = s->rate?(3*s->rate+rate)/4:rate;
+    s->mark = now;
+    s->mark_bytes = 0;
+  }
+  if(caught_up && s->floor<pf->max_window) {
+    s->floor = (s->window>s->floor?s->window:s->floor)*2;
+  }
+  w = 2*s->rate*pf->latency;
+  if(w<s->floor) { w = s->floor; }
+  if(w>pf->max_window) { w = pf->max_window; }
+  s->window = w;
+  if(s->window>pf->window_peak) { pf->window_peak = s->window; }
+}
+
+void pf_read(struct prefetch *pf,struct sourcelist *sl,char *spec,
+             int64_t version,int64_t offset,int64_t length) {
+  struct stream *s;
+  int64_t end,stride,from,to,len,i,n,o,hit;
+
+  if(length<=0) { return; }
+  pf->sl = sl;
+  end = offset+length;
+  s = find_stream(pf,spec,version);
+  if(!s) { s = new_stream(pf,spec,version); }
+  s->used = ++pf->clock;
+  hit = overlap(&(s->fetched),offset,end);
+  pf->hit_bytes += hit;
+  ranges_remove(&(s->fetched),offset,end);
+  /* Reads arrive a little out of order, but not by a whole window */
+  if(offset>s->window) { waste(pf,s,0,offset-s->window); }
+  size_window(pf,s,length,overlap(&(s->pending),offset,end)>0);
+  stride = (offset==s->end)?0:offset-s->last;
+  if(stride==s->stride) {
+    s->run++;
+  } else {
+    s->run = 0;
+    s->stride = stride;
+    s->ahead = end;
+  }
+  s->last = offset;
+  s->end = end;
+  if(s->run<TRIGGER || (stride && stride<length)) { return; }
+  if(!stride) {
+    from = (s->ahead>end)?s->ahead:end;
+    to = end+s->window;
+    if(to>s->limit) { to = s->limit; }
+    /* Topped up a chunk at a time, not a read at a time */
+    if(from>end && to-from<pf->chunk) { to = from; }
+    for(;from<to;from+=len) {
+      len = (to-from>pf->chunk)?pf->chunk:to-from;
+      enqueue(pf,s,from,len);
+    }
+    if(to>s->ahead) { s->ahead = to; }
+  } else {
+    n = s->window/length;
+    if(n<1) { n = 1; }
+    if(n>MAX_STRIDES) { n = MAX_STRIDES; }
+    for(i=1;i<=n;i++) {
+      o = offset+i*stride;
+      if(o+length>s->limit) { break; }
+      if(o<s->ahead) { continue; }
+      enqueue(pf,s,o,length);
+      s->ahead = o+length;
+    }
+  }
+  log_debug(("%s: stride=%"PRId64" window=%"PRId64" ahead=%"PRId64
+             " hit=%"PRId64,spec,stride,s->window,s->ahead,hit));
+  schedule(pf,0);
+}
+
+struct prefetch * pf_new(struct event_base *eb) {
+  struct prefetch *pf;
+  int i;
+
+  pf = safe_malloc(sizeof(struct prefetch));
+  pf->sl = 0;
+  pf->retry = event_new(eb,-1,0,dispatch,pf);
+  pf->q = queue_create(fetch_free,0);
+  for(i=0;i<STREAMS;i++) {
+    pf->streams[i].spec = 0;
+    pf->streams[i].used = 0;
+  }
+  pf->active = pf->scheduled = 0;
+  pf->clock = 0;
+  pf->latency = 0;
+  pf->max_active = 4;
+  pf->busy = 16;
+  pf->min_window = 1024*1024;
+  pf->max_window = 64*1024*1024;
+  pf->chunk = 1024*1024;
+  pf->fetches = pf->bytes = pf->hit_bytes = pf->wasted_bytes = 0;
+  pf->failed = pf->dropped = 0;
+  pf->window_peak = 0;
+  return pf;
+}
+
+/* Prefetches out hold the sourcelist, so there are none by now */
+void pf_free(struct prefetch *pf) {
+  int i;
+
+  event_del(pf->retry);
+  event_free(pf->retry);
+  queue_release(pf->q);
+  for(i=0;i<STREAMS;i++) { stream_drop(pf,pf->streams+i); }
+  free(pf);
+}
+
+void pf_set_limits(struct prefetch *pf,int max_active,int busy,
+                   int64_t min_window,int64_t max_window,int64_t chunk) {
+  pf->max_active = max_active;
+  pf->busy = busy;
+  pf->min_window = min_window;
+  pf->max_window = max_window;
+  pf->chunk = chunk;
+}
+
+void pf_stats(struct prefetch *pf,struct jpf_value *out) {
+  uint64_t settled;
+
+  settled = pf->hit_bytes+pf->wasted_bytes;
+  jpfv_assoc_add(out,"queued",jpfv_number_int(queue_length(pf->q)));
+  jpfv_assoc_add(out,"active",jpfv_number_int(pf->active));
+  jpfv_assoc_add(out,"fetches",jpfv_number_int(pf->fetches));
+  jpfv_assoc_add(out,"bytes",jpfv_number_int(pf->bytes));
+  jpfv_assoc_add(out,"hit_bytes",jpfv_number_int(pf->hit_bytes));
+  jpfv_assoc_add(out,"wasted_bytes",jpfv_number_int(pf->wasted_bytes));
+  jpfv_assoc_add(out,"hit_perc",
+                 jpfv_number(settled?100.0*pf->hit_bytes/settled:0.0));
+  jpfv_assoc_add(out,"failed",jpfv_number_int(pf->failed));
+  jpfv_assoc_add(out,"dropped",jpfv_number_int(pf->dropped));
+  jpfv_assoc_add(out,"latency_us",jpfv_number_int(pf->latency));
+  jpfv_assoc_add(out,"window_peak",jpfv_number_int(pf->window_peak));
+}
@@ -0,0 +1,31 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <inttypes.h>
+#include <event2/event.h>
+
+#include "types.h"
+#include "jpf/jpf.h"
+
+/* Readahead for clients streaming through files. The last few files read
+ * each have a stream which watches for reads following on from one
+ * another, or a constant stride apart. Once a pattern holds, requests
+ * are issued for the reads to come, a window's worth ahead of the reader,
+ * and fill the caches on their way back like any other request. The
+ * window is twice what the reader gets through in the time a prefetch
+ * takes, within limits. Prefetches yield to demand: only a few run at
+ * once, and none start while many demand requests are outstanding.
+ */
+
+struct prefetch;
+
+struct prefetch * pf_new(struct event_base *eb);
+void pf_free(struct prefetch *pf);
+void pf_set_limits(struct prefetch *pf,int max_active,int busy,
+                   int64_t min_window,int64_t max_window,int64_t chunk);
+
+void pf_read(struct prefetch *pf,struct sourcelist *sl,char *spec,
+             int64_t version,int64_t offset,int64_t length);
+void pf_stats(struct prefetch *pf,struct jpf_value *out);
+
+#endif
@@ -6,28 +6,36 @@
 
 #include "util/misc.h"
 #include "util/ranges.h"
+#include "util/buffer.h"
+#include "util/arena.h"
+#include "util/pool.h"
 #include "util/logging.h"
 
 #include "request.h"
 #include "sourcelist.h"
 #include "interface.h"
 #include "source.h"
+#include "writeback.h"
+#include "trace.h"
+#include "slowlog.h"
 
 CONFIG_LOGGING(request)
 
-static void rq_clear_sl(struct request *rq) {
-  if(rq->src) {
-    log_debug(("releasing '%s'",rq->src->name));
-    src_release(rq->src);
-    rq->src = 0;
-  }
-}
+static struct pool request_pool = POOL_INIT(sizeof(struct request));
+static struct pool chunk_pool = POOL_INIT(sizeof(struct chunk));
 
 static void rq_ref_release(void *data) {
   struct request *rq = (struct request *)data;
+  struct chunk *c;
 
   log_debug(("request release"));
-  rq_clear_sl(rq);
+  /* Only left over if the request failed before writing */
+  while(rq->chunks) {
+    c = rq->chunks->next;
+    src_release(rq->chunks->origin);
+    rq_chunk_free(rq->chunks);
+    rq->chunks = c;
+  }
   sl_release(rq->sl);
 }
 
@@ -36,9 +44,15 @@ static void rq_ref_free(void *data) {
 
   log_debug(("request free"));
   ranges_free(&(rq->desired));
-  if(rq->out) { free(rq->out); }
-  free(rq->spec);
-  free(rq);
+  ranges_free(&(rq->owed));
+  if(rq->trace) { trace_free(rq->trace); }
+  if(rq->out_buf) {
+    buffer_release(rq->out_buf);
+  } else if(rq->out) {
+    free(rq->out);
+  }
+  arena_free(&(rq->arena));
+  pool_free(&request_pool,rq);
 }
 
 struct request * rq_create(struct sourcelist *sl,char *spec,int64_t version,
@@ -48,135 +62,182 @@ struct request * rq_create(struct sourcelist *sl,char *spec,int64_t version,
 
   log_info(("creating request spec='%s' offset=%"PRId64"+%"PRId64,
            spec,offset,length));
-  rq = safe_malloc(sizeof(struct request));
+  rq = pool_alloc(&request_pool);
+  arena_init(&(rq->arena));
   ref_create(&(rq->r));
   ref_on_release(&(rq->r),rq_ref_release,rq);
   ref_on_free(&(rq->r),rq_ref_free,rq);
   rq->sl = sl;
-  rq->spec = strdup(spec);
+  rq->spec = arena_strdup(&(rq->arena),spec);
+  rq->route = sl_route(sl,rq->spec);
+  rq->src = 0;
+  rq->src_i = 0;
   rq->version = version;
   rq->out = 0;
+  rq->out_buf = 0;
   rq->chunks = 0;
   rq->failed_errno = 0;
+  rq->state = RQ_READING;
+  rq->driving = rq->again = 0;
+  rq->wb = 0;
   rq->offset = offset;
   rq->length = length;
   rq->done = done;
   rq->priv = priv;
   rq->start = microtime();
+  rq->replied = 0;
+  rq->trace = 0;
+  rq->background = 0;
+  rq->answered = 0;
+  if(sl_get_slowlog(sl)) { rq->trace = trace_new(rq->start); }
   sl_acquire(sl);
   ranges_init(&(rq->desired));
   ranges_add(&(rq->desired),rq->offset,rq->offset+rq->length);
+  ranges_init(&(rq->owed));
+  ranges_add(&(rq->owed),rq->offset,rq->offset+rq->length);
   return rq;
 }
 
 void rq_acquire(struct request *rq) { ref_acquire(&(rq->r)); }
 void rq_release(struct request *rq) { ref_release(&(rq->r)); }
 
-static void rq_reset_sl(struct request *rq) {
-  struct source *next;
+/* Sources are borrowed from the route: the request holds the sourcelist */
+static void next_reader(struct request *rq) {
+  struct route *rt = rq->route;
 
-  next = sl_get_root(rq->sl);
-  if(next) {
-    log_debug(("acquiring '%s' in reset",next->name));
-    src_acquire(next);
-  }
-  rq_clear_sl(rq);
-  rq->src = next;
+  rq->src = 0;
+  if(rq->src_i < rt->n_read) { rq->src = rt->read[rq->src_i++]; }
 }
 
-static void rq_advance_sl(struct request *rq) {
-  struct source *next;
+/* Writers before the chunk's origin in the sourcelist */
+static void next_writer(struct request *rq) {
+  struct route *rt = rq->route;
 
-  next = src_get_next(rq->src);
-  if(next) {
-    log_debug(("acquiring '%s' in advance",next->name));
-    src_acquire(next);
+  rq->src = 0;
+  if(rq->src_i < rt->n_write &&
+     rt->write[rq->src_i]->pos < rq->chunks->origin->pos) {
+    rq->src = rt->write[rq->src_i++];
   }
-  rq_clear_sl(rq);
-  rq->src = next;
 }
 
-static void account_chunks(struct request *rq) {
+static int64_t account_chunks(struct request *rq) {
   struct chunk *c;
+  int64_t bytes = 0;
 
   for(c=rq->chunks;c;c=c->next) {
     src_collect(c->origin,rq->length);
+    bytes += c->length;
   }
+  return bytes;
+}
+
+/* Only allocated here if no chunk was lent in rq_found_data */
+static char * reply_data(struct request *rq) {
+  if(!rq->out) { rq->out = safe_malloc(rq->length); }
+  return rq->out;
 }
 
 static void collect_time(struct request *rq) {
   int64_t taken;
 
   taken = microtime() - rq->start;
-  sl_stat_time(rq->sl,taken);
+  rq->replied = taken;
+  if(rq->trace) { trace_event(rq->trace,"replied"); }
+  if(!rq->background) { sl_stat_time(rq->sl,taken); }
   log_debug(("Request took %"PRId64"ms\n",taken/1000));
 }
 
-// XXX eliminate tail-recursion ehere and elsewhere
-void rq_run_next_write(struct request *rq) {
+/* The interface is answered once, as soon as what it asked for is in.
+ * Sources may still be fetching the rest of desired, for the caches.
+ */
+static void answer(struct request *rq,int failed_errno,char *data) {
+  if(rq->answered) { return; }
+  rq->answered = 1;
+  rq->done(failed_errno,data,rq->priv);
+  collect_time(rq);
+}
+
+/* Requests are driven by rq_drive, which loops calling the step for the
+ * current state. Sources call back into rq_run_next/rq_run_next_write,
+ * often from inside the step which called them. In that case the call
+ * just asks the loop to go round again, so the C stack stays flat however
+ * many sources and chunks a request passes through.
+ */
+
+static void emit_trace(struct request *rq) {
+  struct slowlog *s;
+  struct jpf_value *out;
+
+  s = sl_get_slowlog(rq->sl);
+  trace_event(rq->trace,"finished");
+  if(rq->replied < slowlog_threshold(s)) { return; }
+  out = jpfv_assoc();
+  jpfv_assoc_add(out,"uri",jpfv_string(rq->spec));
+  jpfv_assoc_add(out,"offset",jpfv_number_int(rq->offset));
+  jpfv_assoc_add(out,"length",jpfv_number_int(rq->length));
+  jpfv_assoc_add(out,"errno",jpfv_number_int(rq->failed_errno));
+  jpfv_assoc_add(out,"reply_us",jpfv_number_int(rq->replied));
+  trace_record(rq->trace,out);
+  slowlog_write(s,out);
+}
+
+static void rq_finish(struct request *rq) {
+  rq->src = 0;
+  if(rq->trace) { emit_trace(rq); }
+  rq->state = RQ_FINISHED;
+  if(rq->wb) { wb_finished(rq->wb,rq); }
+  rq_release(rq); /* Taken in rq_run */
+}
+
+static void write_step(struct request *rq) {
   struct chunk *c;
 
   if(!rq->chunks) {
     log_debug(("writing done"));
-    rq_clear_sl(rq); 
-    collect_time(rq);
-    rq_release(rq);
+    rq_finish(rq);
     return;
   }
-  if(!rq->src) {
-    rq_reset_sl(rq);
-  } else {
-    if(rq->p_start) {
-      if(rq->src->write) {
-        src_collect_wtime(rq->src,microtime()-rq->p_start);
-      }
-      rq->p_start = 0;
-    }
-    rq_advance_sl(rq);
+  if(rq->src && rq->p_start) {
+    src_collect_wtime(rq->src,microtime()-rq->p_start);
+    if(rq->trace) { trace_leave(rq->trace); }
+    rq->p_start = 0;
   }
+  next_writer(rq);
   if(rq->src) {
-    if(rq->chunks->origin == rq->src) {
-      log_debug(("reached self so finishing write of this chunk"));
-    } else if(rq->src->write) {
-      c = rq->chunks;
-      log_debug(("running write2 in '%s' on chunk %"PRId64"+%"PRId64,
-                 rq->src->name,c->offset,c->length));
-      rq->p_start = microtime();
-      rq->src->write(rq->src,rq,c);
-      return;
-    } else {
-      log_debug(("source cannot write2"));
-      rq_run_next_write(rq);
-      return;
-    }
+    c = rq->chunks;
+    log_debug(("running write2 in '%s' on chunk %"PRId64"+%"PRId64,
+               rq->src->name,c->offset,c->length));
+    rq->p_start = microtime();
+    if(rq->trace) { trace_enter(rq->trace,rq->src->name,"write",0); }
+    rq->src->write(rq->src,rq,c);
+    return;
   }
-  rq_clear_sl(rq);
+  log_debug(("reached origin so finishing write of this chunk"));
+  rq->src_i = 0;
   c = rq->chunks->next;
   src_release(rq->chunks->origin);
-  free(rq->chunks->out);
-  free(rq->chunks);
+  rq_chunk_free(rq->chunks);
   rq->chunks = c;
   log_debug(("advance chunk"));
-  rq_run_next_write(rq);
+  rq->again = 1;
 }
 
-static void rq_run_writes(struct request *rq) {
-  rq_clear_sl(rq);
-  rq->p_start = 0;
-  rq_run_next_write(rq);
-}
-
-void rq_run_next(struct request *rq) {
+static void read_step(struct request *rq) {
+  struct writeback *wb;
+  int64_t bytes;
   char *c;
  
+  if(rq->src && rq->p_start) {
+    src_collect_rtime(rq->src,microtime()-rq->p_start);
+    if(rq->trace) { trace_leave(rq->trace); }
+    rq->p_start = 0;
+  }
   if(rq->failed_errno) {
     src_set_failed(rq->src,rq->spec);
     if(rq->src) { src_collect_error(rq->src); }
     log_debug(("sending error errno=%d",rq->failed_errno));
-    rq->done(rq->failed_errno,rq->out,rq->priv);
-    rq_clear_sl(rq);
-    collect_time(rq);
-    rq_release(rq);
+    answer(rq,rq->failed_errno,rq->out);
+    rq_finish(rq);
     return;
   }
   if(log_do_debug) {
@@ -189,66 +250,110 @@ void rq_run_next(struct request *rq) {
     log_debug(("reads fulfilled errno=%d",rq->failed_errno));
     if(rq->src) {
       log_info(("satisfied by '%s'",rq->src->name));
-      sl_record_hit(rq->sl,rq->spec,rq->src->name,rq->length);
+      if(!rq->background) {
+        sl_record_hit(rq->sl,rq->spec,rq->src->name,rq->length);
+      }
     }
-    rq->done(rq->failed_errno,rq->out,rq->priv);
-    account_chunks(rq);
-    rq_run_writes(rq);
-    return;
-  }
-  if(!rq->src) {
-    rq_reset_sl(rq);
-  } else {
-    if(rq->p_start) {
-      src_collect_rtime(rq->src,microtime()-rq->p_start);
-      rq->p_start = 0;
+    answer(rq,rq->failed_errno,reply_data(rq));
+    bytes = account_chunks(rq);
+    rq->src = 0;
+    rq->src_i = 0;
+    rq->state = RQ_WRITING;
+    wb = sl_get_writeback(rq->sl);
+    if(wb && rq->chunks) {
+      /* Off the reply path: writeback calls rq_run_writes later */
+      wb_submit(wb,rq,bytes);
+    } else {
+      rq->again = 1;
     }
-    rq_advance_sl(rq);
+    return;
   }
+  next_reader(rq);
   if(rq->src) {
     /* More to do */
-    if(rq->src->read && src_path_ok(rq->src,rq->spec)) {
+    if(src_path_ok(rq->src,rq->spec)) {
       log_debug(("running read2 on next source"));
       rq->p_start = microtime();
+      if(rq->trace) {
+        trace_enter(rq->trace,rq->src->name,"read",&(rq->desired));
+      }
       rq->src->read(rq->src,rq);
     } else {
       log_debug(("next source cannot read2"));
-      rq_run_next(rq);
+      rq->again = 1;
     }
   } else {
     log_debug(("read2 failed"));
     // XXX do something sensible
-    // XXX free chunks
     account_chunks(rq);
-    rq->done(rq->failed_errno||EIO,0,rq->priv);
-    rq_clear_sl(rq);
-    collect_time(rq);
-    rq_release(rq);
+    answer(rq,rq->failed_errno||EIO,0);
+    rq_finish(rq);
   }
 }
 
-void rq_run(struct request *rq) {
+static void rq_drive(struct request *rq) {
+  if(rq->driving) {
+    rq->again = 1;
+    return;
+  }
+  rq_acquire(rq);
+  rq->driving = 1;
+  do {
+    rq->again = 0;
+    switch(rq->state) {
+    case RQ_READING: read_step(rq); break;
+    case RQ_WRITING: write_step(rq); break;
+    case RQ_FINISHED:
+      log_warn(("request driven after it finished"));
+      break;
+    }
+  } while(rq->again);
+  rq->driving = 0;
+  rq_release(rq);
+}
 
-  rq->out = safe_malloc(rq->length);
-  rq->src = 0;
+void rq_run_next(struct request *rq) { rq_drive(rq); }
+void rq_run_next_write(struct request *rq) { rq_drive(rq); }
+
+void rq_run_writes(struct request *rq,struct writeback *wb) {
+  rq->wb = wb;
+  if(rq->trace) { trace_event(rq->trace,"writes_started"); }
+  rq_drive(rq);
+}
+
+/* Written nowhere: the caches just miss out */
+void rq_drop_writes(struct request *rq) {
+  struct chunk *c;
+
+  while(rq->chunks) {
+    c = rq->chunks->next;
+    src_release(rq->chunks->origin);
+    rq_chunk_free(rq->chunks);
+    rq->chunks = c;
+  }
+  rq_finish(rq);
+}
+
+void rq_run(struct request *rq) {
   if(!rq->length) {
-    rq->done(rq->failed_errno,0,rq->priv);
-    collect_time(rq);
+    answer(rq,rq->failed_errno,0);
     return;
   }
   rq->p_start = 0;
+  rq->state = RQ_READING;
   rq_acquire(rq);
-  rq_run_next(rq);
+  rq_drive(rq);
 }
 
-struct chunk * rq_chunk(struct source *sc,char *data,
+struct chunk * rq_chunk(struct source *sc,struct buffer *buf,char *data,
                         int64_t offset,int64_t length,int eof,
                         struct chunk *next) {
   struct chunk *c;
 
-  c = safe_malloc(sizeof(struct chunk));
-  c->out = safe_malloc(length);
-  memcpy(c->out,data,length);
+  c = pool_alloc(&chunk_pool);
+  buffer_acquire(buf);
+  c->buf = buf;
+  c->out = data;
   c->offset = offset;
   c->length = length;
   c->eof = eof;
@@ -257,32 +362,62 @@ struct chunk * rq_chunk(struct source *sc,char *data,
   return c;
 }
 
-void rq_found_data(struct request *rq,struct chunk *c) {
-  struct chunk *d;
+void rq_chunk_free(struct chunk *c) {
+  buffer_release(c->buf);
+  pool_free(&chunk_pool,c);
+}
+
+static void copy_to_reply(struct request *rq,struct chunk *c) {
   struct ranges r;
   struct rangei ri;
   int64_t x,y;
 
+  if(rq->out_buf) { return; } /* Lent chunk already covers it all */
+  if(!rq->out && c->offset <= rq->offset &&
+     c->offset+c->length >= rq->offset+rq->length) {
+    log_debug(("chunk covers reply: lending rather than copying"));
+    rq->out = c->out+rq->offset-c->offset;
+    rq->out_buf = c->buf;
+    buffer_acquire(c->buf);
+    return;
+  }
+  ranges_init(&r);
+  ranges_add(&r,c->offset,c->offset+c->length);
+  ranges_remove(&r,0,rq->offset);
+  ranges_remove(&r,rq->offset+rq->length,INT64_MAX);
+  ranges_start(&r,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    log_debug(("copying range %"PRId64"-%"PRId64,x,y));
+    memcpy(reply_data(rq)+x-rq->offset,c->out+x-c->offset,y-x);
+  }
+  ranges_free(&r);
+}
+
+static void owe_less(struct request *rq,int64_t offset,int64_t length,
+                     int eof) {
+  ranges_remove(&(rq->owed),offset,offset+length);
+  if(eof) { ranges_remove(&(rq->owed),offset+length,INT64_MAX); }
+}
+
+void rq_found_data(struct request *rq,struct chunk *c) {
+  struct chunk *d;
+
   while(c) {
     log_debug(("processing report of data at %"PRId64"+%"PRId64,
               c->offset,c->length));
     /* Help satisfy request */
-    ranges_init(&r);
-    ranges_add(&r,c->offset,c->offset+c->length);
-    ranges_remove(&r,0,rq->offset);
-    ranges_remove(&r,rq->offset+rq->length,INT64_MAX);
-    ranges_start(&r,&ri);
-    while(ranges_next(&ri,&x,&y)) {
-      log_debug(("copying range %"PRId64"-%"PRId64,x,y));
-      memcpy(rq->out+x-rq->offset,c->out+x-c->offset,y-x);
+    if(!rq->answered) { copy_to_reply(rq,c); }
+    if(rq->trace) {
+      trace_note(rq->trace,"chunks",1);
+      trace_note(rq->trace,"found_bytes",c->length);
     }
-    ranges_free(&r);
     ranges_remove(&(rq->desired),c->offset,c->offset+c->length);
     /* Update desire given knoledge of eof */
     if(c->eof) {
       log_debug(("early eof: rest of file does not exist"));
       ranges_remove(&(rq->desired),c->offset+c->length,INT64_MAX);
     }
+    owe_less(rq,c->offset,c->length,c->eof);
     /* Move chunks to request (for later write) */
     src_acquire(c->origin);
     d = c->next;
@@ -290,6 +425,42 @@ void rq_found_data(struct request *rq,struct chunk *c) {
     rq->chunks = c;
     c = d;
   }
+  if(rq->state==RQ_READING && ranges_empty(&(rq->owed))) {
+    answer(rq,0,reply_data(rq));
+  }
+}
+
+/* Data a source has on its way, before the block it's in is complete.
+ * It's only good for the reply: the block comes later via rq_found_data,
+ * for the caches.
+ */
+void rq_found_early(struct request *rq,struct buffer *buf,char *data,
+                    int64_t offset,int64_t length,int eof) {
+  struct chunk c;
+
+  if(rq->answered || rq->state!=RQ_READING) { return; }
+  c.buf = buf;
+  c.out = data;
+  c.offset = offset;
+  c.length = length;
+  copy_to_reply(rq,&c);
+  owe_less(rq,offset,length,eof);
+  if(ranges_empty(&(rq->owed))) {
+    if(rq->trace) { trace_note(rq->trace,"early_reply",1); }
+    answer(rq,0,reply_data(rq));
+  }
+}
+
+/* For sources' per-request state: event thread only, and gone when the
+ * request is freed, so hold a reference for as long as it's needed.
+ */
+void * rq_alloc(struct request *rq,size_t len) {
+  return arena_alloc(&(rq->arena),len);
+}
+
+/* For sources to add detail to the slow log: cheap when it's off */
+void rq_trace_note(struct request *rq,char *key,int64_t n) {
+  if(rq->trace) { trace_note(rq->trace,key,n); }
 }
 
 void rq_error(struct request *rq,int failed_errno) {
@@ -10,11 +10,18 @@ void rq_acquire(struct request *rq);
 void rq_release(struct request *rq);
 void rq_run(struct request *rq);
 void rq_run_next(struct request *rq);
-struct chunk * rq_chunk(struct source *sc,char *data,
+struct chunk * rq_chunk(struct source *sc,struct buffer *buf,char *data,
                         int64_t offset,int64_t length,int eof,
                         struct chunk *next);
+void rq_chunk_free(struct chunk *c);
 void rq_found_data(struct request *rq,struct chunk *c); 
+void rq_found_early(struct request *rq,struct buffer *buf,char *data,
+                    int64_t offset,int64_t length,int eof);
 void rq_run_next_write(struct request *rq);
+void rq_run_writes(struct request *rq,struct writeback *wb);
+void rq_drop_writes(struct request *rq);
 void rq_error(struct request *rq,int failed_errno);
+void * rq_alloc(struct request *rq,size_t len);
+void rq_trace_note(struct request *rq,char *key,int64_t n);
 
 #endif
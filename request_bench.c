@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "types.h"
+#include "request.h"
+#include "source.h"
+#include "sourcelist.h"
+#include "util/misc.h"
+#include "util/buffer.h"
+#include "util/ranges.h"
+#include "util/logging.h"
+
+/* Stress benchmark for the request driver. Pushes multi-megabyte reads
+ * through a sourcelist of four in-memory caches with different block
+ * sizes in front of an origin, so that each read turns into hundreds of
+ * chunks each written back into several tiers. All sources answer
+ * synchronously, which is the worst case for stack depth.
+ *
+ * A few sources for another scheme, and one which cannot read at all,
+ * sit in front: routing should mean requests never visit them.
+ *
+ * Reports CPU time per request, the deepest stack seen in any source
+ * callback (measured from the frame which called sl_read), and the number
+ * of calls to malloc per request.
+ */
+
+#define FILESIZE  (16*1024*1024)
+#define BIGREAD   (4*1024*1024)
+#define SMALLREAD (128*1024)
+#define NREADS    64
+#define NCACHES   4
+#define NOTHERS   4
+
+static int cache_blocks[NCACHES] = { 4096, 16384, 65536, 262144 };
+#define ORIGINBLOCK 65536
+
+/* Count calls into the allocator by interposing on glibc's */
+#ifdef __GLIBC__
+extern void * __libc_malloc(size_t);
+extern void * __libc_calloc(size_t,size_t);
+extern void * __libc_realloc(void *,size_t);
+static int64_t n_mallocs;
+
+void * malloc(size_t n) { n_mallocs++; return __libc_malloc(n); }
+void * calloc(size_t n,size_t m) { n_mallocs++; return __libc_calloc(n,m); }
+void * realloc(void *p,size_t n) { n_mallocs++; return __libc_realloc(p,n); }
+#else
+static int64_t n_mallocs = 0;
+#endif
+
+static char *stack_base;
+static int64_t max_depth,n_chunks;
+static int n_done,n_bad,readsize;
+
+static void note_depth(void) {
+  char here;
+  int64_t depth;
+
+  depth = stack_base-&here;
+  if(depth>max_depth) { max_depth = depth; }
+}
+
+static char pattern(int64_t i) { return (char)((i*31)>>3); }
+
+struct memcache {
+  int block;
+  char *have;
+  char *data;
+};
+
+static void mc_read(struct source *src,struct request *rq) {
+  struct memcache *m = (struct memcache *)(src->priv);
+  struct ranges blocks;
+  struct rangei ri;
+  struct buffer *b;
+  struct chunk *ck;
+  int64_t x,y,bk;
+
+  note_depth();
+  ranges_blockify_expand(&(rq->desired),m->block);
+  ranges_copy(&blocks,&(rq->desired));
+  ranges_start(&blocks,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(bk=x;bk<y;bk+=m->block) {
+      if(!m->have[bk/m->block]) { continue; }
+      b = buffer_view(m->data+bk,m->block,0,0);
+      ck = rq_chunk(src,b,m->data+bk,bk,m->block,0,0);
+      buffer_release(b);
+      rq_found_data(rq,ck);
+      n_chunks++;
+    }
+  }
+  ranges_free(&blocks);
+  rq_run_next(rq);
+}
+
+static void mc_write(struct source *src,struct request *rq,
+                     struct chunk *ck) {
+  struct memcache *m = (struct memcache *)(src->priv);
+  int64_t bk;
+
+  note_depth();
+  for(bk=(ck->offset+m->block-1)/m->block*m->block;
+      bk+m->block<=ck->offset+ck->length;bk+=m->block) {
+    memcpy(m->data+bk,ck->out+bk-ck->offset,m->block);
+    m->have[bk/m->block] = 1;
+  }
+  rq_run_next_write(rq);
+}
+
+static void origin_read(struct source *src,struct request *rq) {
+  struct ranges blocks;
+  struct rangei ri;
+  struct buffer *b;
+  struct chunk *ck;
+  int64_t x,y,i;
+
+  note_depth();
+  ranges_copy(&blocks,&(rq->desired));
+  ranges_blockify_expand(&blocks,ORIGINBLOCK);
+  ranges_start(&blocks,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(;x<y;x+=ORIGINBLOCK) {
+      b = buffer_create(ORIGINBLOCK);
+      for(i=0;i<ORIGINBLOCK;i++) { buffer_data(b)[i] = pattern(x+i); }
+      ck = rq_chunk(src,b,buffer_data(b),x,ORIGINBLOCK,0,0);
+      buffer_release(b);
+      rq_found_data(rq,ck);
+      n_chunks++;
+    }
+  }
+  ranges_free(&blocks);
+  rq_run_next(rq);
+}
+
+/* Never routed a bench:// spec */
+static void other_read(struct source *src,struct request *rq) {
+  if(strncmp(rq->spec,"other://",8)) { n_bad++; }
+  rq_run_next(rq);
+}
+
+static void read_done(int failed_errno,char *data,void *priv) {
+  int64_t offset = *(int64_t *)priv;
+  int64_t i;
+
+  n_done++;
+  if(failed_errno) { n_bad++; return; }
+  for(i=0;i<readsize;i++) {
+    if(data[i]!=pattern(offset+i)) { n_bad++; return; }
+  }
+}
+
+static struct source * add_source(struct sourcelist *sl,char *name,
+                                  int block) {
+  struct source *src;
+  struct memcache *m;
+
+  src = src_create("bench");
+  src_set_name(src,name);
+  if(block) {
+    m = safe_malloc(sizeof(struct memcache));
+    m->block = block;
+    m->have = safe_malloc(FILESIZE/block);
+    memset(m->have,0,FILESIZE/block);
+    m->data = safe_malloc(FILESIZE);
+    src->priv = m;
+    src->read = mc_read;
+    src->write = mc_write;
+  } else {
+    src->priv = 0;
+    src->read = origin_read;
+  }
+  sl_add_src(sl,src);
+  src_release(src);
+  return src;
+}
+
+static void add_others(struct sourcelist *sl) {
+  struct source *src;
+  int i;
+
+  for(i=0;i<NOTHERS;i++) {
+    src = src_create("bench");
+    src->priv = 0;
+    src->read = other_read;
+    src_add_prefix(src,"other://");
+    sl_add_src(sl,src);
+    src_release(src);
+  }
+  src = src_create("bench");
+  src->priv = 0;
+  sl_add_src(sl,src);
+  src_release(src);
+}
+
+static void free_source(struct source *src) {
+  struct memcache *m = (struct memcache *)(src->priv);
+
+  if(!m) { return; }
+  free(m->have);
+  free(m->data);
+  free(m);
+}
+
+static int64_t cputime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+  return ((int64_t)ts.tv_sec)*1000000+ts.tv_nsec/1000;
+}
+
+static void run_reads(struct sourcelist *sl,char *label,int64_t seed,
+                      int size) {
+  char base;
+  int64_t offset,start,taken,mallocs;
+  int i;
+
+  max_depth = n_chunks = 0;
+  n_done = n_bad = 0;
+  taken = 0;
+  stack_base = &base;
+  mallocs = n_mallocs;
+  readsize = size;
+  for(i=0;i<NREADS;i++) {
+    offset = ((i+seed)*7919*4099)%(FILESIZE-size);
+    start = cputime();
+    sl_read(sl,"bench://file",1,offset,size,read_done,&offset);
+    taken += cputime()-start;
+  }
+  mallocs = n_mallocs-mallocs;
+  printf("%-6s reads=%d bad=%d chunks/read=%"PRId64
+         " cpu/read=%"PRId64"us max_stack=%"PRId64"B mallocs/read=%"PRId64"\n",
+         label,n_done,n_bad,n_chunks/NREADS,taken/NREADS,max_depth,
+         mallocs/NREADS);
+}
+
+int main() {
+  struct sourcelist *sl;
+  struct source *srcs[NCACHES+1];
+  char *name;
+  int i;
+
+  log_set_level("",LOG_WARN);
+  logging_fd(2);
+  sl = sl_create();
+  add_others(sl);
+  for(i=0;i<NCACHES;i++) {
+    name = make_string("cache%d",i);
+    srcs[i] = add_source(sl,name,cache_blocks[i]);
+    free(name);
+  }
+  srcs[NCACHES] = add_source(sl,"origin",0);
+  run_reads(sl,"cold",0,BIGREAD);
+  run_reads(sl,"warm",0,BIGREAD);
+  run_reads(sl,"mixed",NREADS/2,BIGREAD);
+  run_reads(sl,"small",NREADS,SMALLREAD);
+  for(i=0;i<NCACHES+1;i++) { free_source(srcs[i]); }
+  sl_release(sl);
+  logging_done();
+  return 0;
+}
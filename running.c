@@ -21,6 +21,8 @@
 #include "source.h"
 #include "interface.h"
 #include "request.h"
+#include "writeback.h"
+#include "prefetch.h"
 #include "sources/http/http.h"
 #include "sources/file2.h"
 #include "sources/cache/file.h"
@@ -39,7 +41,10 @@ static void stat_timer_tick(evutil_socket_t fd,short what,void *arg) {
   struct running *rr = (struct running *)arg;
   struct source *src;
   struct interface *ic;
-  struct jpf_value *out,*out_srcs,*out_src,*out_ics,*out_ic,*out_mem;
+  struct jpf_value *out,*out_srcs,*out_src,*out_ics,*out_ic,*out_mem,*out_wb,*out_sl;
+  struct jpf_value *out_pf;
+  struct writeback *wb;
+  struct prefetch *pf;
   struct jpf_callbacks jpf_emitter_cb;
   struct jpf_emitter jpf_emitter;
   char *time_str;
@@ -68,6 +73,21 @@ static void stat_timer_tick(evutil_socket_t fd,short what,void *arg) {
   free(time_str);
   jpfv_assoc_add(out,"sources",out_srcs);
   jpfv_assoc_add(out,"interfaces",out_ics);
+  out_sl = jpfv_assoc();
+  sl_stats(rr->sl,out_sl);
+  jpfv_assoc_add(out,"requests",out_sl);
+  wb = sl_get_writeback(rr->sl);
+  if(wb) {
+    out_wb = jpfv_assoc();
+    wb_stats(wb,out_wb);
+    jpfv_assoc_add(out,"writeback",out_wb);
+  }
+  pf = sl_get_prefetch(rr->sl);
+  if(pf) {
+    out_pf = jpfv_assoc();
+    pf_stats(pf,out_pf);
+    jpfv_assoc_add(out,"prefetch",out_pf);
+  }
   out_mem = jpfv_important_array(1);
   jpfv_array_add(out_mem,out);
   jpf_emit_fd(&jpf_emitter_cb,&jpf_emitter,rr->stats_fd);
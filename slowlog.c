@@ -0,0 +1,40 @@
+#include "slowlog.h"
+
+#include <inttypes.h>
+
+#include "util/misc.h"
+#include "jpf/jpf.h"
+
+struct slowlog {
+  int fd;
+  int64_t threshold;
+};
+
+struct slowlog * slowlog_new(int fd,int64_t threshold) {
+  struct slowlog *s;
+
+  s = safe_malloc(sizeof(struct slowlog));
+  s->fd = fd;
+  s->threshold = threshold;
+  return s;
+}
+
+void slowlog_free(struct slowlog *s) { free(s); }
+void slowlog_reset_fd(struct slowlog *s,int fd) { s->fd = fd; }
+int64_t slowlog_threshold(struct slowlog *s) { return s->threshold; }
+
+/* Takes ownership of record */
+void slowlog_write(struct slowlog *s,struct jpf_value *record) {
+  struct jpf_value *out;
+  struct jpf_callbacks jpf_emitter_cb;
+  struct jpf_emitter jpf_emitter;
+
+  out = jpfv_important_array(1);
+  jpfv_array_add(out,record);
+  if(s->fd!=-1) {
+    jpf_emit_fd(&jpf_emitter_cb,&jpf_emitter,s->fd);
+    jpf_emit_df(out,&jpf_emitter_cb,&jpf_emitter);
+    jpf_emit_done(&jpf_emitter);
+  }
+  jpfv_free(out);
+}
@@ -0,0 +1,20 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <inttypes.h>
+
+#include "jpf/jpf.h"
+
+/* Requests slower than a threshold, with their traces, one jpf record
+ * each.
+ */
+
+struct slowlog;
+
+struct slowlog * slowlog_new(int fd,int64_t threshold);
+void slowlog_free(struct slowlog *s);
+void slowlog_reset_fd(struct slowlog *s,int fd);
+int64_t slowlog_threshold(struct slowlog *s);
+void slowlog_write(struct slowlog *s,struct jpf_value *record);
+
+#endif
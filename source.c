@@ -8,14 +8,21 @@
 #include "types.h"
 #include "sourcelist.h"
 #include "failures.h"
+#include "inflight.h"
+#include "latency.h"
 
 CONFIG_LOGGING(source)
 
 static void src_ref_free(void *data) {
   struct source * src = (struct source *)data;
+  int i;
 
   log_debug(("source free"));
   sl_release_weak(src->sl);
+  for(i=0;i<src->n_prefixes;i++) { free(src->prefixes[i]); }
+  free(src->prefixes);
+  latency_free(src->r_lat);
+  latency_free(src->w_lat);
   free(src->name);
   free(src);
 }
@@ -28,6 +35,7 @@ static void src_ref_release(void *data) {
   if(src->next) { src->next->prev = src->prev; }
   if(src->close) { src->close(src); }
   if(src->fails) { failures_free(src->fails); }
+  if(src->inflight) { inflight_free(src->inflight); }
 }
 
 void src_open(struct source *src) {
@@ -43,6 +51,7 @@ struct source * src_create(char *type) {
   ref_on_free(&(src->r),src_ref_free,src);
   src->type = type;
   src->fails = 0;
+  src->inflight = 0;
   src->open = 0;
   src->close = 0;
   src->read = 0;
@@ -52,12 +61,19 @@ struct source * src_create(char *type) {
   src->lookup = 0;
   src->readdir = 0;
   src->readlink = 0;
+  src->prefixes = 0;
+  src->n_prefixes = 0;
+  src->pos = 0;
+  src->block = src->block_from = src->block_to = 0;
   src->bytes = 0;
   src->hits = 0;
   src->writes = 0;
   src->name = strdup("anon");
   src->r_time = src->w_time = 0;
   src->errors = 0;
+  src->originated = src->coalesced = 0;
+  src->r_lat = latency_new();
+  src->w_lat = latency_new();
   return src;
 }
 
@@ -66,6 +82,12 @@ void src_set_fails(struct source *src,struct event_base *eb,
   src->fails = failures_new(eb,timeout);
 }
 
+void src_set_inflight(struct source *src) {
+  src->inflight = inflight_new();
+}
+
+struct inflight * src_inflight(struct source *src) { return src->inflight; }
+
 void src_set_name(struct source *src,char *name) {
   free(src->name);
   src->name = strdup(name);
@@ -75,19 +97,52 @@ struct source * src_get_next(struct source *src) {
   return src->next;
 }
 
+/* Call before sl_add_src */
+void src_add_prefix(struct source *src,char *prefix) {
+  src->prefixes = safe_realloc(src->prefixes,
+                               sizeof(char *)*(src->n_prefixes+1));
+  src->prefixes[src->n_prefixes++] = strdup(prefix);
+}
+
+/* Blocks of size block, for offsets in [from,to) */
+void src_set_geometry(struct source *src,int64_t block,
+                      int64_t from,int64_t to) {
+  src->block = block;
+  src->block_from = from;
+  src->block_to = to;
+}
+
+int src_serves(struct source *src,char *spec) {
+  int i;
+
+  if(!src->n_prefixes) { return 1; }
+  for(i=0;i<src->n_prefixes;i++) {
+    if(!strncmp(spec,src->prefixes[i],strlen(src->prefixes[i]))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 void src_collect_rtime(struct source *src,int64_t rtime) {
   src->r_time += rtime;
+  latency_record(src->r_lat,rtime);
   log_debug(("%s: rtime=%"PRId64"us",src->name,src->r_time));
 }
 
 void src_collect_wtime(struct source *src,int64_t wtime) {
   src->w_time += wtime;
+  latency_record(src->w_lat,wtime);
   src->writes++;
   log_debug(("%s: wtime=%"PRId64"us",src->name,src->w_time));
 }
 
 void src_collect_error(struct source *src) { src->errors++; }
 
+void src_collect_fetch(struct source *src,int coalesced) {
+  if(coalesced) { src->coalesced++; } else { src->originated++; }
+}
+
 void src_collect(struct source *src,int64_t length) {
   src->hits++;
   src->bytes += length;
@@ -98,12 +153,26 @@ void src_collect(struct source *src,int64_t length) {
 struct sourcelist * src_sl(struct source *src) { return src->sl; }
 
 void src_global_stats(struct source *src,struct jpf_value *out) {
+  struct jpf_value *v;
+
   jpfv_assoc_add(out,"hits_total",jpfv_number_int(src->hits));
   jpfv_assoc_add(out,"writes_total",jpfv_number_int(src->writes));
   jpfv_assoc_add(out,"bytes_total",jpfv_number_int(src->bytes));
   jpfv_assoc_add(out,"rtime_secs",jpfv_number(src->r_time/1000000.0));
   jpfv_assoc_add(out,"wtime_secs",jpfv_number(src->w_time/1000000.0));
   jpfv_assoc_add(out,"errors_total",jpfv_number_int(src->errors));
+  v = jpfv_assoc();
+  latency_stats(src->r_lat,v);
+  jpfv_assoc_add(out,"rtime_us",v);
+  v = jpfv_assoc();
+  latency_stats(src->w_lat,v);
+  jpfv_assoc_add(out,"wtime_us",v);
+  if(src->inflight) {
+    jpfv_assoc_add(out,"fetches_originated",
+                   jpfv_number_int(src->originated));
+    jpfv_assoc_add(out,"fetches_coalesced",
+                   jpfv_number_int(src->coalesced));
+  }
 }
 
 void src_release(struct source *src) { ref_release(&(src->r)); }
@@ -17,20 +17,28 @@ void src_release(struct source *src);
 void src_acquire(struct source *src);
 struct ref * src_ref(struct source *src);
 void src_set_name(struct source *src,char *name);
+void src_add_prefix(struct source *src,char *prefix);
+void src_set_geometry(struct source *src,int64_t block,
+                      int64_t from,int64_t to);
 
 /* Internal use */
 struct sourcelist * src_sl(struct source *src);
 struct source * src_get_next(struct source *src);
+int src_serves(struct source *src,char *spec);
 void src_collect(struct source *src,int64_t len);
 void src_collect_rtime(struct source *src,int64_t rtime);
 void src_collect_wtime(struct source *src,int64_t wtime);
 void src_collect_error(struct source *src);
+void src_collect_fetch(struct source *src,int coalesced);
 
 void src_global_stats(struct source *src,struct jpf_value *out);
 
 void src_set_fails(struct source *src,struct event_base *eb,
                    int64_t timeout);
 
+void src_set_inflight(struct source *src);
+struct inflight * src_inflight(struct source *src);
+
 int src_path_ok(struct source *src,char *path);
 void src_set_failed(struct source *src,char *path);
 char * src_type(struct source *src);
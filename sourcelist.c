@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
 #include "util/misc.h"
 #include "util/logging.h"
 
@@ -8,14 +9,201 @@
 #include "source.h"
 #include "request.h"
 #include "hits.h"
+#include "writeback.h"
+#include "latency.h"
+#include "slowlog.h"
+#include "prefetch.h"
 
 CONFIG_LOGGING(sourcelist)
 
+/* Requests don't walk every source: each source declares the prefixes of
+ * the specs it can serve and at first use we work out, for each distinct
+ * prefix, which sources can serve it, in order, split into those which
+ * can read and those which can write. A request looks up its chain once,
+ * by longest matching prefix, at creation. Sources with no prefixes (like
+ * the caches) are in every chain. Routes are thrown away whenever sources
+ * are added or opened (opening can change a source's methods) and so
+ * sources mustn't be added once requests are running.
+ *
+ * Each route also has a block geometry so that every source in it splits
+ * a file into the same blocks and what one fetches another can store
+ * whole. Sources with a geometry (the caches) each have a block size over
+ * some stretch of offsets; over each stretch the route uses the lowest
+ * common multiple of the blocks of the sources covering it, or else
+ * whatever the caller asks for.
+ */
+
+static void routes_free(struct sourcelist *sl) {
+  int i;
+
+  for(i=0;i<sl->n_routes;i++) {
+    free(sl->routes[i].prefix);
+    free(sl->routes[i].read);
+    free(sl->routes[i].write);
+    free(sl->routes[i].geom);
+  }
+  free(sl->routes);
+  sl->routes = 0;
+  sl->n_routes = 0;
+}
+
+static void add_route(struct sourcelist *sl,char *prefix) {
+  int i;
+
+  for(i=0;i<sl->n_routes;i++) {
+    if(!strcmp(sl->routes[i].prefix,prefix)) { return; }
+  }
+  sl->routes[sl->n_routes].prefix = strdup(prefix);
+  sl->routes[sl->n_routes].len = strlen(prefix);
+  sl->n_routes++;
+}
+
+static int route_cmp(const void *a,const void *b) {
+  return ((struct route *)b)->len - ((struct route *)a)->len;
+}
+
+static int64_t lcm(int64_t a,int64_t b) {
+  int64_t x,y,t;
+
+  for(x=a,y=b;y;t=x%y,x=y,y=t)
+    ;
+  return a/x*b;
+}
+
+static int int64_cmp(const void *a,const void *b) {
+  int64_t x = *(int64_t *)a, y = *(int64_t *)b;
+
+  return (x>y)-(x<y);
+}
+
+static int covers(struct source *src,int64_t offset) {
+  return src->block && offset>=src->block_from &&
+         (!src->block_to || offset<src->block_to);
+}
+
+static void geom_build(struct route *rt) {
+  int64_t *cuts,block;
+  int i,j,n;
+
+  cuts = safe_malloc(sizeof(int64_t)*(2*rt->n_read+1));
+  n = 0;
+  cuts[n++] = 0;
+  for(i=0;i<rt->n_read;i++) {
+    if(!rt->read[i]->block) { continue; }
+    cuts[n++] = rt->read[i]->block_from;
+    if(rt->read[i]->block_to) { cuts[n++] = rt->read[i]->block_to; }
+  }
+  qsort(cuts,n,sizeof(int64_t),int64_cmp);
+  rt->geom = safe_malloc(sizeof(struct geom)*n);
+  rt->n_geom = 0;
+  for(i=0;i<n;i++) {
+    if(i && cuts[i]==cuts[i-1]) { continue; }
+    block = 0;
+    for(j=0;j<rt->n_read;j++) {
+      if(covers(rt->read[j],cuts[i])) {
+        block = block?lcm(block,rt->read[j]->block):rt->read[j]->block;
+      }
+    }
+    if(rt->n_geom && rt->geom[rt->n_geom-1].block==block) { continue; }
+    rt->geom[rt->n_geom].from = cuts[i];
+    rt->geom[rt->n_geom++].block = block;
+    log_debug(("route '%s': block %"PRId64" from %"PRId64,
+               rt->prefix,block,cuts[i]));
+  }
+  free(cuts);
+}
+
+static void routes_build(struct sourcelist *sl) {
+  struct source *src;
+  struct route *rt;
+  int i,n,n_prefixes;
+
+  n = n_prefixes = 0;
+  for(src=sl->root;src;src=src->next) {
+    src->pos = n++;
+    n_prefixes += src->n_prefixes;
+  }
+  sl->routes = safe_malloc(sizeof(struct route)*(n_prefixes+1));
+  for(src=sl->root;src;src=src->next) {
+    for(i=0;i<src->n_prefixes;i++) { add_route(sl,src->prefixes[i]); }
+  }
+  add_route(sl,"");
+  qsort(sl->routes,sl->n_routes,sizeof(struct route),route_cmp);
+  for(i=0;i<sl->n_routes;i++) {
+    rt = &(sl->routes[i]);
+    rt->read = safe_malloc(sizeof(struct source *)*(n+1));
+    rt->write = safe_malloc(sizeof(struct source *)*(n+1));
+    rt->n_read = rt->n_write = 0;
+    for(src=sl->root;src;src=src->next) {
+      if(!src_serves(src,rt->prefix)) { continue; }
+      if(src->read) { rt->read[rt->n_read++] = src; }
+      if(src->write) { rt->write[rt->n_write++] = src; }
+    }
+    log_debug(("route '%s': %d readers %d writers",
+               rt->prefix,rt->n_read,rt->n_write));
+    geom_build(rt);
+  }
+}
+
+struct route * sl_route(struct sourcelist *sl,char *spec) {
+  int i;
+
+  if(!sl->routes) { routes_build(sl); }
+  for(i=0;i<sl->n_routes-1;i++) {
+    if(!strncmp(spec,sl->routes[i].prefix,sl->routes[i].len)) { break; }
+  }
+  return &(sl->routes[i]);
+}
+
+/* Start of the route's block holding offset. Blocks are aligned to
+ * their size but cut short at the end of their stretch.
+ */
+int64_t sl_block(struct route *rt,int64_t offset,int64_t dflt,int64_t *end) {
+  int64_t block,start;
+  int i;
+
+  for(i=0;i<rt->n_geom-1 && rt->geom[i+1].from<=offset;i++)
+    ;
+  block = rt->geom[i].block?rt->geom[i].block:dflt;
+  start = (offset/block)*block;
+  if(start<rt->geom[i].from) { start = rt->geom[i].from; }
+  *end = start+block;
+  if(i<rt->n_geom-1 && *end>rt->geom[i+1].from) {
+    *end = rt->geom[i+1].from;
+  }
+  return start;
+}
+
+/* Expand to whole blocks of the route's geometry */
+void sl_blockify(struct route *rt,struct ranges *rr,int64_t dflt) {
+  struct ranges out;
+  struct rangei ri;
+  int64_t x,y,start,end;
+
+  if(rt->n_geom==1 && !rt->geom[0].block) {
+    ranges_blockify_expand(rr,dflt);
+    return;
+  }
+  ranges_init(&out);
+  ranges_start(rr,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(end=x;end<y;) {
+      start = sl_block(rt,end,dflt,&end);
+      ranges_add(&out,start,end);
+    }
+  }
+  ranges_free(rr);
+  *rr = out;
+}
+
 static void sl_ref_release(void *data) {
   struct sourcelist *sl = (struct sourcelist *)data;
   struct source *src,*srcn;
 
   log_debug(("sourcelist release"));
+  /* Before the sources go, so nothing queued starts */
+  if(sl->pf) { pf_free(sl->pf); }
+  sl->pf = 0;
   for(src=sl->root;src;src=srcn) {
     srcn = src->next;
     src_release(src);
@@ -29,6 +217,7 @@ void sl_open(struct sourcelist *sl) {
   for(src=sl->root;src;src=src->next) {
     src_open(src);
   }
+  routes_free(sl);
 }
 
 static void sl_ref_free(void *data) {
@@ -36,6 +225,10 @@ static void sl_ref_free(void *data) {
 
   log_debug(("sourcelist free"));
   if(sl->hits) { hits_free(sl->hits); }
+  if(sl->wb) { wb_free(sl->wb); }
+  if(sl->slow) { slowlog_free(sl->slow); }
+  routes_free(sl);
+  latency_free(sl->lat);
   free(sl);
 }
 
@@ -44,8 +237,15 @@ struct sourcelist * sl_create(void) {
 
   sl = safe_malloc(sizeof(struct sourcelist));
   sl->root = 0;
+  sl->routes = 0;
+  sl->n_routes = 0;
   sl->hits = 0;
+  sl->wb = 0;
+  sl->slow = 0;
+  sl->pf = 0;
+  sl->demand = 0;
   sl->bytes = sl->n_hits = sl->time = 0;
+  sl->lat = latency_new();
   ref_create(&(sl->r));
   ref_on_release(&(sl->r),sl_ref_release,sl);
   ref_on_free(&(sl->r),sl_ref_free,sl);
@@ -73,6 +273,7 @@ void sl_add_src(struct sourcelist *sl,struct source *src) {
   *last = src;
   src->prev = last;
   src->next = 0;
+  routes_free(sl);
 }
 
 struct source * sl_find(struct sourcelist *sl,char *name) {
@@ -89,8 +290,11 @@ struct source * sl_find(struct sourcelist *sl,char *name) {
 // XXX lock re modification
 // XXX stat rest
 
+/* At each reply to an interface */
 void sl_stat_time(struct sourcelist *sl,int64_t rtime) {
+  sl->demand--;
   sl->time += rtime;
+  latency_record(sl->lat,rtime);
   log_debug(("requests num=%"PRId64" bytes=%"PRId64" time=%"PRId64"us",
             sl->n_hits,sl->bytes,sl->time));
 }
@@ -102,8 +306,24 @@ void sl_read(struct sourcelist *sl,char *spec,int64_t version,
   rq = rq_create(sl,spec,version,offset,length,done,priv);
   sl->n_hits++;
   sl->bytes += length;
+  sl->demand++;
   rq_run(rq);
   rq_release(rq);
+  /* After, so that demand gets in first */
+  if(sl->pf) { pf_read(sl->pf,sl,spec,version,offset,length); }
+}
+
+int64_t sl_demand(struct sourcelist *sl) { return sl->demand; }
+
+void sl_stats(struct sourcelist *sl,struct jpf_value *out) {
+  struct jpf_value *v;
+
+  jpfv_assoc_add(out,"requests_total",jpfv_number_int(sl->n_hits));
+  jpfv_assoc_add(out,"bytes_total",jpfv_number_int(sl->bytes));
+  jpfv_assoc_add(out,"time_secs",jpfv_number(sl->time/1000000.0));
+  v = jpfv_assoc();
+  latency_stats(sl->lat,v);
+  jpfv_assoc_add(out,"time_us",v);
 }
 
 int sl_stat(struct sourcelist *sl,int inode,struct fuse_stat *fs) {
@@ -147,6 +367,14 @@ void sl_set_hits(struct sourcelist *sl,struct hits *hits) {
   sl->hits = hits;
 }
 
+void sl_set_prefetch(struct sourcelist *sl,struct prefetch *pf) {
+  sl->pf = pf;
+}
+
+struct prefetch * sl_get_prefetch(struct sourcelist *sl) {
+  return sl->pf;
+}
+
 struct hits * sl_get_hits(struct sourcelist *sl) {
   return sl->hits;
 }
@@ -156,3 +384,19 @@ void sl_record_hit(struct sourcelist *sl,char *uri,char *source,
   if(!sl->hits) { return; }
   hit_add(sl->hits,uri,source,bytes);
 }
+
+void sl_set_writeback(struct sourcelist *sl,struct writeback *wb) {
+  sl->wb = wb;
+}
+
+struct writeback * sl_get_writeback(struct sourcelist *sl) {
+  return sl->wb;
+}
+
+void sl_set_slowlog(struct sourcelist *sl,struct slowlog *s) {
+  sl->slow = s;
+}
+
+struct slowlog * sl_get_slowlog(struct sourcelist *sl) {
+  return sl->slow;
+}
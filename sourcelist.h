@@ -26,9 +26,20 @@ struct source * sl_find(struct sourcelist *sl,char *name);
 void sl_acquire_weak(struct sourcelist *sl);
 void sl_release_weak(struct sourcelist *sl);
 struct source * sl_get_root(struct sourcelist *sl);
+struct route * sl_route(struct sourcelist *sl,char *spec);
+int64_t sl_block(struct route *rt,int64_t offset,int64_t dflt,int64_t *end);
+void sl_blockify(struct route *rt,struct ranges *rr,int64_t dflt);
 void sl_stat_time(struct sourcelist *sl,int64_t rtime);
+void sl_stats(struct sourcelist *sl,struct jpf_value *out);
 struct hits * sl_get_hits(struct sourcelist *sl);
 void sl_set_hits(struct sourcelist *sl,struct hits *hits);
+void sl_set_writeback(struct sourcelist *sl,struct writeback *wb);
+struct writeback * sl_get_writeback(struct sourcelist *sl);
+void sl_set_slowlog(struct sourcelist *sl,struct slowlog *s);
+struct slowlog * sl_get_slowlog(struct sourcelist *sl);
+void sl_set_prefetch(struct sourcelist *sl,struct prefetch *pf);
+struct prefetch * sl_get_prefetch(struct sourcelist *sl);
+int64_t sl_demand(struct sourcelist *sl);
 void sl_record_hit(struct sourcelist *sl,char *uri,char *source,
                    int64_t bytes);
 
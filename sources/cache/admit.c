@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "admit.h"
+
+#include "../../util/misc.h"
+#include "../../util/hash.h"
+#include "../../util/logging.h"
+
+CONFIG_LOGGING(admit);
+
+#define DEPTH 4
+#define MAXCOUNT 15
+
+struct admit {
+  uint8_t *rows[DEPTH]; /* two counters a byte */
+  uint64_t width,mask;
+  int64_t added,sample;
+};
+
+struct admit * admit_new(int64_t entries) {
+  struct admit *a;
+  int i;
+
+  a = safe_malloc(sizeof(struct admit));
+  for(a->width=64;a->width<entries;a->width*=2)
+    ;
+  a->mask = a->width-1;
+  for(i=0;i<DEPTH;i++) {
+    a->rows[i] = safe_malloc(a->width/2);
+    memset(a->rows[i],0,a->width/2);
+  }
+  a->added = 0;
+  a->sample = a->width*10;
+  return a;
+}
+
+void admit_free(struct admit *a) {
+  int i;
+
+  for(i=0;i<DEPTH;i++) { free(a->rows[i]); }
+  free(a);
+}
+
+/* Tags are already well mixed: derive the rows' indexes from two words */
+static void indexes(struct admit *a,unsigned char *tag,uint64_t *idx) {
+  uint64_t h0,h1;
+  int i;
+
+  h0 = le64_get(tag);
+  h1 = le64_get(tag+8)|1;
+  for(i=0;i<DEPTH;i++) { idx[i] = (h0+i*h1)&a->mask; }
+}
+
+static int get(uint8_t *row,uint64_t i) {
+  return (row[i/2]>>((i&1)*4))&0xF;
+}
+
+static void halve(struct admit *a) {
+  uint64_t i;
+  int r;
+
+  log_debug(("ageing sketch"));
+  for(r=0;r<DEPTH;r++) {
+    for(i=0;i<a->width/2;i++) { a->rows[r][i] = (a->rows[r][i]>>1)&0x77; }
+  }
+  a->added /= 2;
+}
+
+static int estimate(struct admit *a,uint64_t *idx) {
+  int i,v,min = MAXCOUNT;
+
+  for(i=0;i<DEPTH;i++) {
+    v = get(a->rows[i],idx[i]);
+    if(v<min) { min = v; }
+  }
+  return min;
+}
+
+/* Conservative update: only the smallest counters go up */
+void admit_record(struct admit *a,unsigned char *tag) {
+  uint64_t idx[DEPTH];
+  int i,min;
+
+  indexes(a,tag,idx);
+  min = estimate(a,idx);
+  if(min<MAXCOUNT) {
+    for(i=0;i<DEPTH;i++) {
+      if(get(a->rows[i],idx[i])==min) {
+        a->rows[i][idx[i]/2] += 1<<((idx[i]&1)*4);
+      }
+    }
+  }
+  if(++a->added>=a->sample) { halve(a); }
+}
+
+int admit_estimate(struct admit *a,unsigned char *tag) {
+  uint64_t idx[DEPTH];
+
+  indexes(a,tag,idx);
+  return estimate(a,idx);
+}
+
+int admit_prefer(struct admit *a,unsigned char *tag,unsigned char *victim) {
+  return admit_estimate(a,tag) > admit_estimate(a,victim);
+}
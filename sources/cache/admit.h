@@ -0,0 +1,21 @@
+#ifndef SOURCES_CACHE_ADMIT_H
+#define SOURCES_CACHE_ADMIT_H
+
+#include <stdint.h>
+
+/* TinyLFU-style admission. A count-min sketch of 4-bit counters records
+ * how often each block is asked for, halving every counter after a
+ * sample of accesses ten times the width, so old popularity fades. A new
+ * block is only let in over a victim if it has been asked for more often.
+ * Keys are cache tags (see cache.h).
+ */
+
+struct admit;
+
+struct admit * admit_new(int64_t entries);
+void admit_free(struct admit *a);
+void admit_record(struct admit *a,unsigned char *tag);
+int admit_estimate(struct admit *a,unsigned char *tag);
+int admit_prefer(struct admit *a,unsigned char *tag,unsigned char *victim);
+
+#endif
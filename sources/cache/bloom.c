@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "bloom.h"
+
+#include "../../util/misc.h"
+#include "../../util/hash.h"
+#include "../../util/logging.h"
+
+CONFIG_LOGGING(bloom);
+
+#define PROBES 4
+#define PER_ENTRY 8
+
+struct bloom {
+  uint8_t *counts;
+  uint64_t width,mask;
+};
+
+struct bloom * bloom_new(int64_t entries) {
+  struct bloom *b;
+
+  b = safe_malloc(sizeof(struct bloom));
+  for(b->width=64;b->width<entries*PER_ENTRY;b->width*=2)
+    ;
+  b->mask = b->width-1;
+  b->counts = safe_malloc(b->width);
+  bloom_clear(b);
+  log_debug(("filter of %"PRIu64" counters",b->width));
+  return b;
+}
+
+void bloom_free(struct bloom *b) {
+  free(b->counts);
+  free(b);
+}
+
+void bloom_clear(struct bloom *b) {
+  memset(b->counts,0,b->width);
+}
+
+/* As in admit.c, but rotated so as not to share its indexes */
+static void indexes(struct bloom *b,unsigned char *tag,uint64_t *idx) {
+  uint64_t h0,h1;
+  int i;
+
+  h0 = le64_get(tag);
+  h0 = (h0>>32)|(h0<<32);
+  h1 = le64_get(tag+8)|1;
+  for(i=0;i<PROBES;i++) { idx[i] = (h0+i*h1)&b->mask; }
+}
+
+void bloom_add(struct bloom *b,unsigned char *tag) {
+  uint64_t idx[PROBES];
+  int i;
+
+  indexes(b,tag,idx);
+  for(i=0;i<PROBES;i++) {
+    if(b->counts[idx[i]]<UINT8_MAX) { b->counts[idx[i]]++; }
+  }
+}
+
+void bloom_remove(struct bloom *b,unsigned char *tag) {
+  uint64_t idx[PROBES];
+  int i;
+
+  indexes(b,tag,idx);
+  for(i=0;i<PROBES;i++) {
+    if(b->counts[idx[i]] && b->counts[idx[i]]<UINT8_MAX) {
+      b->counts[idx[i]]--;
+    }
+  }
+}
+
+int bloom_maybe(struct bloom *b,unsigned char *tag) {
+  uint64_t idx[PROBES];
+  int i;
+
+  indexes(b,tag,idx);
+  for(i=0;i<PROBES;i++) {
+    if(!b->counts[idx[i]]) { return 0; }
+  }
+  return 1;
+}
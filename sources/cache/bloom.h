@@ -0,0 +1,22 @@
+#ifndef SOURCES_CACHE_BLOOM_H
+#define SOURCES_CACHE_BLOOM_H
+
+#include <stdint.h>
+
+/* Counting Bloom filter of the tags (see cache.h) resident in a cache,
+ * so that a block which definitely isn't there costs no set probe. About
+ * eight byte counters a slot and four probes give a false positive rate
+ * of around 2.5% when full. A counter which saturates stays put, so
+ * removals never cause false negatives.
+ */
+
+struct bloom;
+
+struct bloom * bloom_new(int64_t entries);
+void bloom_free(struct bloom *b);
+void bloom_clear(struct bloom *b);
+void bloom_add(struct bloom *b,unsigned char *tag);
+void bloom_remove(struct bloom *b,unsigned char *tag);
+int bloom_maybe(struct bloom *b,unsigned char *tag); /* zero if absent */
+
+#endif
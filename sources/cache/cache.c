@@ -9,13 +9,20 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <event2/event.h>
 
 #include "cache.h"
+#include "admit.h"
+#include "io.h"
+#include "spool.h"
+#include "probe.h"
+#include "bloom.h"
 
 #include "../../running.h"
 #include "../../util/misc.h"
 #include "../../util/hash.h"
+#include "../../util/buffer.h"
 #include "../../util/ranges.h"
 #include "../../util/logging.h"
 #include "../../request.h"
@@ -24,13 +31,40 @@
 // XXX del cachefile on exit
 
 // XXX start time to stats
-#define HEADERSIZE(c) ((c)->entries*sizeof(struct header))
-#define BODYSIZE(c)   ((c)->entries*(c)->block_size)
-#define FILESIZE(c) (HEADERSIZE(c)+BODYSIZE(c))
 #define MUTEXREGIONS 16
-#define OFFSET(c,slot) (HEADERSIZE(c)+(slot*(c)->block_size))
 #define MUTEX_FOR(x,c) ((x)*MUTEXREGIONS/c->entries)
 
+#define DEFAULT_SEED 0x2342feed
+#define DEFAULT_IO_THREADS 4
+
+/* Reflection moves blocks to the target a batch at a time, yielding to
+ * the event loop for REFLECT_SLICE between batches. A batch moves at most
+ * a slice's worth of reflect_rate and stops early after REFLECT_BUDGET.
+ * Only slots written since they were last reflected are visited.
+ */
+#define REFLECT_SLICE 100000 /* us */
+#define REFLECT_BUDGET 5000 /* us */
+#define DEFAULT_REFLECT_RATE (32*1024*1024) /* bytes/s */
+
+/* With a spool, writes are appended to it and merged into their slots
+ * later, a batch of at most MERGE_BYTES at a time in set order, so slots
+ * are written in file order. A batch follows on straight away while the
+ * spool is over half full, otherwise every MERGE_SLICE.
+ */
+#define MERGE_SLICE 100000 /* us */
+#define MERGE_BYTES (4*1024*1024)
+#define DEFAULT_SPOOL_SIZE (64*1024*1024)
+#define SPOOL_CHECK 1 /* check admission when merging */
+
+/* A block can live only in the set_size ways of one aligned set. Within
+ * a set, replacement is CLOCK: hits set a slot's reference bit and the
+ * set's hand passes over (clearing) referenced and pinned slots to find
+ * a victim. New blocks go in unreferenced, so one-off blocks go first.
+ * POLICY_RANDOM is the old random way, kept for comparison.
+ */
+#define POLICY_CLOCK  0
+#define POLICY_RANDOM 1
+
 CONFIG_LOGGING(cache);
 
 /* Set target by alpha-smoothing given input xn, sum of n samples */
@@ -53,22 +87,224 @@ static void timer_tick(evutil_socket_t fd, short what, void *arg) {
   log_debug(("current hitrate %"PRId64"%%",c->hit_rate));
 }
 
+static double percent(int64_t n,int64_t of) {
+  return of?100.0*n/of:0.0;
+}
+
 static void cache_stats(struct source *src,struct jpf_value *out) {
   struct cache *c = (struct cache *)(src->priv);
 
   jpfv_assoc_add(out,"lifespan_sec",
                  jpfv_number(((float)c->lifespan)/1000000));
   jpfv_assoc_add(out,"hitrate_perc",jpfv_number(c->hit_rate));
+  jpfv_assoc_add(out,"startup_secs",jpfv_number(c->startup/1000000.0));
+  jpfv_assoc_add(out,"warm_start",jpfv_number_int(c->warm));
+  jpfv_assoc_add(out,"generation",jpfv_number_int(c->generation));
+  jpfv_assoc_add(out,"recovered_slots",jpfv_number_int(c->recovered));
+  jpfv_assoc_add(out,"evictions",jpfv_number_int(c->evictions));
+  jpfv_assoc_add(out,"inplace_writes",jpfv_number_int(c->inplace));
+  jpfv_assoc_add(out,"unwritable",jpfv_number_int(c->unwritable));
+  jpfv_assoc_add(out,"partial_chunks",jpfv_number_int(c->partial));
+  if(c->admit) {
+    jpfv_assoc_add(out,"admitted",jpfv_number_int(c->admitted));
+    jpfv_assoc_add(out,"rejected",jpfv_number_int(c->rejected));
+  }
+  if(c->filter) {
+    /* Of lookups, those settled by the filter; of misses, those it let by */
+    jpfv_assoc_add(out,"filter_negatives",
+                   jpfv_number_int(c->filter_negatives));
+    jpfv_assoc_add(out,"filter_false_positives",
+                   jpfv_number_int(c->filter_false));
+    jpfv_assoc_add(out,"filter_hit_perc",
+                   jpfv_number(percent(c->filter_negatives,
+                                       c->filter_negatives+
+                                       c->filter_positives)));
+    jpfv_assoc_add(out,"filter_fp_perc",
+                   jpfv_number(percent(c->filter_false,
+                                       c->filter_false+
+                                       c->filter_negatives)));
+  }
   if(c->reflected) {
     jpfv_assoc_add(out,"lktime_secs",jpfv_number(c->lk_time/1000000.0));
     jpfv_assoc_add(out,"rftime_secs",jpfv_number(c->rf_time/1000000.0));
     jpfv_assoc_add(out,"reflect_runs",jpfv_number_int(c->rf_runs));
+    jpfv_assoc_add(out,"reflect_slots_per_run",
+                   jpfv_number_int(c->rf_runs?c->rf_slots/c->rf_runs:0));
+    jpfv_assoc_add(out,"reflect_bytes_per_run",
+                   jpfv_number_int(c->rf_runs?c->rf_bytes/c->rf_runs:0));
+  }
+  if(c->reflect) {
+    jpfv_assoc_add(out,"reflect_dirty_slots",jpfv_number_int(c->n_dirty));
   }
+  if(c->spool) {
+    jpfv_assoc_add(out,"spool_blocks",
+                   jpfv_number_int(spool_records(c->spool)));
+    jpfv_assoc_add(out,"spool_unmerged",jpfv_number_int(spool_live(c->spool)));
+    jpfv_assoc_add(out,"spool_appends",jpfv_number_int(c->spool_appends));
+    jpfv_assoc_add(out,"spool_hits",jpfv_number_int(c->spool_hits));
+    jpfv_assoc_add(out,"spool_merged",jpfv_number_int(c->spool_merged));
+    jpfv_assoc_add(out,"spool_merges",jpfv_number_int(c->spool_merges));
+    jpfv_assoc_add(out,"spool_full",jpfv_number_int(c->spool_full));
+  }
+  cio_stats(c->io,out);
   if(c->ops->stats)
     c->ops->stats(c,out,c->priv);
 }
 
 static void reflect_tick(evutil_socket_t fd, short what, void *arg);
+static void reflect_batch(evutil_socket_t fd, short what, void *arg);
+static void merge_tick(evutil_socket_t fd, short what, void *arg);
+
+static void mark_dirty(struct cache *c,int64_t slot) {
+  uint64_t bit = 1ULL<<(slot%64);
+
+  if(!c->dirty || (c->dirty[slot/64]&bit)) { return; }
+  c->dirty[slot/64] |= bit;
+  c->n_dirty++;
+}
+
+static void clear_dirty(struct cache *c,int64_t slot) {
+  uint64_t bit = 1ULL<<(slot%64);
+
+  if(!(c->dirty[slot/64]&bit)) { return; }
+  c->dirty[slot/64] &= ~bit;
+  c->n_dirty--;
+}
+
+/* First dirty slot at or after slot, or -1 */
+static int64_t next_dirty(struct cache *c,int64_t slot) {
+  uint64_t bits;
+  int64_t w;
+
+  for(w=slot/64;w*64<c->entries;w++) {
+    bits = c->dirty[w];
+    if(w==slot/64) { bits &= ~0ULL<<(slot%64); }
+    if(bits) { return w*64+__builtin_ctzll(bits); }
+  }
+  return -1;
+}
+
+static uint64_t super_checksum(struct superblock *sb) {
+  struct hash128 h;
+
+  hash128(sb,offsetof(struct superblock,checksum),0,&h);
+  return h.h[0];
+}
+
+static void super_fill(struct cache *c,struct superblock *sb,int clean) {
+  memcpy(sb->magic,CACHE_MAGIC,sizeof(sb->magic));
+  le64_put(sb->version,CACHE_VERSION);
+  le64_put(sb->header_size,sizeof(struct header));
+  le64_put(sb->block_size,c->block_size);
+  le64_put(sb->entries,c->entries);
+  le64_put(sb->set_size,c->set_size);
+  le64_put(sb->seed,c->seed);
+  le64_put(sb->generation,c->generation);
+  le64_put(sb->clean,clean);
+  le64_put(sb->checksum,super_checksum(sb));
+}
+
+/* Nonzero if sb describes a cache file of this version and shape */
+static int super_valid(struct cache *c,struct superblock *sb) {
+  if(memcmp(sb->magic,CACHE_MAGIC,sizeof(sb->magic))) {
+    log_info(("cache file has no superblock"));
+    return 0;
+  }
+  if(le64_get(sb->version)!=CACHE_VERSION ||
+     le64_get(sb->header_size)!=sizeof(struct header)) {
+    log_warn(("cache file is version %"PRIu64", want %d",
+              le64_get(sb->version),CACHE_VERSION));
+    return 0;
+  }
+  if(le64_get(sb->checksum)!=super_checksum(sb)) {
+    log_warn(("cache superblock is corrupt"));
+    return 0;
+  }
+  if(le64_get(sb->block_size)!=c->block_size ||
+     le64_get(sb->entries)!=c->entries ||
+     le64_get(sb->set_size)!=c->set_size ||
+     le64_get(sb->seed)!=c->seed) {
+    log_warn(("cache file was created with different configuration"));
+    return 0;
+  }
+  return 1;
+}
+
+/* Slots locked when we stopped may hold half-written data */
+static void recover(struct cache *c) {
+  struct header *h;
+  int64_t slot;
+
+  for(slot=0;slot<c->entries;slot++) {
+    c->ops->get_header(&h,c,slot,c->priv);
+    if(!memcmp(h->tag,c->ones,TAGSIZE)) {
+      memset(h->tag,0,TAGSIZE);
+      c->ops->set_header(c,h,slot,c->priv);
+      c->recovered++;
+    }
+    c->ops->header_done(c,h,slot,c->priv);
+  }
+}
+
+/* The in-memory indexes of what's resident */
+static void load_index(struct cache *c) {
+  struct header *h;
+  int64_t slot;
+
+  for(slot=0;slot<c->entries;slot++) {
+    c->ops->get_header(&h,c,slot,c->priv);
+    if(!memcmp(h->tag,c->zeros,TAGSIZE)) {
+      c->fps[slot] = PROBE_EMPTY;
+    } else if(!memcmp(h->tag,c->ones,TAGSIZE)) {
+      c->fps[slot] = PROBE_LOCKED;
+    } else {
+      c->fps[slot] = probe_fp(h->tag);
+      if(c->filter) { bloom_add(c->filter,h->tag); }
+    }
+    c->ops->header_done(c,h,slot,c->priv);
+  }
+}
+
+static void dirty_all(struct cache *c) {
+  struct header *h;
+  int64_t slot;
+
+  for(slot=0;slot<c->entries;slot++) {
+    c->ops->get_header(&h,c,slot,c->priv);
+    if(memcmp(h->tag,c->zeros,TAGSIZE)) { mark_dirty(c,slot); }
+    c->ops->header_done(c,h,slot,c->priv);
+  }
+}
+
+static void cache_start(struct cache *c,char *path,int keep) {
+  struct superblock sb;
+  int64_t start;
+
+  start = microtime();
+  c->ops->get_super(c,&sb,c->priv);
+  c->warm = (keep && super_valid(c,&sb));
+  if(c->warm) {
+    c->generation = le64_get(sb.generation)+1;
+    if(!le64_get(sb.clean)) {
+      log_warn(("cache '%s' was not closed cleanly: recovering",path));
+      recover(c);
+    }
+    if(c->dirty) { dirty_all(c); } /* may have blocks still to reflect */
+    load_index(c);
+  } else {
+    log_info(("emptying cache '%s'",path));
+    c->ops->wipe(c,c->priv);
+    memset(c->fps,0,c->entries*sizeof(uint32_t));
+    if(c->filter) { bloom_clear(c->filter); }
+    c->generation = 1;
+  }
+  super_fill(c,&sb,0);
+  c->ops->set_super(c,&sb,1,c->priv);
+  c->startup = microtime()-start;
+  log_info(("cache '%s' started warm=%d generation=%"PRIu64" recovered=%"
+            PRId64" in %"PRId64"ms",path,c->warm,c->generation,
+            c->recovered,c->startup/1000));
+}
 
 static struct cache * cache_open(struct event_base *eb,
                                  struct jpf_value *conf,
@@ -76,8 +312,10 @@ static struct cache * cache_open(struct event_base *eb,
   struct cache *c;
   struct timeval one_min = { 60, 0 }; // XXX conf
   struct timeval reflect_time = { 5, 0 }; // XXX conf
-  struct jpf_value *path,*rname;
-  int64_t block,entries,set;
+  struct timeval merge_time = { 0, MERGE_SLICE };
+  struct jpf_value *path,*rname,*policy,*spoolfile;
+  int64_t block,entries,set,seed,threads,rate,spool_size,from,to;
+  int admit,keep,filter;
   
   path = jpfv_lookup(conf,"filename");
   if(!path) { die("No path to cachefile specified"); }
@@ -86,21 +324,89 @@ static struct cache * cache_open(struct event_base *eb,
      jpfv_int64(jpfv_lookup(conf,"set_size"),&set)) {
     die("Bad config"); // XXX do it properly when we have schema
   }
+  seed = DEFAULT_SEED;
+  if(jpfv_lookup(conf,"hash_seed") &&
+     jpfv_int64(jpfv_lookup(conf,"hash_seed"),&seed)) {
+    die("Bad hash_seed");
+  }
+  threads = DEFAULT_IO_THREADS;
+  if(jpfv_lookup(conf,"io_threads") &&
+     (jpfv_int64(jpfv_lookup(conf,"io_threads"),&threads) || threads<0)) {
+    die("Bad io_threads");
+  }
+  rate = DEFAULT_REFLECT_RATE;
+  if(jpfv_lookup(conf,"reflect_rate") &&
+     (jpfv_int64(jpfv_lookup(conf,"reflect_rate"),&rate) || rate<1)) {
+    die("Bad reflect_rate");
+  }
+  spool_size = DEFAULT_SPOOL_SIZE;
+  if(jpfv_lookup(conf,"spool_size") &&
+     jpfv_int64(jpfv_lookup(conf,"spool_size"),&spool_size)) {
+    die("Bad spool_size");
+  }
+  /* Caches with different blocks can split a file between them */
+  from = to = 0;
+  if(jpfv_lookup(conf,"min_offset") &&
+     (jpfv_int64(jpfv_lookup(conf,"min_offset"),&from) ||
+      from<0 || from%block)) {
+    die("Bad min_offset");
+  }
+  if(jpfv_lookup(conf,"max_offset") &&
+     (jpfv_int64(jpfv_lookup(conf,"max_offset"),&to) ||
+      to<=from || to%block)) {
+    die("Bad max_offset");
+  }
+  spoolfile = jpfv_lookup(conf,"spoolfile");
+  if(spoolfile && spoolfile->type!=JPFV_STRING) { die("Bad spoolfile"); }
+  if(set<1 || entries<set) { die("Bad set_size"); }
+  admit = jpfv_bool(jpfv_lookup(conf,"admit"));
+  if(admit==-1) { die("Bad admit value"); }
+  keep = jpfv_bool(jpfv_lookup(conf,"keep"));
+  if(keep==-1) { die("Bad keep value"); }
+  filter = jpfv_bool(jpfv_lookup(conf,"filter"));
+  if(filter==-1) { die("Bad filter value"); }
   c = safe_malloc(sizeof(struct cache));
   c->block_size = block;
+  c->min_offset = from;
+  c->max_offset = to;
   c->entries = entries;
   c->set_size = set;
-  c->ones = safe_malloc(HASHSIZE);
-  c->zeros = safe_malloc(HASHSIZE);
-  memset(c->ones,255,HASHSIZE);
-  memset(c->zeros,0,HASHSIZE);
+  c->n_sets = entries/set;
+  c->seed = seed;
+  c->policy = POLICY_CLOCK;
+  policy = jpfv_lookup(conf,"policy");
+  if(policy) {
+    if(policy->type!=JPFV_STRING) { die("Bad cache policy"); }
+    if(!strcmp(policy->v.string,"random")) { c->policy = POLICY_RANDOM; }
+    else if(strcmp(policy->v.string,"clock")) { die("Bad cache policy"); }
+  }
+  c->ones = safe_malloc(TAGSIZE);
+  c->zeros = safe_malloc(TAGSIZE);
+  memset(c->ones,255,TAGSIZE);
+  memset(c->zeros,0,TAGSIZE);
+  c->pins = safe_malloc(entries);
+  memset(c->pins,0,entries);
+  c->refs = safe_malloc(entries);
+  memset(c->refs,0,entries);
+  c->hands = safe_malloc(c->n_sets*sizeof(uint32_t));
+  c->fps = safe_malloc(entries*sizeof(uint32_t));
+  memset(c->hands,0,c->n_sets*sizeof(uint32_t));
+  c->admit = 0;
+  if(admit>0) { c->admit = admit_new(entries); }
+  c->filter = 0;
+  if(filter) { c->filter = bloom_new(entries); } /* on unless !false */
   c->reflect = 0;
   c->reflect_name = 0;
   c->reflected = 0;
-  c->pending = 0;
+  c->dirty = 0;
+  c->n_dirty = 0;
+  c->rf_rate = rate;
+  c->rf_active = 0;
   rname = jpfv_lookup(conf,"reflect");
   if(rname) {
     c->reflect_name = strdup(rname->v.string);
+    c->dirty = safe_malloc((entries+63)/64*sizeof(uint64_t));
+    memset(c->dirty,0,(entries+63)/64*sizeof(uint64_t));
   }
   /* Stats */
   c->lifespan = 0;
@@ -108,257 +414,900 @@ static struct cache * cache_open(struct event_base *eb,
   c->n_lifespan = 0;
   c->hits = c->misses = c->hit_rate = 0;
   c->lk_time = c->rf_time = 0;
-  c->rf_runs = 0;
+  c->evictions = c->inplace = c->unwritable = 0;
+  c->admitted = c->rejected = 0;
+  c->startup = c->recovered = 0;
+  c->rf_runs = c->rf_slots = c->rf_bytes = 0;
+  c->spool_appends = c->spool_hits = c->spool_full = 0;
+  c->partial = 0;
+  c->filter_negatives = c->filter_positives = c->filter_false = 0;
+  c->spool_merged = c->spool_merges = 0;
   /* Timers */
   c->reflect_timer = event_new(eb,-1,EV_PERSIST,reflect_tick,c);
   event_add(c->reflect_timer,&reflect_time);
+  c->reflect_batch = event_new(eb,-1,0,reflect_batch,c);
   c->timer = event_new(eb,-1,EV_PERSIST,timer_tick,c);
   event_add(c->timer,&one_min);
   /* Subtype */
   c->ops = ops;
   c->priv = priv;
   c->ops->open(c,conf,c->priv);
+  c->io = cio_create(eb,c,threads);
+  c->src = 0;
+  c->spool = 0;
+  c->merge_timer = 0;
+  c->merging = 0;
+  c->merge_cursor = 0;
+  if(spoolfile) {
+    c->spool = spool_open(spoolfile->v.string,spool_size,block);
+    c->merge_timer = event_new(eb,-1,EV_PERSIST,merge_tick,c);
+    event_add(c->merge_timer,&merge_time);
+  }
+  /* Kept unless told otherwise, by keep: !false */
+  cache_start(c,path->v.string,keep!=0);
   return c;
 }
 
+static void reflect_end(struct cache *c);
+static void spool_drain(struct cache *c);
+
 static void cache_close(struct cache *c) {
+  struct superblock sb;
+
+  if(c->rf_active) { reflect_end(c); }
   if(c->reflect) { src_release(c->reflect); }
+  super_fill(c,&sb,1);
+  cio_free(c->io);
+  if(c->spool) {
+    spool_drain(c);
+    spool_close(c->spool);
+    event_del(c->merge_timer);
+    event_free(c->merge_timer);
+  }
+  c->ops->set_super(c,&sb,1,c->priv);
   c->ops->close(c,c->priv);
   free(c->ones);
   free(c->zeros);
+  free(c->pins);
+  free(c->refs);
+  free(c->hands);
+  free(c->fps);
+  if(c->admit) { admit_free(c->admit); }
+  if(c->filter) { bloom_free(c->filter); }
   event_del(c->timer);
   event_free(c->timer);
   event_del(c->reflect_timer);
   event_free(c->reflect_timer);
+  event_del(c->reflect_batch);
+  event_free(c->reflect_batch);
+  free(c->dirty);
   free(c);
 }
 
-static struct hash * cache_hash(struct request *rq,int64_t bk) {
-  char *key;
-  struct hash *h;
-  
-  log_debug(("Request offset='%"PRId64"'",bk));
-  key = make_string("%"PRId64":%"PRId64":%s",bk,rq->version,rq->spec);
-  h = make_hash(key);
-  free(key);
-  return h;
+/* Tags are keyed by the cache's seed: caches which reflect into one
+ * another need the same seed. The spec is hashed once per request and
+ * then combined with each block's offset and version, with no formatting.
+ */
+static void spec_hash(struct cache *c,struct request *rq,
+                      struct hash128 *out) {
+  hash128(rq->spec,strlen(rq->spec),c->seed,out);
 }
 
-static int cache_lock(struct cache *c,int slot) {
+/* Returns the hash which picks the set */
+static uint64_t block_tag(struct cache *c,struct hash128 *spec,
+                          struct request *rq,int64_t bk,unsigned char *tag) {
+  unsigned char key[32];
+  struct hash128 h;
+
+  le64_put(key,spec->h[0]);
+  le64_put(key+8,spec->h[1]);
+  le64_put(key+16,bk);
+  le64_put(key+24,rq->version);
+  hash128(key,sizeof(key),c->seed,&h);
+  le64_put(tag,h.h[0]);
+  le64_put(tag+8,h.h[1]);
+  /* Reserved values */
+  if(!memcmp(tag,c->zeros,TAGSIZE) || !memcmp(tag,c->ones,TAGSIZE)) {
+    tag[0] ^= 1;
+  }
+  return h.h[1];
+}
+
+static int64_t set_start(struct cache *c,uint64_t h) {
+  return (h%c->n_sets)*c->set_size;
+}
+
+static int cache_lock(struct cache *c,int64_t slot) {
   struct header *h;
   int ok;
 
+  if(c->pins[slot]) {
+    log_debug(("slot is pinned"));
+    return 0;
+  }
   c->ops->get_header(&h,c,slot,c->priv);
-  ok = memcmp(h->hash,c->ones,HASHSIZE);
+  ok = memcmp(h->tag,c->ones,TAGSIZE);
   if(ok) {
-    if(!memcmp(h->hash,c->zeros,HASHSIZE)) {
+    if(!memcmp(h->tag,c->zeros,TAGSIZE)) {
       log_debug(("slot was empty"));
     } else {
-      log_debug(("slot was used age=%"PRId64,microtime()-h->created));
-      c->cur_lifespan += microtime()-h->created;
+      log_debug(("slot was used age=%"PRId64,
+                 microtime()-le64_get(h->created)));
+      c->cur_lifespan += microtime()-le64_get(h->created);
       c->n_lifespan++;
+      c->evictions++;
+      if(c->filter) { bloom_remove(c->filter,h->tag); }
     }
-    memset(h->hash,255,HASHSIZE);
-    h->created = microtime();
+    memset(h->tag,255,TAGSIZE);
+    le64_put(h->created,microtime());
     c->ops->set_header(c,h,slot,c->priv);
+    c->fps[slot] = PROBE_LOCKED;
   }
   c->ops->header_done(c,h,slot,c->priv);
   return ok; 
 }
 
-static int cache_check_lock(struct cache *c,int slot,struct hash *hh) {
+static int cache_check_lock(struct cache *c,int64_t slot,unsigned char *tag) {
   struct header *h;
   int found;
 
   c->ops->get_header(&h,c,slot,c->priv);
-  found = !hash_cmp(hh,h->hash,HASHSIZE);
+  found = !memcmp(tag,h->tag,TAGSIZE);
   if(found) {
-    memset(h->hash,255,HASHSIZE);
+    if(c->filter) { bloom_remove(c->filter,tag); }
+    memset(h->tag,255,TAGSIZE);
     c->ops->set_header(c,h,slot,c->priv);
+    c->fps[slot] = PROBE_LOCKED;
   }
   c->ops->header_done(c,h,slot,c->priv);
   return found;
 }
 
-static int cache_lock_any(struct cache *c,int slot,struct hash **hh) {
+static int cache_lock_any(struct cache *c,int64_t slot,unsigned char *tag) {
   struct header *h;
 
+  if(c->pins[slot]) { return 0; }
   c->ops->get_header(&h,c,slot,c->priv);
-  if(!memcmp(h->hash,c->zeros,HASHSIZE) ||
-     !memcmp(h->hash,c->ones,HASHSIZE)) {
+  if(!memcmp(h->tag,c->zeros,TAGSIZE) ||
+     !memcmp(h->tag,c->ones,TAGSIZE)) {
     c->ops->header_done(c,h,slot,c->priv);
     return 0;
   }
-  *hh = hash_bin(h->hash,HASHSIZE);
+  memcpy(tag,h->tag,TAGSIZE);
   c->ops->header_done(c,h,slot,c->priv);
   return 1;
 }
 
-static void cache_unlock(struct cache *c,int slot,struct hash *hh) {
+static void cache_unlock(struct cache *c,int64_t slot,unsigned char *tag) {
   struct header *h;
 
   c->ops->get_header(&h,c,slot,c->priv); 
-  memcpy(h->hash,hash_data(hh),hash_len(hh));
+  memcpy(h->tag,tag,TAGSIZE);
   c->ops->set_header(c,h,slot,c->priv);
   c->ops->header_done(c,h,slot,c->priv);
+  c->fps[slot] = probe_fp(tag);
+  if(c->filter) { bloom_add(c->filter,tag); }
+  mark_dirty(c,slot);
 }
 
-static void cache_unlock_empty(struct cache *c,int slot) {
+static void cache_unlock_empty(struct cache *c,int64_t slot) {
   struct header *h;
 
+  c->refs[slot] = 0;
   c->ops->get_header(&h,c,slot,c->priv); 
-  memcpy(h->hash,c->zeros,HASHSIZE);
+  /* Reflected slots aren't locked first, so are still in the filter */
+  if(c->filter && memcmp(h->tag,c->zeros,TAGSIZE) &&
+     memcmp(h->tag,c->ones,TAGSIZE)) {
+    bloom_remove(c->filter,h->tag);
+  }
+  memcpy(h->tag,c->zeros,TAGSIZE);
   c->ops->set_header(c,h,slot,c->priv);
   c->ops->header_done(c,h,slot,c->priv);
+  c->fps[slot] = PROBE_EMPTY;
+}
+
+/* Slot in the set holding tag, or -1. Also the first empty slot */
+/* Fingerprints find the candidates a set at a time, and only those
+ * headers are looked at.
+ */
+static int64_t find_resident(struct cache *c,int64_t base,unsigned char *tag,
+                             int64_t *empty) {
+  struct header *h;
+  uint64_t match;
+  uint32_t fp;
+  int64_t i,n,slot;
+  int found;
+
+  *empty = -1;
+  fp = probe_fp(tag);
+  for(i=0;i<c->set_size;i+=64) {
+    n = c->set_size-i;
+    if(n>64) { n = 64; }
+    match = probe_match(c->fps+base+i,n,fp);
+    while(match) {
+      slot = base+i+__builtin_ctzll(match);
+      match &= match-1;
+      c->ops->get_header(&h,c,slot,c->priv);
+      found = !memcmp(h->tag,tag,TAGSIZE);
+      c->ops->header_done(c,h,slot,c->priv);
+      if(found) { return slot; }
+    }
+    if(*empty<0) {
+      match = probe_match(c->fps+base+i,n,PROBE_EMPTY);
+      if(match) { *empty = base+i+__builtin_ctzll(match); }
+    }
+  }
+  return -1;
 }
 
-static void cache_queue_write(struct cache *c,struct hash *h,
-                              char *data,void *priv) {
-  uint64_t slot;
+static int64_t clock_victim(struct cache *c,int64_t base) {
+  uint32_t *hand;
+  int64_t slot;
+  int i;
 
-  slot = (hash_mod(h,c->entries) + (rand()%c->set_size)) %c->entries;
-  c->pending = 1;
+  hand = c->hands+base/c->set_size;
+  for(i=0;i<2*c->set_size;i++) {
+    slot = base + *hand;
+    *hand = (*hand+1)%c->set_size;
+    if(c->pins[slot]) { continue; }
+    if(c->refs[slot]) { c->refs[slot] = 0; continue; }
+    return slot;
+  }
+  return -1;
+}
+
+/* Whether the block with tag should displace what's in slot */
+static int admitted(struct cache *c,int64_t slot,unsigned char *tag) {
+  unsigned char victim[TAGSIZE];
+  struct header *h;
+
+  c->ops->get_header(&h,c,slot,c->priv);
+  memcpy(victim,h->tag,TAGSIZE);
+  c->ops->header_done(c,h,slot,c->priv);
+  if(!memcmp(victim,c->zeros,TAGSIZE) || !memcmp(victim,c->ones,TAGSIZE) ||
+     admit_prefer(c->admit,tag,victim)) {
+    c->admitted++;
+    return 1;
+  }
+  log_debug(("not admitted over victim at (%"PRId64")",slot));
+  c->rejected++;
+  return 0;
+}
+
+/* The blocks of one request out on the executor. The submitter holds one
+ * count while it queues them, and the request moves on when the last
+ * count goes.
+ */
+struct io_group {
+  struct source *ds;
+  struct request *rq;
+  char *tail; /* padded last block being written, ours to free */
+  int outstanding,writing;
+};
+
+struct block_io {
+  struct io_group *g;
+  int64_t bk;
+  unsigned char tag[TAGSIZE];
+};
+
+static struct io_group * group_new(struct source *ds,struct request *rq,
+                                   int writing) {
+  struct io_group *g;
+
+  g = safe_malloc(sizeof(struct io_group));
+  g->ds = ds;
+  g->rq = rq;
+  g->tail = 0;
+  g->outstanding = 1;
+  g->writing = writing;
+  src_acquire(ds);
+  rq_acquire(rq);
+  return g;
+}
+
+static void group_done(struct io_group *g) {
+  struct source *ds;
+
+  if(--g->outstanding) { return; }
+  if(g->writing) {
+    rq_run_next_write(g->rq);
+  } else {
+    rq_run_next(g->rq);
+  }
+  rq_release(g->rq);
+  ds = g->ds;
+  free(g->tail);
+  free(g);
+  src_release(ds); /* may close the cache */
+}
+
+static void write_done(struct cache *c,int64_t slot,char *data,void *priv) {
+  struct block_io *b = (struct block_io *)priv;
+  struct io_group *g = b->g;
+
+  cache_unlock(c,slot,b->tag);
+  free(b);
+  group_done(g);
+}
+
+/* Slot is locked. Without a group (reflection) it's written there and then */
+static void slot_write(struct cache *c,struct io_group *g,int64_t slot,
+                       unsigned char *tag,char *data) {
+  struct block_io *b;
+
+  if(!g) {
+    c->ops->write_data(c,slot,data,c->priv);
+    cache_unlock(c,slot,tag);
+    return;
+  }
+  b = safe_malloc(sizeof(struct block_io));
+  b->g = g;
+  memcpy(b->tag,tag,TAGSIZE);
+  g->outstanding++;
+  cio_write(c->io,slot,data,write_done,b);
+}
+
+/* Picks and locks the slot for a block, or -1 if it's not to be written.
+ * Reflection doesn't check admission: the blocks were already admitted.
+ */
+static int64_t place_block(struct cache *c,uint64_t hash,unsigned char *tag,
+                           int check) {
+  int64_t base,slot,empty;
+
+  base = set_start(c,hash);
+  if(c->policy==POLICY_RANDOM) {
+    slot = base + rand()%c->set_size;
+  } else {
+    slot = find_resident(c,base,tag,&empty);
+    if(slot>=0) {
+      /* Same key, same data: just refresh it */
+      log_debug(("block already at (%"PRId64")",slot));
+      c->inplace++;
+      c->refs[slot] = 1;
+      if(!c->pins[slot] && cache_check_lock(c,slot,tag)) { return slot; }
+      return -1;
+    }
+    slot = (empty>=0)?empty:clock_victim(c,base);
+    if(slot<0) {
+      log_debug(("whole set pinned"));
+      c->unwritable++;
+      return -1;
+    }
+  }
+  if(check && c->admit && !admitted(c,slot,tag)) { return -1; }
   log_debug(("writing block at (%"PRId64")",slot));
   if(cache_lock(c,slot)) {
-    c->ops->write_data(c,slot,data,c->priv);
-    cache_unlock(c,slot,h);
+    c->refs[slot] = 0;
+    return slot;
+  }
+  c->unwritable++;
+  return -1;
+}
+
+static void cache_queue_write(struct cache *c,struct io_group *g,
+                              uint64_t hash,unsigned char *tag,char *data,
+                              int check) {
+  int64_t slot;
+
+  slot = place_block(c,hash,tag,check);
+  if(slot>=0) { slot_write(c,g,slot,tag,data); }
+}
+
+/* Spool I/O for a request, or for reflection (without a group) */
+struct spool_io {
+  struct io_group *g;
+  int64_t rec,bk;
+  char *data;
+  struct buffer *buf;
+  int failed;
+};
+
+static void appended(struct cache *c,int64_t rec,int failed) {
+  if(failed) {
+    log_error(("cannot write to spool"));
+    spool_merged(c->spool,rec);
+    return;
+  }
+  c->spool_appends++;
+  spool_written(c->spool,rec);
+}
+
+static void append_work(struct cache *c,void *priv) {
+  struct spool_io *s = (struct spool_io *)priv;
+
+  s->failed = spool_write(c->spool,s->rec,s->data);
+}
+
+static void append_done(struct cache *c,int64_t slot,char *data,void *priv) {
+  struct spool_io *s = (struct spool_io *)priv;
+  struct io_group *g = s->g;
+
+  appended(c,s->rec,s->failed);
+  free(s);
+  group_done(g);
+}
+
+/* Zero if the spool has taken (or already has) the block */
+static int spool_block(struct cache *c,struct io_group *g,unsigned char *tag,
+                       char *data,int flags) {
+  struct spool_io *s;
+  int64_t rec;
+
+  if(spool_find(c->spool,tag)>=0) {
+    log_debug(("already spooled"));
+    return 0;
+  }
+  rec = spool_add(c->spool,tag,flags);
+  if(rec<0) {
+    log_debug(("spool full, writing directly"));
+    c->spool_full++;
+    return -1;
+  }
+  if(!g) {
+    appended(c,rec,spool_write(c->spool,rec,data));
+    return 0;
+  }
+  s = safe_malloc(sizeof(struct spool_io));
+  s->g = g;
+  s->rec = rec;
+  s->data = data;
+  g->outstanding++;
+  cio_call(c->io,append_work,append_done,s);
+  return 0;
+}
+
+static void spool_read_work(struct cache *c,void *priv) {
+  struct spool_io *s = (struct spool_io *)priv;
+
+  s->failed = spool_read(c->spool,s->rec,buffer_data(s->buf));
+}
+
+static void found_block(struct io_group *g,struct buffer *b,char *data,
+                        int64_t bk);
+
+static void spool_read_done(struct cache *c,int64_t slot,char *data,
+                            void *priv) {
+  struct spool_io *s = (struct spool_io *)priv;
+  struct io_group *g = s->g;
+
+  spool_unhold(c->spool);
+  if(s->failed) {
+    log_error(("cannot read from spool"));
+    buffer_release(s->buf);
+  } else {
+    found_block(g,s->buf,buffer_data(s->buf),s->bk);
+  }
+  free(s);
+  group_done(g);
+}
+
+static void read_spooled(struct io_group *g,int64_t rec,int64_t bk) {
+  struct cache *c = (struct cache *)(g->ds->priv);
+  struct spool_io *s;
+
+  spool_hold(c->spool);
+  s = safe_malloc(sizeof(struct spool_io));
+  s->g = g;
+  s->rec = rec;
+  s->bk = bk;
+  s->buf = buffer_create(c->block_size);
+  g->outstanding++;
+  cio_call(c->io,spool_read_work,spool_read_done,s);
+}
+
+struct merge {
+  int64_t n;
+  int64_t *recs,*slots;
+  int *failed;
+};
+
+struct merge_key {
+  int64_t set,rec;
+};
+
+static int merge_cmp(const void *a,const void *b) {
+  const struct merge_key *ka = (const struct merge_key *)a;
+  const struct merge_key *kb = (const struct merge_key *)b;
+
+  if(ka->set!=kb->set) { return ka->set<kb->set?-1:1; }
+  return ka->rec<kb->rec?-1:(ka->rec>kb->rec);
+}
+
+static void merge_work(struct cache *c,void *priv) {
+  struct merge *m = (struct merge *)priv;
+  char *buf;
+  int64_t i;
+
+  buf = safe_malloc(c->block_size);
+  for(i=0;i<m->n;i++) {
+    m->failed[i] = spool_read(c->spool,m->recs[i],buf);
+    if(!m->failed[i]) { c->ops->write_data(c,m->slots[i],buf,c->priv); }
+  }
+  free(buf);
+}
+
+static void merge_go(struct cache *c);
+
+static void merge_done(struct cache *c,int64_t slot,char *data,void *priv) {
+  struct merge *m = (struct merge *)priv;
+  struct source *src = c->src;
+  int64_t i;
+
+  for(i=0;i<m->n;i++) {
+    if(m->failed[i]) {
+      log_error(("cannot read from spool"));
+      cache_unlock_empty(c,m->slots[i]);
+    } else {
+      cache_unlock(c,m->slots[i],spool_tag(c->spool,m->recs[i]));
+      c->spool_merged++;
+    }
+    spool_merged(c->spool,m->recs[i]);
+  }
+  log_debug(("merged %"PRId64" blocks, %"PRId64" to go",
+             m->n,spool_live(c->spool)));
+  free(m->recs);
+  free(m->slots);
+  free(m->failed);
+  free(m);
+  c->merging = 0;
+  if(spool_live(c->spool)*2>spool_capacity(c->spool)) { merge_go(c); }
+  src_release(src); /* may close the cache */
+}
+
+/* The next batch up the file from the last, wrapping round */
+static void merge_go(struct cache *c) {
+  struct merge_key *keys;
+  struct merge *m;
+  unsigned char *tag;
+  int64_t n,i,start,max,rec,slot;
+
+  if(c->merging || !spool_live(c->spool)) { return; }
+  keys = safe_malloc(spool_live(c->spool)*sizeof(struct merge_key));
+  n = 0;
+  for(rec=0;rec<spool_records(c->spool);rec++) {
+    if(spool_state(c->spool,rec)!=SPOOL_LIVE) { continue; }
+    keys[n].set = set_start(c,le64_get(spool_tag(c->spool,rec)+8));
+    keys[n++].rec = rec;
+  }
+  qsort(keys,n,sizeof(struct merge_key),merge_cmp);
+  for(start=0;start<n && keys[start].set<c->merge_cursor;start++)
+    ;
+  max = MERGE_BYTES/c->block_size;
+  if(max<1) { max = 1; }
+  if(max>n) { max = n; }
+  m = safe_malloc(sizeof(struct merge));
+  m->recs = safe_malloc(max*sizeof(int64_t));
+  m->slots = safe_malloc(max*sizeof(int64_t));
+  m->failed = safe_malloc(max*sizeof(int));
+  m->n = 0;
+  for(i=0;i<max;i++) {
+    rec = keys[(start+i)%n].rec;
+    c->merge_cursor = keys[(start+i)%n].set+1;
+    tag = spool_tag(c->spool,rec);
+    spool_merging(c->spool,rec);
+    slot = place_block(c,le64_get(tag+8),tag,
+                       spool_flags(c->spool,rec)&SPOOL_CHECK);
+    if(slot<0) {
+      spool_merged(c->spool,rec);
+      continue;
+    }
+    m->recs[m->n] = rec;
+    m->slots[m->n++] = slot;
+  }
+  free(keys);
+  c->merging = 1;
+  c->spool_merges++;
+  src_acquire(c->src);
+  cio_call(c->io,merge_work,merge_done,m);
+}
+
+static void merge_tick(evutil_socket_t fd, short what, void *arg) {
+  merge_go((struct cache *)arg);
+}
+
+/* At close whatever's left is merged there and then */
+static void spool_drain(struct cache *c) {
+  unsigned char *tag;
+  int64_t rec,slot;
+  char *buf;
+
+  if(spool_live(c->spool)) {
+    log_info(("merging %"PRId64" spooled blocks",spool_live(c->spool)));
+  }
+  buf = safe_malloc(c->block_size);
+  for(rec=0;rec<spool_records(c->spool);rec++) {
+    if(spool_state(c->spool,rec)!=SPOOL_LIVE) { continue; }
+    tag = spool_tag(c->spool,rec);
+    spool_merging(c->spool,rec);
+    slot = place_block(c,le64_get(tag+8),tag,
+                       spool_flags(c->spool,rec)&SPOOL_CHECK);
+    if(slot>=0) {
+      if(spool_read(c->spool,rec,buf)) {
+        cache_unlock_empty(c,slot);
+      } else {
+        c->ops->write_data(c,slot,buf,c->priv);
+        cache_unlock(c,slot,tag);
+      }
+    }
+    spool_merged(c->spool,rec);
   }
+  free(buf);
 }
 
-// XXX all writes to async
-static void write_block(struct cache *c,struct request *rq,
-                        char *data,int64_t block) {
-  struct hash *h;
+static void write_block(struct cache *c,struct io_group *g,
+                        struct hash128 *spec,char *data,int64_t block) {
+  unsigned char tag[TAGSIZE];
+  uint64_t home;
+
+  home = block_tag(c,spec,g->rq,block,tag);
+  if(c->spool && !spool_block(c,g,tag,data,SPOOL_CHECK)) { return; }
+  cache_queue_write(c,g,home,tag,data,1);
+}
 
-  h = cache_hash(rq,block);
-  cache_queue_write(c,h,data,c->priv);
-  free_hash(h);
+/* Clip [*x,*y) to the offsets we cache: zero if nothing's left */
+static int clip(struct cache *c,int64_t *x,int64_t *y) {
+  if(*x<c->min_offset) { *x = c->min_offset; }
+  if(c->max_offset && *y>c->max_offset) { *y = c->max_offset; }
+  return *y>*x;
 }
 
+/* The chunk's data is safe until the request moves on, so isn't copied */
 static void ds_write(struct source *ds,struct request *rq,struct chunk *ck) {
   struct cache *c = (struct cache *)(ds->priv);
+  struct io_group *g;
+  struct hash128 spec;
   struct ranges blocks;
   struct rangei ri;
-  int64_t x,y,bk,tail;
-  char *taildata;
+  int64_t x,y,end,bk,tail;
 
   log_debug(("writing chunk at %"PRId64"+%"PRId64,ck->offset,ck->length));
+  x = ck->offset;
+  y = ck->offset+ck->length;
+  if(!clip(c,&x,&y)) {
+    rq_run_next_write(rq);
+    return;
+  }
+  /* Only whole blocks are kept: misfits mean the geometry's wrong */
+  if(x%c->block_size || (y%c->block_size && !ck->eof)) {
+    log_debug(("chunk not on block boundaries"));
+    c->partial++;
+  }
+  end = y; /* the loop below reuses y */
+  g = group_new(ds,rq,1);
+  spec_hash(c,rq,&spec);
   ranges_init(&blocks);
-  ranges_add(&blocks,ck->offset,ck->offset+ck->length);
+  ranges_add(&blocks,x,y);
   ranges_blockify_reduce(&blocks,c->block_size);
   ranges_start(&blocks,&ri);
   while(ranges_next(&ri,&x,&y)) {
     for(bk=x/c->block_size;bk<y/c->block_size;bk++) {
-      write_block(c,rq,ck->out+bk*c->block_size-ck->offset,bk*c->block_size);
+      write_block(c,g,&spec,ck->out+bk*c->block_size-ck->offset,
+                  bk*c->block_size);
     }
   }
-  tail = (ck->offset+ck->length)%c->block_size;
+  tail = end%c->block_size;
   if(ck->eof && tail) {
     /* One last block */
     // XXX prove safe
-    bk = (ck->offset+ck->length)/c->block_size;
-    taildata = safe_malloc(c->block_size);
-    memcpy(taildata,ck->out+bk*c->block_size-ck->offset,tail);
-    memset(taildata+tail,0,c->block_size-tail);
-    write_block(c,rq,taildata,bk*c->block_size);
-    free(taildata);
+    bk = end/c->block_size;
+    g->tail = safe_malloc(c->block_size);
+    memcpy(g->tail,ck->out+bk*c->block_size-ck->offset,tail);
+    memset(g->tail+tail,0,c->block_size-tail);
+    write_block(c,g,&spec,g->tail,bk*c->block_size);
   }
   ranges_free(&blocks);
-  rq_run_next_write(rq);
+  group_done(g);
 }
 
-static void read_block(struct source *ds,struct request *rq,int64_t bk) {
+struct pin {
+  struct source *ds;
+  int64_t slot;
+};
+
+static void unpin_slot(char *data,void *priv) {
+  struct pin *p = (struct pin *)priv;
+  struct cache *c = (struct cache *)(p->ds->priv);
+
+  c->ops->read_done(data,c->priv);
+  c->pins[p->slot]--;
+  src_release(p->ds);
+  free(p);
+}
+
+/* Lend data from a pinned slot to a chunk without copying. While lent,
+ * the slot is not overwritten or reflected, though it can still be read.
+ */
+static struct buffer * lend_slot(struct source *ds,int64_t slot,char *data) {
   struct cache *c = (struct cache *)(ds->priv);
-  struct hash *h;
+  struct pin *p;
+
+  p = safe_malloc(sizeof(struct pin));
+  p->ds = ds;
+  p->slot = slot;
+  src_acquire(ds);
+  return buffer_view(data,c->block_size,unpin_slot,p);
+}
+
+static void found_block(struct io_group *g,struct buffer *b,char *data,
+                        int64_t bk) {
+  struct cache *c = (struct cache *)(g->ds->priv);
   struct chunk *ck;
-  uint64_t slot,i;
+
+  ck = rq_chunk(g->ds,b,data,bk,c->block_size,0,0);
+  buffer_release(b);
+  rq_found_data(g->rq,ck);
+}
+
+static void read_done(struct cache *c,int64_t slot,char *data,void *priv) {
+  struct block_io *b = (struct block_io *)priv;
+  struct io_group *g = b->g;
+
+  found_block(g,lend_slot(g->ds,slot,data),data,b->bk);
+  free(b);
+  group_done(g);
+}
+
+static void read_block(struct io_group *g,struct hash128 *spec,int64_t bk) {
+  struct cache *c = (struct cache *)(g->ds->priv);
+  unsigned char tag[TAGSIZE];
+  struct block_io *b;
+  struct buffer *buf;
+  int64_t slot,base,empty;
   char *data;
 
-  h = cache_hash(rq,bk);
-  slot = hash_mod(h,c->entries);
-  log_debug(("considering block at %"PRId64" (%"PRId64")",bk,slot));
-  for(i=0;i<c->set_size;i++) {
-    if(cache_check_lock(c,slot,h)) {
-      c->ops->read_data(c,slot,&data,c->priv);
-      ck = rq_chunk(ds,data,bk,c->block_size,0,0);
-      rq_found_data(rq,ck);
-      c->ops->read_done(data,c->priv);
-      cache_unlock(c,slot,h);
-      free_hash(h);
-      log_debug(("found in cache"));
-      c->hits++;
-      return; 
+  base = set_start(c,block_tag(c,spec,g->rq,bk,tag));
+  if(c->admit) { admit_record(c->admit,tag); }
+  log_debug(("considering block at %"PRId64" (set %"PRId64")",
+             bk,base/c->set_size));
+  /* Newer than anything in the slots */
+  if(c->spool && (slot=spool_find(c->spool,tag))>=0) {
+    log_debug(("found in spool"));
+    c->hits++;
+    c->spool_hits++;
+    read_spooled(g,slot,bk);
+    return;
+  }
+  if(c->filter) {
+    if(!bloom_maybe(c->filter,tag)) {
+      log_debug(("not in filter"));
+      c->filter_negatives++;
+      c->misses++;
+      return;
     }
-    slot++;
-    slot %= c->entries;
+    c->filter_positives++;
+  }
+  slot = find_resident(c,base,tag,&empty);
+  if(slot<0) {
+    log_debug(("not found in cache"));
+    if(c->filter) { c->filter_false++; }
+    c->misses++;
+    return;
+  }
+  log_debug(("found in cache"));
+  c->hits++;
+  c->refs[slot] = 1;
+  if(c->pins[slot]==UINT8_MAX) {
+    /* Pinned, so it can't change while we read it here */
+    log_debug(("too many pins, copying"));
+    c->ops->read_data(c,slot,&data,c->priv);
+    buf = buffer_create(c->block_size);
+    memcpy(buffer_data(buf),data,c->block_size);
+    c->ops->read_done(data,c->priv);
+    found_block(g,buf,buffer_data(buf),bk);
+    return;
   }
-  free_hash(h);
-  log_debug(("not found in cache"));
-  c->misses++;
+  /* The pin keeps the slot from being reused while the read is out */
+  c->pins[slot]++;
+  b = safe_malloc(sizeof(struct block_io));
+  b->g = g;
+  b->bk = bk;
+  g->outstanding++;
+  cio_read(c->io,slot,read_done,b);
 }
 
 static void ds_read(struct source *ds,struct request *rq) {
   struct cache *c = (struct cache *)(ds->priv);
+  struct io_group *g;
+  struct hash128 spec;
   struct ranges blocks;
   struct rangei ri;
   int64_t x,y,bk;
 
   log_debug(("read spec='%s' version='%"PRId64"'",rq->spec,rq->version));
-  ranges_blockify_expand(&(rq->desired),c->block_size);
+  g = group_new(ds,rq,0);
+  spec_hash(c,rq,&spec);
+  sl_blockify(rq->route,&(rq->desired),c->block_size);
   ranges_copy(&blocks,&(rq->desired)); /* Modified during iter = bad */
   ranges_start(&blocks,&ri);
   while(ranges_next(&ri,&x,&y)) {
+    if(!clip(c,&x,&y)) { continue; }
     log_debug(("Considering range %"PRId64"-%"PRId64,x,y));
-    for(bk=x/c->block_size;bk<y/c->block_size;bk++) {
-      read_block(ds,rq,bk*c->block_size);
+    for(bk=x/c->block_size;bk<(y+c->block_size-1)/c->block_size;bk++) {
+      read_block(g,&spec,bk*c->block_size);
     }
   }
   ranges_free(&blocks);
-  rq_run_next(rq);
+  group_done(g);
 }
 
 static void reflect_to(struct source *src,struct cache *c,
-                       struct hash *h,char *data) {
+                       unsigned char *tag,char *data) {
   int64_t start;
 
   start = microtime();
-  cache_queue_write(c,h,data,c->priv);
+  if(!c->spool || spool_block(c,0,tag,data,0)) {
+    cache_queue_write(c,0,le64_get(tag+8),tag,data,0);
+  }
   src_collect_wtime(src,microtime()-start); 
 }
 
+static void reflect_end(struct cache *c) {
+  struct cache *target = (struct cache *)(c->reflect->priv);
+  int64_t now,now2;
+
+  now = microtime();
+  if(target->ops->unlock) { target->ops->unlock(target,target->priv); }
+  now2 = microtime();
+  target->lk_time += now2 - now;
+  target->rf_time += now2 - c->rf_start;
+  c->rf_active = 0;
+  log_debug(("reflection done, %"PRId64" slots still dirty",c->n_dirty));
+}
+
+static void reflect_batch(evutil_socket_t fd, short what, void *arg) {
+  struct cache *c = (struct cache *)arg;
+  struct cache *target = (struct cache *)(c->reflect->priv);
+  struct timeval slice = { 0, REFLECT_SLICE };
+  unsigned char tag[TAGSIZE];
+  int64_t start,slot,bytes,allowed;
+  char *data;
+
+  start = microtime();
+  allowed = c->rf_rate*REFLECT_SLICE/1000000;
+  for(bytes=0;!bytes || (bytes+c->block_size<=allowed &&
+                         microtime()-start<REFLECT_BUDGET);) {
+    slot = next_dirty(c,c->rf_cursor);
+    if(slot<0) {
+      reflect_end(c);
+      return;
+    }
+    c->rf_cursor = slot+1;
+    if(c->pins[slot]) { continue; } /* lent out: next run */
+    clear_dirty(c,slot);
+    if(!cache_lock_any(c,slot,tag)) { continue; }
+    log_debug(("slot with data for reflection slot=%"PRId64,slot));
+    c->ops->read_data(c,slot,&data,c->priv);
+    reflect_to(c->reflect,target,tag,data);
+    c->ops->read_done(data,c->priv);
+    cache_unlock_empty(c,slot);
+    bytes += c->block_size;
+    target->rf_slots++;
+    target->rf_bytes += c->block_size;
+  }
+  log_debug(("reflected %"PRId64" bytes, yielding",bytes));
+  event_add(c->reflect_batch,&slice);
+}
+
 static void reflect_go(struct cache *c) {
   struct cache *target;
-  uint64_t slot,start,now,now2;
-  struct hash *h;
-  char *data;
+  int64_t start;
 
-  if(!c->reflect || !c->pending) { return; } // XXX
+  if(!c->reflect || c->rf_active || !c->n_dirty) { return; }
   target = (struct cache *)(c->reflect->priv);
   start = microtime();
-  if(target->ops->lock(target,target->priv)) {
+  if(target->ops->lock && target->ops->lock(target,target->priv)) {
     log_debug(("target locked, not reflecting"));
     return;
   }
-  c->pending = 0;
   target->rf_runs++;
   target->lk_time += microtime() - start;
-  for(slot=0;slot<c->entries;slot++) {
-    if(!cache_lock_any(c,slot,&h)) { continue; }
-    log_debug(("slot with data for reflection slot=%"PRId64,slot));
-    c->ops->read_data(c,slot,&data,c->priv);
-    reflect_to(c->reflect,target,h,data);
-    c->ops->read_done(data,c->priv);
-    free_hash(h);
-    cache_unlock_empty(c,slot);
-  }
-  now = microtime();
-  target->ops->unlock(target,target->priv);
-  now2 = microtime();
-  target->lk_time += now2 - now;
-  target->rf_time += now2-start;
+  c->rf_active = 1;
+  c->rf_start = start;
+  c->rf_cursor = 0;
+  reflect_batch(-1,0,c);
 }
 
-
 static void reflect_tick(evutil_socket_t fd, short what, void *arg) {
   struct cache *c = (struct cache *)arg;
 
@@ -384,14 +1333,17 @@ static void ds_open(struct source *ds) {
     log_debug(("Looking to reflect to '%s'",c->reflect_name));
     src = sl_find(src_sl(ds),c->reflect_name);
     if(src) {
-      if(!strcmp(src_type(src),"cache")) {
+      if(strcmp(src_type(src),"cache")) {
+        log_debug(("wrong type!"));
+      } else if(((struct cache *)src->priv)->seed != c->seed) {
+        log_warn(("cannot reflect into '%s': different hash_seed",
+                  c->reflect_name));
+      } else {
         src_acquire(src);
         log_debug(("found it"));
         c->reflect = src;
         reflected(src);
-      } else {
-        log_debug(("wrong type!"));
-      } 
+      }
     } else {
       log_debug(("not found"));
     }
@@ -408,6 +1360,8 @@ struct source * source_cache_make(struct running *rr,
   c = cache_open(rr->eb,conf,ops,priv);
   ds = src_create("cache");
   ds->priv = c;
+  c->src = ds; /* not a reference */
+  src_set_geometry(ds,c->block_size,c->min_offset,c->max_offset);
   ds->open = ds_open;
   ds->read = ds_read;
   ds->write = ds_write;
@@ -415,4 +1369,3 @@ struct source * source_cache_make(struct running *rr,
   ds->stats = cache_stats;
   return ds;
 }
-
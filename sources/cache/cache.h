@@ -1,32 +1,81 @@
 #ifndef SOURCES_CACHE_H
 #define SOURCES_CACHE_H
 
-#define HASHSIZE 64
+#include <stdint.h>
 
 #include "../../util/hash.h"
 #include "../../jpf/jpf.h"
 #include "../../running.h"
 
+/* On disk a cache is a superblock, then a header per slot, then the
+ * slots' data. Everything is little-endian. A header's tag is a keyed
+ * 128-bit hash of the block's key: all zeros means empty, all ones locked.
+ * Bump CACHE_VERSION on any change to the layout.
+ *
+ * The superblock is marked dirty while the cache is open and clean once
+ * it's closed, and carries a generation, bumped at each open, and a
+ * checksum of itself. A cache whose superblock checks out is reused; if
+ * it wasn't closed cleanly, slots left locked are emptied first.
+ */
+
+#define CACHE_MAGIC   "fuse8cch"
+#define CACHE_VERSION 2
+#define TAGSIZE 16
+#define SUPERSIZE 4096
+
 struct header {
-  char hash[HASHSIZE];
-  int64_t created;
+  unsigned char tag[TAGSIZE];
+  unsigned char created[8];
 };
 
+struct superblock {
+  char magic[8];
+  unsigned char version[8],header_size[8],block_size[8];
+  unsigned char entries[8],set_size[8],seed[8];
+  unsigned char generation[8],clean[8];
+  unsigned char checksum[8]; /* last */
+};
+
+#define HEADERSIZE(c) ((c)->entries*sizeof(struct header))
+#define BODYSIZE(c)   ((c)->entries*(c)->block_size)
+#define FILESIZE(c)   (SUPERSIZE+HEADERSIZE(c)+BODYSIZE(c))
+#define HEADER_OFFSET(slot) (SUPERSIZE+(slot)*sizeof(struct header))
+#define OFFSET(c,slot) (SUPERSIZE+HEADERSIZE(c)+(slot)*(c)->block_size)
+
 struct cache {
   struct cache_ops *ops;
   void *priv;
-  struct event *timer,*reflect_timer;
+  struct event *timer,*reflect_timer,*reflect_batch,*merge_timer;
   void *ones,*zeros;
   struct source *reflect;
   char *reflect_name;
-  int pending,reflected;
+  uint8_t *pins; /* slots whose data is lent out: not to be reused */
+  uint8_t *refs; /* CLOCK reference bits, by slot */
+  uint32_t *hands; /* CLOCK hands, by set */
+  uint32_t *fps; /* tag fingerprints, by slot: see probe.h */
+  struct admit *admit; /* optional */
+  struct bloom *filter; /* resident tags; optional */
+  struct cache_io *io; /* block data is read and written here */
+  struct spool *spool; /* optional */
+  struct source *src; /* ours */
+  uint64_t *dirty; /* slots not yet reflected, if reflecting */
+  int64_t n_dirty,rf_cursor,rf_start;
+  int reflected,rf_active,merging;
+  int64_t merge_cursor;
 
   /* config */
-  int64_t block_size,entries,set_size;
+  int64_t block_size,entries,set_size,n_sets,rf_rate;
+  int64_t min_offset,max_offset; /* what's cached of a file; max 0 if all */
+  uint64_t seed,generation;
+  int policy,warm;
 
   /* stats */
   int64_t lifespan,cur_lifespan,n_lifespan,hits,misses,hit_rate;
-  int64_t lk_time,rf_time,rf_runs;
+  int64_t lk_time,rf_time,rf_runs,rf_slots,rf_bytes;
+  int64_t evictions,inplace,unwritable,admitted,rejected;
+  int64_t startup,recovered,partial;
+  int64_t filter_negatives,filter_positives,filter_false;
+  int64_t spool_appends,spool_hits,spool_full,spool_merged,spool_merges;
 };
 
 struct cache_ops {
@@ -34,12 +83,22 @@ struct cache_ops {
   void (*close)(struct cache *c,void *priv);
   int (*lock)(struct cache *c,void *priv);
   void (*unlock)(struct cache *c,void *priv);
-  void (*get_header)(struct header **h,struct cache *c,int slot,void *priv);
-  void (*set_header)(struct cache *c,struct header *h,int slot,void *priv);
-  void (*header_done)(struct cache *c,struct header *h,int slot,void *priv);
-  void (*read_data)(struct cache *c,int slot,char **data,void *priv);
-  void (*write_data)(struct cache *c,int slot,char *data,void *priv);
+  void (*get_header)(struct header **h,struct cache *c,int64_t slot,
+                     void *priv);
+  void (*set_header)(struct cache *c,struct header *h,int64_t slot,
+                     void *priv);
+  void (*header_done)(struct cache *c,struct header *h,int64_t slot,
+                      void *priv);
+  void (*read_data)(struct cache *c,int64_t slot,char **data,void *priv);
+  /* Optional: read_data, but nonzero and nothing read if it would block */
+  int (*read_nowait)(struct cache *c,int64_t slot,char **data,void *priv);
+  void (*write_data)(struct cache *c,int64_t slot,char *data,void *priv);
   void (*read_done)(char *data,void *priv);
+  void (*get_super)(struct cache *c,struct superblock *sb,void *priv);
+  /* If sync, everything before and the superblock itself are durable */
+  void (*set_super)(struct cache *c,struct superblock *sb,int sync,
+                    void *priv);
+  void (*wipe)(struct cache *c,void *priv); /* empty every header */
   void (*stats)(struct cache *c,struct jpf_value *out,void *priv);
 };
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* For preadv2 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <event2/event.h>
@@ -23,81 +26,193 @@
 #include "file.h"
 
 // XXX start time to stats
-#define HEADERSIZE(c) ((c)->entries*sizeof(struct header))
-#define BODYSIZE(c)   ((c)->entries*(c)->block_size)
-#define FILESIZE(c) (HEADERSIZE(c)+BODYSIZE(c))
-#define OFFSET(c,slot) (HEADERSIZE(c)+(slot*(c)->block_size))
-
 CONFIG_LOGGING(cachefile);
 
+/* The header table is held in memory, so probing a set costs no system
+ * calls. Changed headers are marked dirty by page of the table and
+ * written back in batches, when enough pages are dirty or the oldest has
+ * waited long enough, and whenever the superblock is written. The one
+ * ordering that matters is that a slot's locked header reaches the file
+ * before its data is overwritten, so that after a crash old tags never
+ * describe new data: locked headers are written through at once, on the
+ * event loop, before the data is queued. Only one process may use a
+ * cachefile at once, so it is flocked while open.
+ */
+
+#define HPAGE 4096
+#define FLUSH_PAGES 64
+#define FLUSH_AGE 1000000 /* us */
+#define PAGE_OF(slot) (((slot)*sizeof(struct header))/HPAGE)
+
 struct cache_file {
   char *lock;
   int fd;
+  struct header *headers;
+  uint8_t *dirty; /* by page of headers */
+  int64_t n_pages,n_dirty,dirty_since;
 
   /* lock breaking */
   int64_t seen_when;
   char *seen;
+
+  /* stats */
+  int64_t flushes,pages_flushed;
 };
 
-// XXX properly marshalled header
-// XXX slots not int
-static void get_header(struct header **h,struct cache *c,int slot,void *p) {
-  struct cache_file *cf = (struct cache_file *)p;
+static void flush_headers(struct cache *c,struct cache_file *cf) {
+  int64_t p,q,start,len;
 
-  // XXX handle errors
-  *h = malloc(sizeof(struct header));
-  lseek(cf->fd,slot*sizeof(struct header),SEEK_SET);
-  read_all(cf->fd,*(char **)h,sizeof(struct header));
+  if(!cf->n_dirty) { return; }
+  log_debug(("flushing %"PRId64" header pages",cf->n_dirty));
+  for(p=0;p<cf->n_pages;p=q) {
+    if(!cf->dirty[p]) { q = p+1; continue; }
+    for(q=p;q<cf->n_pages && cf->dirty[q];q++) { cf->dirty[q] = 0; }
+    start = p*HPAGE;
+    len = q*HPAGE;
+    if(len>HEADERSIZE(c)) { len = HEADERSIZE(c); }
+    len -= start;
+    if(pwrite_all(cf->fd,((char *)cf->headers)+start,len,SUPERSIZE+start)) {
+      log_error(("cannot write cache headers"));
+    }
+    cf->pages_flushed += q-p;
+  }
+  cf->flushes++;
+  cf->n_dirty = 0;
 }
 
-static void set_header(struct cache *c,struct header *h,int slot,void *p) {
+static void get_header(struct header **h,struct cache *c,int64_t slot,
+                       void *p) {
   struct cache_file *cf = (struct cache_file *)p;
 
-  // XXX handle errors
-  lseek(cf->fd,slot*sizeof(struct header),SEEK_SET);
-  write_all(cf->fd,(char *)h,sizeof(struct header));
+  *h = cf->headers+slot;
 }
 
-static void header_done(struct cache *c,struct header *h,int slot,void *p) {
-  free(h);
+static void set_header(struct cache *c,struct header *h,int64_t slot,
+                       void *p) {
+  struct cache_file *cf = (struct cache_file *)p;
+  int64_t page = PAGE_OF(slot);
+
+  if(!memcmp(h->tag,c->ones,TAGSIZE)) {
+    if(pwrite_all(cf->fd,h,sizeof(struct header),HEADER_OFFSET(slot))) {
+      log_error(("cannot write cache header"));
+    }
+    return;
+  }
+  if(!cf->dirty[page]) {
+    if(!cf->n_dirty) { cf->dirty_since = microtime(); }
+    cf->dirty[page] = 1;
+    cf->n_dirty++;
+  }
+  if(cf->n_dirty>=FLUSH_PAGES || microtime()-cf->dirty_since>FLUSH_AGE) {
+    flush_headers(c,cf);
+  }
 }
 
-static void write_data(struct cache *c,int slot,char *data,void *p) {
+static void header_done(struct cache *c,struct header *h,int64_t slot,
+                        void *p) {}
+
+static void write_data(struct cache *c,int64_t slot,char *data,void *p) {
   struct cache_file *cf = (struct cache_file *)p;
 
   // XXX handle errors
-  lseek(cf->fd,OFFSET(c,slot),SEEK_SET);
-  write_all(cf->fd,data,c->block_size);
+  /* May run on an I/O thread: the locked header is already on file */
+  pwrite_all(cf->fd,data,c->block_size,OFFSET(c,slot));
 }
 
-static void read_data(struct cache *c,int slot,char **data,void *p) {
+static void read_data(struct cache *c,int64_t slot,char **data,void *p) {
   struct cache_file *cf = (struct cache_file *)p;
 
   // XXX handle errors
   *data = safe_malloc(c->block_size);
-  lseek(cf->fd,OFFSET(c,slot),SEEK_SET);
-  read_all(cf->fd,*data,c->block_size);
+  pread_all(cf->fd,*data,c->block_size,OFFSET(c,slot));
+}
+
+static void cf_stats(struct cache *c,struct jpf_value *out,void *p) {
+  struct cache_file *cf = (struct cache_file *)p;
+
+  jpfv_assoc_add(out,"header_flushes",jpfv_number_int(cf->flushes));
+  jpfv_assoc_add(out,"header_pages_flushed",
+                 jpfv_number_int(cf->pages_flushed));
+  jpfv_assoc_add(out,"header_pages_dirty",jpfv_number_int(cf->n_dirty));
+}
+
+/* Only if it's all in the page cache, so needn't leave the event loop */
+static int read_nowait(struct cache *c,int64_t slot,char **data,void *p) {
+#ifdef RWF_NOWAIT
+  struct cache_file *cf = (struct cache_file *)p;
+  struct iovec iov;
+
+  *data = safe_malloc(c->block_size);
+  iov.iov_base = *data;
+  iov.iov_len = c->block_size;
+  if(preadv2(cf->fd,&iov,1,OFFSET(c,slot),RWF_NOWAIT)==c->block_size) {
+    return 0;
+  }
+  free(*data);
+#endif
+  return -1;
 }
 
 static void read_done(char *data,void *priv) {
   free(data);
 }
 
+static void get_super(struct cache *c,struct superblock *sb,void *priv) {
+  struct cache_file *cf = (struct cache_file *)priv;
+
+  memset(sb,0,sizeof(struct superblock));
+  pread_all(cf->fd,sb,sizeof(struct superblock),0);
+}
+
+static void set_super(struct cache *c,struct superblock *sb,int sync,
+                      void *priv) {
+  struct cache_file *cf = (struct cache_file *)priv;
+
+  flush_headers(c,cf);
+  if(sync && fdatasync(cf->fd)<0) { die("Cannot sync cache file"); }
+  if(pwrite_all(cf->fd,sb,sizeof(struct superblock),0)) {
+    die("Cannot write cache superblock");
+  }
+  if(sync && fdatasync(cf->fd)<0) { die("Cannot sync cache file"); }
+}
+
+static void wipe(struct cache *c,void *priv) {
+  struct cache_file *cf = (struct cache_file *)priv;
+
+  if(ftruncate(cf->fd,0)<0 || ftruncate(cf->fd,FILESIZE(c))<0) {
+    die("Cannot empty cache file");
+  }
+  memset(cf->headers,0,HEADERSIZE(c));
+  memset(cf->dirty,0,cf->n_pages);
+  cf->n_dirty = 0;
+}
+
 static void cf_open(struct cache *c,struct jpf_value *conf,void *priv) {
   struct cache_file *cf = (struct cache_file *)priv;
   struct jpf_value *path; 
   struct strbuf lockp;
-  int keep,flags=0;
+  struct stat st;
 
-  keep = jpfv_bool(jpfv_lookup(conf,"keep"));
-  if(keep<=0) { flags = O_TRUNC; }
   path = jpfv_lookup(conf,"filename");
   if(!path) { die("No path to cachefile specified"); }
-  cf->fd = open(path->v.string,O_CREAT|O_RDWR|flags,0666);
+  cf->fd = open(path->v.string,O_CREAT|O_RDWR,0666);
   if(cf->fd<0) { die("Cannot create/open cache file"); }
-  if(keep<=0) {
+  if(flock(cf->fd,LOCK_EX|LOCK_NB)<0) {
+    die("Cache file is in use by another process");
+  }
+  if(fstat(cf->fd,&st)<0) { die("Cannot stat cache file"); }
+  if(st.st_size!=FILESIZE(c)) {
     if(ftruncate(cf->fd,FILESIZE(c))<0) { die("Cannot extend cache file"); }
   }
+  cf->headers = safe_malloc(HEADERSIZE(c));
+  if(pread_all(cf->fd,cf->headers,HEADERSIZE(c),SUPERSIZE)!=HEADERSIZE(c)) {
+    die("Cannot read cache headers");
+  }
+  cf->n_pages = (HEADERSIZE(c)+HPAGE-1)/HPAGE;
+  cf->dirty = safe_malloc(cf->n_pages);
+  memset(cf->dirty,0,cf->n_pages);
+  cf->n_dirty = 0;
+  cf->flushes = cf->pages_flushed = 0;
   strbuf_init(&lockp,0);
   strbuf_add(&lockp,"%s",path->v.string);
   strbuf_add(&lockp,"%s","-lock");
@@ -109,7 +224,10 @@ static void cf_open(struct cache *c,struct jpf_value *conf,void *priv) {
 static void cf_close(struct cache *c,void *priv) {
   struct cache_file *cf = (struct cache_file *)priv;
 
+  flush_headers(c,cf);
   if(close(cf->fd)<0) { die("Cannot close cache file"); }
+  free(cf->headers);
+  free(cf->dirty);
   free(cf->lock);
   free(cf);
 }
@@ -169,9 +287,13 @@ static struct cache_ops ops = {
   .set_header = set_header,
   .header_done = header_done,
   .read_data = read_data,
+  .read_nowait = read_nowait,
   .write_data = write_data,
   .read_done = read_done,
-  .stats = 0,
+  .get_super = get_super,
+  .set_super = set_super,
+  .wipe = wipe,
+  .stats = cf_stats,
   .lock = lock,
   .unlock = unlock,
 };
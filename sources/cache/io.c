@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <event2/event.h>
+
+#include "io.h"
+#include "cache.h"
+
+#include "../../latency.h"
+#include "../../util/misc.h"
+#include "../../util/pool.h"
+#include "../../util/event.h"
+#include "../../util/logging.h"
+
+CONFIG_LOGGING(cacheio);
+
+#define PAGE 4096
+
+enum jtype { J_READ, J_WRITE, J_CALL };
+
+struct job {
+  enum jtype type;
+  int64_t slot;
+  char *data;
+  cio_work_fn work;
+  cio_done_fn done;
+  void *priv;
+  int64_t queued,started,finished;
+};
+
+static struct pool job_pool = POOL_INIT(sizeof(struct job));
+
+struct cache_io {
+  struct cache *c;
+  struct wqueue *qu;
+  struct evdata *ans;
+  pthread_t *threads;
+  int n_threads;
+
+  /* stats */
+  int64_t depth,peak,reads,writes,calls,inline_reads;
+  struct latency *wait,*service;
+};
+
+/* Take any faults now: a cachemmap read only hands back a pointer */
+static void touch(char *data,int64_t len) {
+  volatile char x;
+  int64_t i;
+
+  for(i=0;i<len;i+=PAGE) { x = data[i]; }
+  (void)x;
+}
+
+static void do_job(struct cache_io *io,struct job *j) {
+  struct cache *c = io->c;
+
+  j->started = microtime();
+  switch(j->type) {
+  case J_READ:
+    c->ops->read_data(c,j->slot,&(j->data),c->priv);
+    touch(j->data,c->block_size);
+    break;
+  case J_WRITE:
+    c->ops->write_data(c,j->slot,j->data,c->priv);
+    break;
+  case J_CALL:
+    j->work(c,j->priv);
+    break;
+  }
+  j->finished = microtime();
+}
+
+static void finish(struct cache_io *io,struct job *j) {
+  struct job done;
+
+  io->depth--;
+  latency_record(io->wait,j->started-j->queued);
+  latency_record(io->service,j->finished-j->started);
+  done = *j;
+  pool_free(&job_pool,j);
+  /* May free io, if it drops the last reference to the cache */
+  done.done(io->c,done.slot,done.data,done.priv);
+}
+
+static void * worker(void *data) {
+  struct cache_io *io = (struct cache_io *)data;
+  struct job *j;
+
+  while(1) {
+    j = wqueue_get_work(io->qu);
+    if(wqueue_should_quit(io->qu)) { break; }
+    if(!j) { continue; }
+    do_job(io,j);
+    evdata_send(io->ans,j);
+  }
+  return 0;
+}
+
+static void consume(void *data,void *priv) {
+  finish((struct cache_io *)priv,(struct job *)data);
+}
+
+static void submit(struct cache_io *io,enum jtype type,int64_t slot,
+                   char *data,cio_work_fn work,cio_done_fn done,
+                   void *priv) {
+  struct job *j;
+
+  j = pool_alloc(&job_pool);
+  j->type = type;
+  j->slot = slot;
+  j->data = data;
+  j->work = work;
+  j->done = done;
+  j->priv = priv;
+  j->queued = microtime();
+  io->depth++;
+  if(io->depth>io->peak) { io->peak = io->depth; }
+  if(io->n_threads) {
+    log_debug(("queueing job type %d slot=%"PRId64" depth=%"PRId64,
+               type,slot,io->depth));
+    wqueue_send_work(io->qu,j);
+  } else {
+    do_job(io,j);
+    finish(io,j);
+  }
+}
+
+/* Reads which won't block are quicker done here than handed over */
+void cio_read(struct cache_io *io,int64_t slot,cio_done_fn done,void *priv) {
+  struct cache *c = io->c;
+  char *data;
+
+  io->reads++;
+  if(io->n_threads && c->ops->read_nowait &&
+     !c->ops->read_nowait(c,slot,&data,c->priv)) {
+    io->inline_reads++;
+    done(c,slot,data,priv);
+    return;
+  }
+  submit(io,J_READ,slot,0,0,done,priv);
+}
+
+void cio_write(struct cache_io *io,int64_t slot,char *data,
+               cio_done_fn done,void *priv) {
+  io->writes++;
+  submit(io,J_WRITE,slot,data,0,done,priv);
+}
+
+void cio_call(struct cache_io *io,cio_work_fn work,cio_done_fn done,
+              void *priv) {
+  io->calls++;
+  submit(io,J_CALL,-1,0,work,done,priv);
+}
+
+struct cache_io * cio_create(struct event_base *eb,struct cache *c,
+                             int threads) {
+  struct cache_io *io;
+  pthread_attr_t attr;
+  int i;
+
+  io = safe_malloc(sizeof(struct cache_io));
+  io->c = c;
+  io->n_threads = threads;
+  io->depth = io->peak = io->reads = io->writes = io->calls = 0;
+  io->inline_reads = 0;
+  io->wait = latency_new();
+  io->service = latency_new();
+  io->qu = 0;
+  io->ans = 0;
+  io->threads = 0;
+  if(!threads) { return io; }
+  io->qu = wqueue_create();
+  io->ans = evdata_create(eb,consume,io);
+  event_add(evdata_event(io->ans),0);
+  io->threads = safe_malloc(threads*sizeof(pthread_t));
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_JOINABLE);
+  for(i=0;i<threads;i++) {
+    pthread_create(&(io->threads[i]),&attr,worker,io);
+  }
+  pthread_attr_destroy(&attr);
+  return io;
+}
+
+/* Jobs hold the cache open, so by now there are none */
+void cio_free(struct cache_io *io) {
+  int i;
+
+  if(io->n_threads) {
+    wqueue_acquire_weak(io->qu);
+    wqueue_release(io->qu);
+    for(i=0;i<io->n_threads;i++) {
+      pthread_join(io->threads[i],0);
+    }
+    wqueue_release_weak(io->qu);
+    evdata_release(io->ans);
+    free(io->threads);
+  }
+  latency_free(io->wait);
+  latency_free(io->service);
+  free(io);
+}
+
+void cio_stats(struct cache_io *io,struct jpf_value *out) {
+  struct jpf_value *wait,*service;
+
+  jpfv_assoc_add(out,"io_threads",jpfv_number_int(io->n_threads));
+  jpfv_assoc_add(out,"io_reads",jpfv_number_int(io->reads));
+  jpfv_assoc_add(out,"io_writes",jpfv_number_int(io->writes));
+  jpfv_assoc_add(out,"io_calls",jpfv_number_int(io->calls));
+  jpfv_assoc_add(out,"io_inline_reads",jpfv_number_int(io->inline_reads));
+  jpfv_assoc_add(out,"io_queue_depth",jpfv_number_int(io->depth));
+  jpfv_assoc_add(out,"io_queue_peak",jpfv_number_int(io->peak));
+  wait = jpfv_assoc();
+  latency_stats(io->wait,wait);
+  jpfv_assoc_add(out,"io_wait_us",wait);
+  service = jpfv_assoc();
+  latency_stats(io->service,service);
+  jpfv_assoc_add(out,"io_service_us",service);
+}
@@ -0,0 +1,37 @@
+#ifndef SOURCES_CACHE_IO_H
+#define SOURCES_CACHE_IO_H
+
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "../../jpf/jpf.h"
+
+/* Block data reads and writes for a cache, run on a small pool of threads
+ * so that a slow disk (or a fault on a cachemmap) holds up a thread and
+ * not the event loop. Only the data moves off the loop: slots are pinned
+ * or locked by the caller beforehand, and the callback runs back on the
+ * loop (through an evdata channel) once the job is done. Reads which the
+ * backend can do without blocking (read_nowait) are done there and then,
+ * as is everything when there are no threads: then the callback runs
+ * before cio_read/cio_write return.
+ */
+
+struct cache;
+struct cache_io;
+
+typedef void (*cio_done_fn)(struct cache *c,int64_t slot,char *data,
+                            void *priv);
+typedef void (*cio_work_fn)(struct cache *c,void *priv);
+
+struct cache_io * cio_create(struct event_base *eb,struct cache *c,
+                             int threads);
+void cio_free(struct cache_io *io);
+void cio_read(struct cache_io *io,int64_t slot,cio_done_fn done,void *priv);
+void cio_write(struct cache_io *io,int64_t slot,char *data,
+               cio_done_fn done,void *priv);
+/* Any other I/O: work runs on a thread, then done(c,-1,0,priv) */
+void cio_call(struct cache_io *io,cio_work_fn work,cio_done_fn done,
+              void *priv);
+void cio_stats(struct cache_io *io,struct jpf_value *out);
+
+#endif
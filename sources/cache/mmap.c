@@ -23,11 +23,9 @@
 #include "mmap.h"
 
 // XXX start time to stats
-#define HEADERSIZE(c) ((c)->entries*sizeof(struct header))
-#define BODYSIZE(c)   ((c)->entries*(c)->block_size)
-#define FILESIZE(c) (HEADERSIZE(c)+BODYSIZE(c))
-#define OFFSET(c,slot) (HEADERSIZE(c)+(slot*(c)->block_size))
 #define SLOT(cm,c,slot) ((cm)->data+OFFSET(c,slot))
+#define PAGE 4096
+#define MINCORE_PAGES 64
 
 CONFIG_LOGGING(cachemmap);
 
@@ -36,49 +34,99 @@ struct cache_mmap {
   char *data;
 };
 
-// XXX properly marshalled header
-// XXX slots not int
-static void get_header(struct header **h,struct cache *c,int slot,void *p) {
+static void get_header(struct header **h,struct cache *c,int64_t slot,
+                       void *p) {
   struct cache_mmap *cm = (struct cache_mmap *)p;
 
-  *h = ((struct header *)cm->data)+slot;
+  *h = (struct header *)(cm->data+HEADER_OFFSET(slot));
 }
 
-static void set_header(struct cache *c,struct header *h,int slot,void *p) {}
+static void set_header(struct cache *c,struct header *h,int64_t slot,
+                       void *p) {}
 
-static void header_done(struct cache *c,struct header *h,int slot,void *p) {
+static void header_done(struct cache *c,struct header *h,int64_t slot,
+                        void *p) {
 }
 
-static void write_data(struct cache *c,int slot,char *data,void *p) {
+static void write_data(struct cache *c,int64_t slot,char *data,void *p) {
   struct cache_mmap *cm = (struct cache_mmap *)p;
 
   memcpy(SLOT(cm,c,slot),data,c->block_size);
 }
 
-static void read_data(struct cache *c,int slot,char **data,void *p) {
+static void read_data(struct cache *c,int64_t slot,char **data,void *p) {
   struct cache_mmap *cm = (struct cache_mmap *)p;
 
   *data = SLOT(cm,c,slot);
 }
 
+/* Only if no page of the slot would fault */
+static int read_nowait(struct cache *c,int64_t slot,char **data,void *p) {
+  struct cache_mmap *cm = (struct cache_mmap *)p;
+  unsigned char vec[MINCORE_PAGES];
+  int64_t start,end,len,i;
+
+  start = OFFSET(c,slot)/PAGE*PAGE;
+  end = OFFSET(c,slot)+c->block_size;
+  for(;start<end;start+=len) {
+    len = end-start;
+    if(len>MINCORE_PAGES*PAGE) { len = MINCORE_PAGES*PAGE; }
+    if(mincore(cm->data+start,len,vec)<0) { return -1; }
+    for(i=0;i<(len+PAGE-1)/PAGE;i++) {
+      if(!(vec[i]&1)) { return -1; }
+    }
+  }
+  *data = SLOT(cm,c,slot);
+  return 0;
+}
+
 static void read_done(char *data,void *priv) {}
 
+static void get_super(struct cache *c,struct superblock *sb,void *priv) {
+  struct cache_mmap *cm = (struct cache_mmap *)priv;
+
+  memcpy(sb,cm->data,sizeof(struct superblock));
+}
+
+static void set_super(struct cache *c,struct superblock *sb,int sync,
+                      void *priv) {
+  struct cache_mmap *cm = (struct cache_mmap *)priv;
+
+  if(sync && msync(cm->data,FILESIZE(c),MS_SYNC)<0) {
+    die("Cannot sync cache file");
+  }
+  memcpy(cm->data,sb,sizeof(struct superblock));
+  if(sync && msync(cm->data,SUPERSIZE,MS_SYNC)<0) {
+    die("Cannot sync cache file");
+  }
+}
+
+static void wipe(struct cache *c,void *priv) {
+  struct cache_mmap *cm = (struct cache_mmap *)priv;
+
+  memset(cm->data+SUPERSIZE,0,HEADERSIZE(c));
+}
+
 static void cm_open(struct cache *c,struct jpf_value *conf,void *priv) {
   struct cache_mmap *cm = (struct cache_mmap *)priv;
   struct jpf_value *path;
+  struct stat st;
   int r;
  
   path = jpfv_lookup(conf,"filename");
   if(!path) { die("No path to cachefile specified"); }
-  cm->fd = open(path->v.string,O_CREAT|O_RDWR|O_TRUNC,0666);
+  cm->fd = open(path->v.string,O_CREAT|O_RDWR,0666);
   if(cm->fd<0) { die("Cannot create/open cache file"); }
-  if(ftruncate(cm->fd,FILESIZE(c))<0) { die("Cannot extend cache file"); }
-  log_info(("allocating cache file. Will be slow on old filesystem types"));
-  if((r=posix_fallocate(cm->fd,0,FILESIZE(c)))) {
-    errno = r;
-    die("Cannot fallocate space for cache file");
+  if(fstat(cm->fd,&st)<0) { die("Cannot stat cache file"); }
+  if(st.st_size!=FILESIZE(c)) {
+    if(ftruncate(cm->fd,FILESIZE(c))<0) { die("Cannot extend cache file"); }
+    log_info(("allocating cache file. Will be slow on old filesystem types"));
+    if((r=posix_fallocate(cm->fd,0,FILESIZE(c)))) {
+      errno = r;
+      die("Cannot fallocate space for cache file");
+    }
+    log_info(("cache file allocated"));
   }
-  log_info(("cache file allocated"));
   cm->data = mmap(0,FILESIZE(c),PROT_READ|PROT_WRITE,MAP_SHARED,cm->fd,0);
   log_debug(("mmap %s at %p-%p",
              path->v.string,cm->data,cm->data+FILESIZE(c)));
@@ -88,6 +136,7 @@ static void cm_open(struct cache *c,struct jpf_value *conf,void *priv) {
 static void cm_close(struct cache *c,void *priv) {
   struct cache_mmap *cm = (struct cache_mmap *)priv;
 
+  munmap(cm->data,FILESIZE(c));
   if(close(cm->fd)<0) { die("Cannot close cache file"); }
   free(cm);
 }
@@ -99,8 +148,12 @@ static struct cache_ops ops = {
   .set_header = set_header,
   .header_done = header_done,
   .read_data = read_data,
+  .read_nowait = read_nowait,
   .write_data = write_data,
   .read_done = read_done,
+  .get_super = get_super,
+  .set_super = set_super,
+  .wipe = wipe,
   .stats = 0,
   .lock = 0,
   .unlock = 0,
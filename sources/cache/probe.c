@@ -0,0 +1,47 @@
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "probe.h"
+
+uint32_t probe_fp(const unsigned char *tag) {
+  uint32_t fp;
+
+  fp = (uint32_t)tag[0] | ((uint32_t)tag[1]<<8) |
+       ((uint32_t)tag[2]<<16) | ((uint32_t)tag[3]<<24);
+  if(fp==PROBE_EMPTY || fp==PROBE_LOCKED) { fp ^= 1; }
+  return fp;
+}
+
+uint64_t probe_match(const uint32_t *fps,int n,uint32_t fp) {
+  uint64_t out = 0;
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i want8,v8;
+
+  want8 = _mm256_set1_epi32((int)fp);
+  for(;i+8<=n;i+=8) {
+    v8 = _mm256_loadu_si256((const __m256i *)(fps+i));
+    v8 = _mm256_cmpeq_epi32(v8,want8);
+    out |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(v8))<<i;
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i want4,v4;
+
+  want4 = _mm_set1_epi32((int)fp);
+  for(;i+4<=n;i+=4) {
+    v4 = _mm_loadu_si128((const __m128i *)(fps+i));
+    v4 = _mm_cmpeq_epi32(v4,want4);
+    out |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(v4))<<i;
+  }
+#endif
+  for(;i<n;i++) {
+    if(fps[i]==fp) { out |= UINT64_C(1)<<i; }
+  }
+  return out;
+}
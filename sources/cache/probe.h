@@ -0,0 +1,21 @@
+#ifndef SOURCES_CACHE_PROBE_H
+#define SOURCES_CACHE_PROBE_H
+
+#include <stdint.h>
+
+/* A 32-bit fingerprint of each slot's tag, in slot order, so a set's
+ * worth sit next to each other and can be compared in a few vector
+ * instructions (SSE2, or AVX2 if built with -mavx2) rather than a header
+ * at a time. Matches still need checking against the full tag; an empty
+ * slot is always PROBE_EMPTY and a locked one PROBE_LOCKED, which no tag
+ * maps to.
+ */
+
+#define PROBE_EMPTY  0
+#define PROBE_LOCKED 0xFFFFFFFFU
+
+uint32_t probe_fp(const unsigned char *tag);
+/* Bit i set where fps[i]==fp, for n up to 64 */
+uint64_t probe_match(const uint32_t *fps,int n,uint32_t fp);
+
+#endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "cache.h"
+#include "probe.h"
+
+/* Probe throughput for 8-, 16- and 32-way sets: a walk over each way's
+ * header, as find_resident used to do, against comparing fingerprints
+ * a set at a time and checking only the candidates' headers. Misses are
+ * the case that matters: they look at every way. Hits are in a random
+ * way.
+ *
+ * gcc -std=gnu99 -O2 [-mavx2] -I. sources/cache/probe_bench.c \
+ *     sources/cache/probe.c
+ */
+
+#define SLOTS   (1024*1024)
+#define PROBES  (4*1024*1024)
+
+static struct header *headers;
+static uint32_t *fps;
+static unsigned char (*keys)[TAGSIZE];
+static int64_t *bases;
+
+static uint64_t rnd_state = 88172645463325252ULL;
+static uint64_t rnd(void) {
+  rnd_state ^= rnd_state<<13;
+  rnd_state ^= rnd_state>>7;
+  rnd_state ^= rnd_state<<17;
+  return rnd_state;
+}
+
+static int64_t cputime(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+  return ((int64_t)ts.tv_sec)*1000000000+ts.tv_nsec;
+}
+
+static int64_t walk(int64_t base,int ways,unsigned char *tag) {
+  int64_t slot;
+
+  for(slot=base;slot<base+ways;slot++) {
+    if(!memcmp(headers[slot].tag,tag,TAGSIZE)) { return slot; }
+  }
+  return -1;
+}
+
+static int64_t probe(int64_t base,int ways,unsigned char *tag) {
+  uint64_t match;
+  int64_t slot;
+
+  match = probe_match(fps+base,ways,probe_fp(tag));
+  while(match) {
+    slot = base+__builtin_ctzll(match);
+    match &= match-1;
+    if(!memcmp(headers[slot].tag,tag,TAGSIZE)) { return slot; }
+  }
+  return -1;
+}
+
+static void fill(void) {
+  int64_t slot;
+  int i;
+
+  for(slot=0;slot<SLOTS;slot++) {
+    for(i=0;i<TAGSIZE;i++) { headers[slot].tag[i] = rnd(); }
+    fps[slot] = probe_fp(headers[slot].tag);
+  }
+}
+
+/* Odd probes are for a tag in the set, even ones for a tag not there */
+static void bench(int ways) {
+  int64_t (*fn[2])(int64_t,int,unsigned char *) = { walk, probe };
+  char *names[2] = { "walk", "probe" };
+  int64_t i,start,taken[2][2],found[2];
+  int f,hit;
+
+  for(i=0;i<PROBES;i++) {
+    bases[i] = (rnd()%(SLOTS/ways))*ways;
+    if(i&1) {
+      memcpy(keys[i],headers[bases[i]+rnd()%ways].tag,TAGSIZE);
+    } else {
+      memset(keys[i],0x5a,TAGSIZE);
+      memcpy(keys[i],&i,sizeof(i));
+    }
+  }
+  for(f=0;f<2;f++) {
+    found[f] = 0;
+    for(hit=0;hit<2;hit++) {
+      start = cputime();
+      for(i=hit;i<PROBES;i+=2) {
+        found[f] += (fn[f](bases[i],ways,keys[i])>=0);
+      }
+      taken[f][hit] = cputime()-start;
+    }
+  }
+  for(f=0;f<2;f++) {
+    printf("%2d-way %-5s miss=%5.1fns hit=%5.1fns found=%"PRId64"\n",
+           ways,names[f],(double)taken[f][0]/(PROBES/2),
+           (double)taken[f][1]/(PROBES/2),found[f]);
+  }
+}
+
+int main() {
+  headers = malloc(SLOTS*sizeof(struct header));
+  fps = malloc(SLOTS*sizeof(uint32_t));
+  keys = malloc(PROBES*TAGSIZE);
+  bases = malloc(PROBES*sizeof(int64_t));
+  fill();
+  bench(8);
+  bench(16);
+  bench(32);
+  free(headers);
+  free(fps);
+  free(keys);
+  free(bases);
+  return 0;
+}
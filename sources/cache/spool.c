@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+
+#include "spool.h"
+#include "cache.h"
+
+#include "../../util/misc.h"
+#include "../../util/hash.h"
+#include "../../util/logging.h"
+
+CONFIG_LOGGING(spool);
+
+struct record {
+  unsigned char tag[TAGSIZE];
+  int state,flags,indexed;
+  int64_t next; /* in bucket */
+};
+
+struct spool {
+  int fd;
+  int64_t block_size,max,n,live,busy,holds;
+  struct record *recs;
+  int64_t *buckets;
+  uint64_t mask;
+};
+
+struct spool * spool_open(char *path,int64_t size,int64_t block_size) {
+  struct spool *sp;
+  uint64_t i;
+
+  sp = safe_malloc(sizeof(struct spool));
+  sp->fd = open(path,O_CREAT|O_RDWR|O_TRUNC,0666);
+  if(sp->fd<0) { die("Cannot create/open spool file"); }
+  sp->block_size = block_size;
+  sp->max = size/block_size;
+  if(sp->max<1) { sp->max = 1; }
+  sp->n = sp->live = sp->busy = sp->holds = 0;
+  sp->recs = safe_malloc(sp->max*sizeof(struct record));
+  for(sp->mask=63;sp->mask<sp->max;sp->mask=sp->mask*2+1)
+    ;
+  sp->buckets = safe_malloc((sp->mask+1)*sizeof(int64_t));
+  for(i=0;i<=sp->mask;i++) { sp->buckets[i] = -1; }
+  log_info(("spool '%s' holds %"PRId64" blocks",path,sp->max));
+  return sp;
+}
+
+void spool_close(struct spool *sp) {
+  if(ftruncate(sp->fd,0)<0) { log_warn(("Cannot empty spool file")); }
+  close(sp->fd);
+  free(sp->recs);
+  free(sp->buckets);
+  free(sp);
+}
+
+static int64_t * bucket(struct spool *sp,unsigned char *tag) {
+  return sp->buckets+(le64_get(tag)&sp->mask);
+}
+
+static void unindex(struct spool *sp,int64_t rec) {
+  int64_t *p;
+
+  if(!sp->recs[rec].indexed) { return; }
+  for(p=bucket(sp,sp->recs[rec].tag);*p!=rec;p=&(sp->recs[*p].next))
+    ;
+  *p = sp->recs[rec].next;
+  sp->recs[rec].indexed = 0;
+}
+
+static void maybe_reset(struct spool *sp) {
+  uint64_t i;
+
+  if(!sp->n || sp->live || sp->busy || sp->holds) { return; }
+  log_debug(("spool empty, restarting"));
+  sp->n = 0;
+  for(i=0;i<=sp->mask;i++) { sp->buckets[i] = -1; }
+}
+
+int64_t spool_add(struct spool *sp,unsigned char *tag,int flags) {
+  int64_t rec;
+
+  if(sp->n==sp->max) { return -1; }
+  rec = sp->n++;
+  memcpy(sp->recs[rec].tag,tag,TAGSIZE);
+  sp->recs[rec].state = SPOOL_WRITING;
+  sp->recs[rec].flags = flags;
+  sp->recs[rec].indexed = 0;
+  sp->busy++;
+  return rec;
+}
+
+void spool_written(struct spool *sp,int64_t rec) {
+  struct record *r = sp->recs+rec;
+  int64_t old,*b;
+
+  old = spool_find(sp,r->tag);
+  if(old>=0) {
+    unindex(sp,old);
+    if(sp->recs[old].state==SPOOL_LIVE) {
+      sp->recs[old].state = SPOOL_DONE;
+      sp->live--;
+    }
+  }
+  r->state = SPOOL_LIVE;
+  sp->busy--;
+  sp->live++;
+  b = bucket(sp,r->tag);
+  r->next = *b;
+  *b = rec;
+  r->indexed = 1;
+}
+
+void spool_merging(struct spool *sp,int64_t rec) {
+  sp->recs[rec].state = SPOOL_MERGING;
+  sp->live--;
+  sp->busy++;
+}
+
+void spool_merged(struct spool *sp,int64_t rec) {
+  unindex(sp,rec);
+  sp->recs[rec].state = SPOOL_DONE;
+  sp->busy--;
+  maybe_reset(sp);
+}
+
+int64_t spool_find(struct spool *sp,unsigned char *tag) {
+  int64_t rec;
+
+  for(rec=*bucket(sp,tag);rec>=0;rec=sp->recs[rec].next) {
+    if(!memcmp(sp->recs[rec].tag,tag,TAGSIZE)) { return rec; }
+  }
+  return -1;
+}
+
+int spool_state(struct spool *sp,int64_t rec) { return sp->recs[rec].state; }
+int spool_flags(struct spool *sp,int64_t rec) { return sp->recs[rec].flags; }
+unsigned char * spool_tag(struct spool *sp,int64_t rec) {
+  return sp->recs[rec].tag;
+}
+
+/* Readers in flight hold the spool so its records aren't reused */
+void spool_hold(struct spool *sp) { sp->holds++; }
+void spool_unhold(struct spool *sp) {
+  sp->holds--;
+  maybe_reset(sp);
+}
+
+int spool_read(struct spool *sp,int64_t rec,char *data) {
+  if(pread_all(sp->fd,data,sp->block_size,rec*sp->block_size)
+     !=sp->block_size) {
+    return -1;
+  }
+  return 0;
+}
+
+int spool_write(struct spool *sp,int64_t rec,char *data) {
+  return pwrite_all(sp->fd,data,sp->block_size,rec*sp->block_size);
+}
+
+int64_t spool_records(struct spool *sp) { return sp->n; }
+int64_t spool_live(struct spool *sp) { return sp->live; }
+int64_t spool_capacity(struct spool *sp) { return sp->max; }
@@ -0,0 +1,48 @@
+#ifndef SOURCES_CACHE_SPOOL_H
+#define SOURCES_CACHE_SPOOL_H
+
+#include <stdint.h>
+
+/* Write spool for a cache: blocks are appended to a log file, which is
+ * cheap even on a spinning disk, and moved into their slots later.
+ * Records are numbered from zero in file order, hold one block each and
+ * are indexed in memory by tag (see cache.h) once written. A newer record
+ * for a tag hides older ones. Once every record has been merged and none
+ * is being read, the spool starts again from the top.
+ *
+ * The spool doesn't outlive the process: it's emptied when opened.
+ * spool_read and spool_write may be called from any thread, the rest
+ * only from the event loop.
+ */
+
+#define SPOOL_WRITING 0 /* being appended */
+#define SPOOL_LIVE    1 /* waiting to be merged */
+#define SPOOL_MERGING 2
+#define SPOOL_DONE    3 /* merged, or hidden by a newer record */
+
+struct spool;
+
+struct spool * spool_open(char *path,int64_t size,int64_t block_size);
+void spool_close(struct spool *sp);
+
+/* -1 if full. flags are the caller's */
+int64_t spool_add(struct spool *sp,unsigned char *tag,int flags);
+void spool_written(struct spool *sp,int64_t rec);
+void spool_merging(struct spool *sp,int64_t rec);
+void spool_merged(struct spool *sp,int64_t rec); /* or given up on */
+int64_t spool_find(struct spool *sp,unsigned char *tag); /* -1 if none */
+int spool_state(struct spool *sp,int64_t rec);
+int spool_flags(struct spool *sp,int64_t rec);
+unsigned char * spool_tag(struct spool *sp,int64_t rec);
+
+void spool_hold(struct spool *sp);
+void spool_unhold(struct spool *sp);
+
+int spool_read(struct spool *sp,int64_t rec,char *data);
+int spool_write(struct spool *sp,int64_t rec,char *data);
+
+int64_t spool_records(struct spool *sp);
+int64_t spool_live(struct spool *sp);
+int64_t spool_capacity(struct spool *sp);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <event2/event.h>
+
+#include "../../types.h"
+#include "../../running.h"
+#include "../../request.h"
+#include "../../source.h"
+#include "../../sourcelist.h"
+#include "../../util/misc.h"
+#include "../../util/buffer.h"
+#include "../../util/ranges.h"
+#include "../../util/logging.h"
+#include "../../jpf/jpf.h"
+#include "cache.h"
+#include "mmap.h"
+
+/* Replacement policy simulator. Replays a trace of reads through a
+ * cachemmap in front of an origin, once per policy (and with admission),
+ * and reports hit rates. The trace is one read per line, "spec offset length", from the
+ * named file, else a synthetic mix of a small, hot set of index files
+ * and long one-off scans of big files.
+ *
+ *   test [trace [entries [set_size]]]
+ *
+ * synthetic, entries=2048 set_size=8:
+ * policy=random admit=0 reads=60000 block_hitrate=27.7% origin_blocks=73715 ...
+ * policy=clock  admit=0 reads=60000 block_hitrate=34.6% origin_blocks=66678 ...
+ * policy=clock  admit=1 reads=60000 block_hitrate=42.9% origin_blocks=58197 ...
+ */
+
+#define BLOCK 4096
+#define NINDEX 256
+#define INDEXBLOCKS 8
+#define NREADS 60000
+
+static int64_t origin_blocks;
+
+static void origin_read(struct source *src,struct request *rq) {
+  struct ranges blocks;
+  struct rangei ri;
+  struct buffer *b;
+  struct chunk *ck;
+  int64_t x,y;
+
+  ranges_copy(&blocks,&(rq->desired));
+  ranges_blockify_expand(&blocks,BLOCK);
+  ranges_start(&blocks,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(;x<y;x+=BLOCK) {
+      b = buffer_create(BLOCK);
+      memset(buffer_data(b),x/BLOCK,BLOCK);
+      ck = rq_chunk(src,b,buffer_data(b),x,BLOCK,0,0);
+      buffer_release(b);
+      rq_found_data(rq,ck);
+      origin_blocks++;
+    }
+  }
+  ranges_free(&blocks);
+  rq_run_next(rq);
+}
+
+static void done(int failed_errno,char *data,void *priv) {
+  if(failed_errno) { fprintf(stderr,"read failed\n"); exit(1); }
+}
+
+struct read {
+  char spec[256];
+  int64_t offset,length;
+};
+
+static uint64_t rnd_state = 1;
+static uint64_t rnd(void) {
+  rnd_state = rnd_state*6364136223846793005ULL+1442695040888963407ULL;
+  return rnd_state>>33;
+}
+
+/* Index files skewed to low numbers, every tenth read a step along a scan */
+static struct read * synthetic(int *n) {
+  struct read *rr;
+  int i,scan = 0;
+  int64_t scan_at = 0,f;
+
+  rr = safe_malloc(NREADS*sizeof(struct read));
+  for(i=0;i<NREADS;i++) {
+    if(i%10==9) {
+      snprintf(rr[i].spec,sizeof(rr[i].spec),"http://x/big%d.bam",scan);
+      rr[i].offset = scan_at;
+      rr[i].length = 8*BLOCK;
+      scan_at += 8*BLOCK;
+      if(scan_at>=2000*BLOCK) { scan++; scan_at = 0; }
+    } else {
+      f = (rnd()%NINDEX)*(rnd()%NINDEX)/NINDEX;
+      snprintf(rr[i].spec,sizeof(rr[i].spec),"http://x/idx%"PRId64".bb",f);
+      rr[i].offset = (rnd()%INDEXBLOCKS)*BLOCK;
+      rr[i].length = BLOCK;
+    }
+  }
+  *n = NREADS;
+  return rr;
+}
+
+static struct read * load(char *fn,int *n) {
+  struct read *rr = 0;
+  FILE *f;
+  int size = 0;
+
+  f = fopen(fn,"r");
+  if(!f) { perror(fn); exit(1); }
+  *n = 0;
+  while(1) {
+    if(*n==size) {
+      size = size*2+1024;
+      rr = safe_realloc(rr,size*sizeof(struct read));
+    }
+    if(fscanf(f,"%255s %"SCNd64" %"SCNd64,rr[*n].spec,
+              &(rr[*n].offset),&(rr[*n].length))!=3) { break; }
+    (*n)++;
+  }
+  fclose(f);
+  return rr;
+}
+
+static void replay(char *policy,int admit,struct read *rr,int n,
+                   int64_t entries,int64_t set_size) {
+  struct running run;
+  struct jpf_value *conf;
+  struct source *cs,*origin;
+  struct cache *c;
+  int i;
+
+  memset(&run,0,sizeof(run));
+  run.eb = event_base_new();
+  run.sl = sl_create();
+  conf = jpfv_assoc();
+  jpfv_assoc_add(conf,"filename",jpfv_string("cache-test.dat"));
+  jpfv_assoc_add(conf,"block",jpfv_number_int(BLOCK));
+  jpfv_assoc_add(conf,"entries",jpfv_number_int(entries));
+  jpfv_assoc_add(conf,"set_size",jpfv_number_int(set_size));
+  jpfv_assoc_add(conf,"policy",jpfv_string(policy));
+  if(admit) { jpfv_assoc_add(conf,"admit",jpfv_alloc(JPFV_TRUE,0)); }
+  /* No event loop here: I/O done inline */
+  jpfv_assoc_add(conf,"io_threads",jpfv_number_int(0));
+  cs = source_cachemmap2_make(&run,conf);
+  jpfv_free(conf);
+  sl_add_src(run.sl,cs);
+  origin = src_create("origin");
+  origin->read = origin_read;
+  sl_add_src(run.sl,origin);
+  src_release(origin);
+  sl_open(run.sl);
+  c = (struct cache *)cs->priv;
+  origin_blocks = 0;
+  for(i=0;i<n;i++) {
+    sl_read(run.sl,rr[i].spec,1,rr[i].offset,rr[i].length,done,0);
+  }
+  printf("policy=%-6s admit=%d reads=%d block_hitrate=%.1f%%"
+         " origin_blocks=%"PRId64" rejected=%"PRId64"\n",policy,admit,n,
+         c->hits*100.0/(c->hits+c->misses),origin_blocks,c->rejected);
+  src_release(cs);
+  sl_release(run.sl);
+  event_base_free(run.eb);
+  unlink("cache-test.dat");
+}
+
+int main(int argc,char **argv) {
+  struct read *rr;
+  int64_t entries = 2048,set_size = 8;
+  int n;
+
+  log_set_level("",LOG_WARN);
+  logging_fd(2);
+  if(argc>1 && strcmp(argv[1],"-")) {
+    rr = load(argv[1],&n);
+  } else {
+    rr = synthetic(&n);
+  }
+  if(argc>2) { entries = atoll(argv[2]); }
+  if(argc>3) { set_size = atoll(argv[3]); }
+  replay("random",0,rr,n,entries,set_size);
+  replay("clock",0,rr,n,entries,set_size);
+  replay("clock",1,rr,n,entries,set_size);
+  free(rr);
+  logging_done();
+  return 0;
+}
@@ -14,6 +14,7 @@
 #include "file2.h"
 #include "../syncsource.h"
 #include "../util/misc.h"
+#include "../util/buffer.h"
 #include "../util/path.h"
 #include "../util/logging.h"
 #include "../source.h"
@@ -21,7 +22,7 @@
 
 #define PREFIX "file://"
 
-#define FILEBLOCKSIZE 65536
+#define FILEBLOCKSIZE 65536 /* where no cache sets the geometry */
 
 CONFIG_LOGGING(file)
 
@@ -94,6 +95,7 @@ static int is_regular(char *dir,char *file) {
 
 static int do_request(int fd,struct syncsource *ss,
                       int64_t start,int64_t len,struct chunk **ck) {
+  struct buffer *b;
   char *buf;
   int n;
 
@@ -101,11 +103,13 @@ static int do_request(int fd,struct syncsource *ss,
   log_debug(("do_request %"PRId64"+%"PRId64,start,len));
   if(lseek(fd,start,SEEK_SET)>=0) {
     n = read_all(fd,buf,len);
-    if(n<0) { return errno; }
-    *ck = rq_chunk(syncsource_source(ss),buf,start,n,n<len,*ck);
-    free(buf);
+    if(n<0) { free(buf); return errno; }
+    b = buffer_adopt(buf,n);
+    *ck = rq_chunk(syncsource_source(ss),b,buf,start,n,n<len,*ck);
+    buffer_release(b);
     return 0;
   } else {
+    free(buf);
     return errno;
   }
 }
@@ -129,11 +133,11 @@ static struct chunk * file_read(struct syncsource *ss,struct request *rq,
       if(!regular_ok) { *failed_errno = ENOENT; }
       if(track_ok && regular_ok) {
         ranges_copy(&blocks,&(rq->desired));
-        ranges_blockify_expand(&blocks,FILEBLOCKSIZE);
+        sl_blockify(rq->route,&blocks,FILEBLOCKSIZE);
         if(log_do_debug) {
           char *r1 = ranges_print(&(rq->desired));
           char *r2 = ranges_print(&blocks);
-          log_debug(("desired: %s expanded: %s size=%d",r1,r2,FILEBLOCKSIZE));
+          log_debug(("desired: %s expanded: %s",r1,r2));
           free(r1);
           free(r2);
         }
@@ -167,6 +171,7 @@ static void ds_close(struct syncsource *src) {
 struct source * source_file2_make(struct running *rr,
                                   struct jpf_value *conf) {
   struct syncsource *ss;
+  struct source *src;
   struct jpf_value *root;
 
   root = jpfv_lookup(conf,"root");
@@ -177,5 +182,7 @@ struct source * source_file2_make(struct running *rr,
   ss->read = file_read;
   ss->write = 0;
   ss->close = ds_close;
-  return syncsource_create(rr->sq,ss);
+  src = syncsource_create(rr->sq,ss);
+  src_add_prefix(src,PREFIX);
+  return src;
 }
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/util.h>
@@ -9,37 +11,63 @@
 
 #include "client.h"
 #include "connection.h"
+#include "multipart.h"
 #include "../../util/misc.h"
+#include "../../util/strbuf.h"
 #include "../../util/logging.h"
 #include "../../util/dns.h"
 
 CONFIG_LOGGING(http);
 
+/* Ranges asked for in one request, keeping the header to a sane length */
+#define MAX_RANGES 16
+
+/* How the body of the response in progress is being read */
+enum resp_state {
+  RESP_NEW,    /* headers not yet looked at */
+  RESP_SINGLE, /* one range */
+  RESP_MULTI,  /* multipart/byteranges */
+  RESP_WHOLE,  /* the whole file, though we asked for ranges */
+  RESP_SKIP,   /* nothing in it for us */
+  RESP_BAD     /* no use: see bad */
+};
+
 struct http_request {
   struct httpclient *cli;
   char *uris;
   char *host;
   struct evhttp_uri *uri;
-  int port,retries;
+  int port,retries,background;
   /* stats */
   struct http_stats stats;
-  int64_t dns_start;
+  int64_t dns_start,xfer_start;
   /**/
-  char *out;
-  int64_t offset,len;
+  struct ranges want; /* not yet received */
+  int64_t total; /* length of the whole file, once known */
+  int asked,parts;
+  int64_t wanted; /* at the start of this attempt */
+  /* response in progress */
+  enum resp_state resp;
+  char *bad;
+  struct multipart *mp;
+  int64_t next,end; /* of a single range or the whole file */
+  int64_t last; /* end of the last piece passed on */
+  http_part_fn part;
   http_fn callback;
   void *priv;
   struct connection *conn;
 };
 
 static int try(struct http_request *rq);
+static void again(struct http_request *rq);
 
 static void free_rq(struct http_request *rq) {
   rq->retries = -1; /* stop attempts to resurrect during destroy */
-  free(rq->out);
+  ranges_free(&(rq->want));
   if(rq->uris) { free(rq->uris); rq->uris = 0; }
   if(rq->host) { free(rq->host); rq->host = 0; }
   if(rq->uri) { evhttp_uri_free(rq->uri); rq->uri = 0; }
+  if(rq->mp) { mp_free(rq->mp); rq->mp = 0; }
   if(rq->conn) { unget_connection(rq->conn,0); rq->conn = 0; }
   free(rq);
 }
@@ -50,84 +78,337 @@ static void error(struct http_request *rq,char *msg) {
   if(rq->conn) { unget_connection(rq->conn,1); rq->conn = 0; }
   if(try(rq)) {
     log_warn(("too many errors, failing request"));
-    rq->callback(0,msg,rq->len,0,rq->priv,&(rq->stats));
+    rq->callback(0,rq->total,rq->priv,&(rq->stats));
     free_rq(rq);
   }
   free(msg);
 }
 
-static int parse_range(const char *range,
-                       int64_t *from,int64_t *to,int64_t *len) {
-  char *q,*r;
+static char * endpoint_key(struct http_request *rq) {
+  return make_string("%s:%d",rq->host,rq->port);
+}
 
-  if(strncmp(range,"bytes ",6)) { return 1; }
-  *from = strtoull(range+6,&q,10);
-  if(*q!='-') { return 1; }
-  *to = strtoull(q+1,&r,10);
-  if(*r!='/') { return 1; }
-  *len = strtoull(r+1,&q,10);
-  if(*q) { return 1; }
-  return 0;
+static int single_only(struct httpclient *cli,char *key) {
+  return !!assoc_lookup(cli->single,key);
 }
 
-// XXX timeouts
-static void done(struct evhttp_request *req,void *priv) {
-  struct evkeyvalq *headers;
-  struct http_request *rq;
-  int nread,offset,amt,code;
+static void set_single(struct http_request *rq) {
+  char *key;
+
+  key = endpoint_key(rq);
+  if(single_only(rq->cli,key)) {
+    free(key);
+    return;
+  }
+  log_info(("%s only serves one range per request",key));
+  assoc_set(rq->cli->single,key,(void *)1);
+}
+
+static void got_part(int64_t offset,struct buffer *b,char *data,int64_t len,
+                     int64_t total,void *priv) {
+  struct http_request *rq = (struct http_request *)priv;
+
+  if(offset!=rq->last) { rq->parts++; }
+  rq->last = offset+len;
+  if(total>=0) { rq->total = total; }
+  rq->part(offset,b,data,len,total,rq->priv);
+  ranges_remove(&(rq->want),offset,offset+len);
+}
+
+static void span(struct ranges *rr,int64_t *from,int64_t *to) {
+  struct rangei ri;
+  int64_t x,y;
+  int first;
+
+  *from = *to = 0;
+  ranges_start(rr,&ri);
+  for(first=1;ranges_next(&ri,&x,&y);first=0) {
+    if(first) { *from = x; }
+    *to = y;
+  }
+}
+
+static int64_t remaining(struct ranges *rr) {
+  struct rangei ri;
+  int64_t x,y,n;
+
+  n = 0;
+  ranges_start(rr,&ri);
+  while(ranges_next(&ri,&x,&y)) { n += y-x; }
+  return n;
+}
+
+/* Response bodies are taken from evhttp rather than copied out of it:
+ * its chains move to an evbuffer of our own which is freed once the last
+ * buffer viewing it is released.
+ */
+static void free_body(char *data,void *priv) {
+  evbuffer_free((struct evbuffer *)priv);
+}
+
+static void release_body(char *data,void *priv) {
+  buffer_release((struct buffer *)priv);
+}
+
+static struct buffer * take_body(struct evbuffer *buf,
+                                 struct evbuffer **out) {
+  *out = evbuffer_new();
+  evbuffer_add_buffer(*out,buf);
+  return buffer_view(0,0,free_body,*out);
+}
+
+/* The rest of the response is ignored, and the request tried again */
+static void bad(struct http_request *rq,char *msg) {
+  rq->resp = RESP_BAD;
+  rq->bad = msg;
+}
+
+/* Nothing asked for is in the file, but we learn where the file ends */
+static void begin_unsatisfiable(struct http_request *rq,
+                                struct evkeyvalq *headers) {
   const char *range;
-  int64_t from,to,len;
-  int eof;
+  char *end;
+  int64_t total;
 
-  rq = (struct http_request *)priv;
-  if(!req) {
-    error(rq,"Request failed");
-    return; 
+  range = evhttp_find_header(headers,"Content-Range");
+  if(!range || strncmp(range,"bytes */",8)) {
+    bad(rq,"Bad status");
+    return;
+  }
+  total = strtoull(range+8,&end,10);
+  if(*end || total<0) {
+    bad(rq,"Content range header invalid");
+    return;
+  }
+  rq->total = total;
+  rq->resp = RESP_SKIP;
+}
+
+static void begin_single(struct http_request *rq,
+                         struct evkeyvalq *headers) {
+  const char *range;
+  int64_t from,to,len,a,b;
+
+  range = evhttp_find_header(headers,"Content-Range");
+  if(!range) {
+    bad(rq,"Content range header missing");
+    return;
+  }
+  if(parse_content_range(range,&from,&to,&len) ||
+     from<0 || to<from || to>=len) {
+    bad(rq,"Content range header invalid");
+    return;
+  }
+  span(&(rq->want),&a,&b);
+  if(from<a || to>=b) {
+    bad(rq,"Unexpected range returned");
+    return;
   }
+  rq->resp = RESP_SINGLE;
+  rq->next = from;
+  rq->end = to+1;
+  rq->total = len;
+}
+
+static void begin_multipart(struct http_request *rq,const char *ctype) {
+  int64_t a,b;
+
+  span(&(rq->want),&a,&b);
+  rq->mp = mp_new(ctype,b-a,got_part,rq);
+  if(!rq->mp) {
+    bad(rq,"Bad multipart content type");
+    return;
+  }
+  rq->resp = RESP_MULTI;
+}
+
+/* Some servers give up on many ranges and send the whole file. It's
+ * coming anyway, so use it until we have what we asked for, but don't
+ * ask for more than one again.
+ */
+static void begin_whole(struct http_request *rq,
+                        struct evkeyvalq *headers) {
+  const char *length;
+  char *end;
+
+  if(rq->asked<2) {
+    bad(rq,"Server does not support range requests");
+    return;
+  }
+  set_single(rq);
+  rq->resp = RESP_WHOLE;
+  rq->next = 0;
+  rq->end = INT64_MAX;
+  length = evhttp_find_header(headers,"Content-Length");
+  if(length) {
+    rq->total = strtoull(length,&end,10);
+    if(*end) { rq->total = -1; }
+  }
+}
+
+/* Once the headers are in: at the first of the body, or at the end */
+static void begin(struct http_request *rq,struct evhttp_request *req) {
+  struct evkeyvalq *headers;
+  const char *ctype;
+  int code;
+
   code = evhttp_request_get_response_code(req);
+  headers = evhttp_request_get_input_headers(req);
+  if(!headers) {
+    bad(rq,"Cannot retrieve headers");
+    return;
+  }
+  if(code==416) {
+    begin_unsatisfiable(rq,headers);
+    return;
+  }
   if(code<200 || code>299) {
-    error(rq,"Bad status"); // XXX codes
+    bad(rq,"Bad status"); // XXX codes
     return;
   }
   if(code!=206) {
-    error(rq,"Server does not support range requests");
+    begin_whole(rq,headers);
     return;
   }
-  headers = evhttp_request_get_input_headers(req); 
-  if(!headers) {
-    error(rq,"Cannot retrieve headers");
-    return;
+  ctype = evhttp_find_header(headers,"Content-Type");
+  if(ctype && !strncasecmp(ctype,"multipart/byteranges",20)) {
+    begin_multipart(rq,ctype);
+  } else {
+    begin_single(rq,headers);
   }
-  range = evhttp_find_header(headers,"Content-Range");
-  if(!range) {
-    error(rq,"Content range header missing");
+}
+
+static void feed_piece(struct http_request *rq,struct buffer *b,
+                       char *data,int64_t len) {
+  if(rq->resp==RESP_MULTI) {
+    if(mp_feed(rq->mp,b,data,len)) { bad(rq,"Bad multipart response"); }
     return;
   }
-  if(parse_range(range,&from,&to,&len)) {
-    error(rq,"Content range header invalid");
+  if(len>rq->end-rq->next) { len = rq->end-rq->next; }
+  if(!len) { return; }
+  got_part(rq->next,b,data,len,rq->total,rq);
+  rq->next += len;
+}
+
+/* Whatever has arrived is passed on straight away, as views of the
+ * pieces it came in.
+ */
+static void feed(struct http_request *rq,struct evbuffer *buf) {
+  struct evbuffer *own;
+  struct evbuffer_iovec *v;
+  struct buffer *body,*seg;
+  int i,n;
+
+  if(rq->resp!=RESP_SINGLE && rq->resp!=RESP_MULTI &&
+     rq->resp!=RESP_WHOLE) {
+    return; /* evhttp drains it */
+  }
+  if(!evbuffer_get_length(buf)) { return; }
+  body = take_body(buf,&own);
+  n = evbuffer_peek(own,-1,0,0,0);
+  v = safe_malloc(n*sizeof(struct evbuffer_iovec));
+  evbuffer_peek(own,-1,0,v,n);
+  for(i=0;i<n && rq->resp!=RESP_BAD;i++) {
+    buffer_acquire(body);
+    seg = buffer_view(v[i].iov_base,v[i].iov_len,release_body,body);
+    feed_piece(rq,seg,v[i].iov_base,v[i].iov_len);
+    buffer_release(seg);
+  }
+  free(v);
+  buffer_release(body);
+}
+
+static void end_response(struct http_request *rq) {
+  if(rq->mp) { mp_free(rq->mp); rq->mp = 0; }
+  rq->resp = RESP_NEW;
+}
+
+/* Anything past the end of the file isn't coming. Otherwise, if any of
+ * what's left was received, ask again for the rest. A server which sent
+ * just one of several ranges asked for will only ever do so.
+ */
+static void finish(struct http_request *rq) {
+  if(rq->conn) { unget_connection(rq->conn,0); rq->conn = 0; }
+  if(rq->total>=0) { ranges_remove(&(rq->want),rq->total,INT64_MAX); }
+  if(ranges_empty(&(rq->want))) {
+    rq->callback(1,rq->total,rq->priv,&(rq->stats));
+    free_rq(rq);
     return;
   }
-  eof = (len == to+1);
-  if(from != rq->offset || (!eof && to != rq->offset+rq->len-1)) {
+  if(remaining(&(rq->want))==rq->wanted) {
     error(rq,"Unexpected range returned");
     return;
   }
-  log_debug(("EOF? = %d",eof));
-  offset = 0;
-  amt = rq->len;
-  while(amt) {
-    nread = evbuffer_remove(evhttp_request_get_input_buffer(req),
-                            rq->out+offset,amt);
-    if(nread <= 0) { break; }
-    offset += nread;
-    amt -= nread;
+  if(rq->asked>1 && rq->parts==1) { set_single(rq); }
+  log_debug(("partial response, asking for the rest"));
+  again(rq);
+}
+
+/* Body as it arrives. The rest of a whole file isn't waited for once
+ * nothing we want is left in it: the connection goes with it.
+ */
+static void body(struct evhttp_request *req,void *priv) {
+  struct http_request *rq = (struct http_request *)priv;
+
+  if(rq->resp==RESP_NEW) { begin(rq,req); }
+  feed(rq,evhttp_request_get_input_buffer(req));
+  if(rq->resp==RESP_WHOLE && ranges_empty(&(rq->want))) {
+    log_debug(("have all we wanted: abandoning the rest of the file"));
+    evhttp_cancel_request(req);
+    rq->stats.xfer_time += microtime() - rq->xfer_start;
+    if(rq->conn) { unget_connection(rq->conn,1); rq->conn = 0; }
+    end_response(rq);
+    finish(rq);
   }
-  if(amt && !eof) {
-    error(rq,"Short buffer");
+}
+
+// XXX timeouts
+static void done(struct evhttp_request *req,void *priv) {
+  struct http_request *rq;
+  char *msg;
+
+  rq = (struct http_request *)priv;
+  rq->stats.xfer_time += microtime() - rq->xfer_start;
+  if(!req) {
+    end_response(rq);
+    error(rq,"Request failed");
     return;
   }
-  rq->callback(1,rq->out,rq->len-amt,eof,rq->priv,&(rq->stats));
-  free_rq(rq);
+  if(rq->resp==RESP_NEW) { begin(rq,req); }
+  feed(rq,evhttp_request_get_input_buffer(req));
+  if(rq->resp==RESP_BAD) {
+    msg = rq->bad;
+    end_response(rq);
+    error(rq,msg);
+    return;
+  }
+  if(rq->resp==RESP_MULTI && !mp_finished(rq->mp)) {
+    log_warn(("multipart response cut short"));
+  }
+  if(rq->resp==RESP_WHOLE) { rq->total = rq->next; }
+  end_response(rq);
+  finish(rq);
+}
+
+static char * range_header(struct http_request *rq) {
+  struct strbuf out;
+  struct rangei ri;
+  int64_t x,y;
+  int max;
+  char *key;
+
+  key = endpoint_key(rq);
+  max = single_only(rq->cli,key)?1:MAX_RANGES;
+  free(key);
+  strbuf_init(&out,0);
+  strbuf_add(&out,"bytes=");
+  rq->asked = 0;
+  ranges_start(&(rq->want),&ri);
+  while(rq->asked<max && ranges_next(&ri,&x,&y)) {
+    strbuf_add(&out,"%s%"PRId64"-%"PRId64,rq->asked?",":"",x,y-1);
+    rq->asked++;
+  }
+  return strbuf_str(&out);
 }
 
 static void make_request(struct connection *conn,void *priv) {
@@ -143,20 +424,24 @@ static void make_request(struct connection *conn,void *priv) {
     return;
   }
   rq->conn = conn;
+  rq->stats.dns_time += microtime() - rq->dns_start;
+  rq->xfer_start = microtime();
   // XXX non-blocking DNS / cache
   req = evhttp_request_new(done,rq);
   if(!req) {
     error(rq,"Could not create request");
     return;
   }
+  evhttp_request_set_chunked_cb(req,body);
 
   reqh = evhttp_request_get_output_headers(req);
   evhttp_add_header(reqh,"Host", rq->host);
-  range = make_string("bytes=%llu-%llu",
-		(unsigned long long)rq->offset,
-	        (unsigned long long)(rq->offset+rq->len-1));
+  range = range_header(rq);
   evhttp_add_header(reqh,"Range",range);
   free(range);
+  rq->wanted = remaining(&(rq->want));
+  rq->parts = 0;
+  rq->last = -1;
   r = evhttp_make_request(evconnection(conn),req,EVHTTP_REQ_GET,rq->uris);
   if(r) {
     error(rq,"Request failed");
@@ -172,6 +457,7 @@ struct httpclient * httpclient_create(struct event_base *eb,
   cli->eb = eb;
   cli->edb = edb;
   cli->cnn = cnn_make(cli);
+  cli->single = assoc_create(type_free,0,0,0);
   return cli;
 }
 
@@ -183,6 +469,7 @@ static void cnn_finished(void *priv) {
   f_cb = cli->f_cb;
   f_priv = cli->f_priv;
   log_debug(("connections finished: closing"));
+  assoc_release(cli->single);
   free(cli);
   f_cb(f_priv);
 }
@@ -198,21 +485,55 @@ void httpclient_finish(struct httpclient *cli,http_finished cb,void *priv) {
 static int try(struct http_request *rq) {
   if(rq->retries > MAX_RETRIES || rq->retries==-1) { return -1; }
   rq->retries++;
-  rq->dns_start = microtime();
-  get_connection(rq->cli->cnn,rq->host,rq->port,make_request,rq);
+  rq->stats.retries = rq->retries-1;
+  again(rq);
   return 0;
 }
 
+/* The rest of a request which is getting somewhere: not a retry */
+static void again(struct http_request *rq) {
+  rq->dns_start = microtime();
+  get_connection(rq->cli->cnn,rq->host,rq->port,rq->background,
+                 make_request,rq);
+}
+
+/* How many ranges the server for a URI will take in one request */
+int http_max_ranges(struct httpclient *cli,char *uris) {
+  struct evhttp_uri *uri;
+  const char *host;
+  char *key;
+  int port,max;
+
+  uri = evhttp_uri_parse(uris);
+  if(!uri) { return 1; }
+  host = evhttp_uri_get_host(uri);
+  port = evhttp_uri_get_port(uri);
+  if(port==-1) { port = 80; }
+  max = MAX_RANGES;
+  if(host) {
+    key = make_string("%s:%d",host,port);
+    if(single_only(cli,key)) { max = 1; }
+    free(key);
+  }
+  evhttp_uri_free(uri);
+  return max;
+}
+
 // XXX tidy up
-void http_request(struct httpclient *cli,char *uris,size_t off,size_t size,
-                  http_fn callback,void *priv) {
+void http_request(struct httpclient *cli,char *uris,struct ranges *want,
+                  int background,http_part_fn part,http_fn callback,
+                  void *priv) {
   struct http_request *rq;
   const char *host;
 
   rq = safe_malloc(sizeof(struct http_request));
-  rq->out = safe_malloc(size);
-  rq->offset = off;
-  rq->len = size;
+  ranges_copy(&(rq->want),want);
+  rq->total = -1;
+  rq->asked = rq->parts = 0;
+  rq->resp = RESP_NEW;
+  rq->mp = 0;
+  rq->background = background;
+  rq->part = part;
   rq->callback = callback;
   rq->priv = priv;
   rq->cli = cli;
@@ -234,7 +555,7 @@ void http_request(struct httpclient *cli,char *uris,size_t off,size_t size,
   }
   rq->host = strdup(host);
   rq->port = evhttp_uri_get_port(rq->uri);
-  rq->stats = (struct http_stats){ .dns_time = 0 };
+  rq->stats = (struct http_stats){ .dns_time = 0, .xfer_time = 0 };
   rq->retries = 0;
   if(rq->port==-1) { rq->port=80; }
   try(rq);  
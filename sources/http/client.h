@@ -8,9 +8,14 @@ struct httpclient;
 
 #include "connection.h"
 #include "../../util/misc.h"
+#include "../../util/assoc.h"
+#include "../../util/ranges.h"
+#include "../../util/buffer.h"
 
 struct http_stats {
-  int64_t dns_time;
+  int64_t dns_time; /* waiting for a connection, including any DNS */
+  int64_t xfer_time; /* from sending request to full response */
+  int retries;
 };
 
 typedef void (*http_finished)(void *);
@@ -22,16 +27,26 @@ struct httpclient {
   struct event_base *eb;
   struct evdns_base *edb;
   struct connections *cnn;
+  /* "host:port" of servers which only send one range per response */
+  struct assoc *single;
 };
 
-typedef void (*http_fn)(int,char *,int64_t,int,void *,struct http_stats *);
+/* Each piece of the response body, as it arrives; then once at the end.
+ * Pieces are views of the body: acquire the buffer to keep one beyond
+ * the callback.
+ */
+typedef void (*http_part_fn)(int64_t offset,struct buffer *b,char *data,
+                             int64_t len,int64_t total,void *priv);
+typedef void (*http_fn)(int success,int64_t total,void *priv,
+                        struct http_stats *stats);
 
 struct httpclient * httpclient_create(struct event_base *eb,
                                       struct evdns_base *edb);
 void httpclient_finish(struct httpclient *cli,http_finished cb,void *priv);
-void http_request(struct httpclient *cli,
-                  char *uris,size_t off,size_t size,
-                  http_fn callback,void *priv);
+int http_max_ranges(struct httpclient *cli,char *uris);
+void http_request(struct httpclient *cli,char *uris,struct ranges *want,
+                  int background,http_part_fn part,http_fn callback,
+                  void *priv);
 
 
 #endif
@@ -1,12 +1,15 @@
 #include "connection.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <event2/event.h>
 #include <event2/http.h>
 
 #include "client.h"
 #include "../../util/logging.h"
+#include "../../util/assoc.h"
 #include "../../util/dns.h"
+#include "../../jpf/jpf.h"
 
 /* connections contains the global state for this module.
  * endpoint contains the state for a host/port combination.
@@ -14,14 +17,20 @@
  * conn_request conetains an individual request for a connection.
  *
  * We limit the number of simultaneous connecitons to be nice to remote
- * servers.
+ * servers. The limit, and the timeouts below, can be set for all
+ * endpoints and overridden for any one of them.
  *
- * try_link tries to match existing connections to existing requests and
- * if it does, marks the connection as in use and returns it, removing it
- * from the request list.
+ * Requests wait in two queues, each served in order of arrival: first
+ * those of clients, then background ones (eg prefetch).
  *
- * try_new, if there are pending requests and there aren't too many
- * connections creates new connections. It then calls try_resolve.
+ * try_link matches ready connections to waiting requests, marking the
+ * connection as in use and removing the request from its queue. Ready
+ * connections are kept on an idle list, most recently used first, so
+ * the warmest is reused and the coldest time out.
+ *
+ * try_new creates new connections, if fewer are on their way than there
+ * are requests waiting (or than the endpoint's warm_conns) and there
+ * aren't too many. It then calls try_resolve.
  *
  * try_resolve issues a DNS query on behalf of a new connection. When a
  * response comes back it's put into the ready state, as accepted by
@@ -33,10 +42,13 @@
  * then try_link will attempt to establish new connections.
  *
  * unget_connection places the connection back into the ready state, and
- * then recalls try_link to satisfy any pending requests.
+ * then recalls try_link to satisfy any pending requests. Bad connections
+ * are tidied away straight after (but not from inside their callback).
  *
- * tidy does periodic conneciton tidying. Old connections are removed, and
- * then try_new is called to see if any new connections can be created.
+ * tidy does periodic conneciton tidying. Old connections are removed,
+ * down to the warm ones, and then try_new is called to see if any new
+ * connections can be created. Endpoints left with no connections and
+ * nothing queued are freed, unless they have limits of their own.
  *
  * Whenever connections become ready, try_link must be called. Whenever
  * connections are freed try_new must be called.
@@ -45,15 +57,21 @@
 CONFIG_LOGGING(http);
 
 // XXX timeout inuse
-// XXX configurable
-#define MAX_CONN 3
 #define DNS_WAIT 30000000
 
+/* Unless configured otherwise */
+#define DEFAULT_MAX_CONNS 3
+#define DEFAULT_IDLE_MS   5000
+#define DEFAULT_STUCK_MS  60000
+#define DEFAULT_QUEUE_MS  15000
+
 struct connections {
   struct ref r;
   struct httpclient *cli;
-  struct event * timer;
+  struct event *timer,*soon;
   struct endpoint *epp;
+  struct cnn_limits lim;
+  struct assoc *limits; /* by "host" or "host:port" */
   int closing;
 
   /* for freeing */
@@ -64,14 +82,25 @@ struct connections {
   int64_t n_new,dns_time;
 };
 
+struct crq_fifo {
+  struct conn_request *head,*tail;
+};
+
 struct endpoint {
   char *host;
   int port;
-  int n_paused,n_conn;
+  int n_conn,n_queued;
+  struct cnn_limits lim;
+  int configured; /* kept while idle, for warm-up and stats */
   struct connections *cnn;
   struct connection *conn;
-  struct conn_request *rqq;
+  struct connection *idle;
+  struct crq_fifo q[2]; /* clients, background */
   struct endpoint *next;
+
+  /* stats */
+  int64_t n_served,n_reused,n_expired,wait_total,wait_max;
+  int64_t n_setup,setup_total;
 };
 
 enum conn_state {
@@ -83,8 +112,9 @@ struct connection {
   enum conn_state state;
   struct endpoint *ep;
   struct evhttp_connection *evcon;
-  struct connection *next;
-  int64_t last_used;
+  struct connection *next,*next_idle;
+  int64_t last_used,uses;
+  int doomed;
 
   /* stats */
   int64_t dns_start;
@@ -109,6 +139,27 @@ static void dump_ep(struct endpoint *ep) {
 }
 #endif
 
+static void crq_push(struct crq_fifo *q,struct conn_request *crq) {
+  crq->next = 0;
+  if(q->tail) { q->tail->next = crq; } else { q->head = crq; }
+  q->tail = crq;
+}
+
+static struct conn_request * crq_take(struct endpoint *ep) {
+  struct conn_request *crq;
+  int i;
+
+  for(i=0;i<2;i++) {
+    crq = ep->q[i].head;
+    if(!crq) { continue; }
+    ep->q[i].head = crq->next;
+    if(!crq->next) { ep->q[i].tail = 0; }
+    ep->n_queued--;
+    return crq;
+  }
+  return 0;
+}
+
 static void free_endpoint(struct endpoint *ep) {
   struct endpoint **epp;
 
@@ -124,6 +175,18 @@ static void free_endpoint(struct endpoint *ep) {
   free(ep);
 }
 
+static void endpoint_limits(struct connections *cnn,struct endpoint *ep) {
+  struct cnn_limits *lim;
+  char *key;
+
+  key = make_string("%s:%d",ep->host,ep->port);
+  lim = (struct cnn_limits *)assoc_lookup(cnn->limits,key);
+  free(key);
+  if(!lim) { lim = (struct cnn_limits *)assoc_lookup(cnn->limits,ep->host); }
+  ep->lim = lim?*lim:cnn->lim;
+  ep->configured = !!lim;
+}
+
 static struct endpoint * get_endpoint(struct connections *cnn,
                                       const char *host,int port) {
   struct endpoint *ep;
@@ -137,11 +200,16 @@ static struct endpoint * get_endpoint(struct connections *cnn,
   ep->host = strdup(host);
   ep->port = port;
   ep->next = cnn->epp;
-  ep->rqq = 0;
-  ep->n_paused = 0;
+  ep->q[0].head = ep->q[0].tail = ep->q[1].head = ep->q[1].tail = 0;
+  ep->n_queued = 0;
   ep->n_conn = 0;
   ep->cnn = cnn;
   ep->conn = 0;
+  ep->idle = 0;
+  ep->n_served = ep->n_reused = ep->n_expired = 0;
+  ep->wait_total = ep->wait_max = 0;
+  ep->n_setup = ep->setup_total = 0;
+  endpoint_limits(cnn,ep);
   cnn->epp = ep;
   ref_acquire(&(cnn->r));
   return ep;
@@ -149,47 +217,72 @@ static struct endpoint * get_endpoint(struct connections *cnn,
 
 static void try_link(struct endpoint *ep) {
   struct connection *conn;
-  struct conn_request *rqq;
+  struct conn_request *crq;
+  int64_t now,wait;
 
-  for(conn=ep->conn;conn;conn=conn->next) {
-    if(conn->state != CONN_READY) { continue; }
-    if(!ep->rqq) { return; }
+  while(ep->idle && ep->n_queued) {
     log_debug(("Request satisfied"));
-    rqq = ep->rqq;
-    ep->rqq = ep->rqq->next;
+    conn = ep->idle;
+    ep->idle = conn->next_idle;
+    crq = crq_take(ep);
+    now = microtime();
+    wait = now-crq->start;
+    ep->n_served++;
+    if(conn->uses++) { ep->n_reused++; }
+    ep->wait_total += wait;
+    if(wait>ep->wait_max) { ep->wait_max = wait; }
     conn->state = CONN_INUSE;
-    conn->last_used = microtime();
-    rqq->callback(conn,rqq->priv);
-    free(rqq);  
-  } 
+    conn->last_used = now;
+    crq->callback(conn,crq->priv);
+    free(crq);
+  }
+}
+
+static void make_ready(struct connection *conn) {
+  conn->state = CONN_READY;
+  conn->last_used = microtime();
+  conn->next_idle = conn->ep->idle;
+  conn->ep->idle = conn;
 }
 
 void unget_connection(struct connection *conn,int bad) {
+  struct timeval now = {0,0};
+
   log_debug(("Connection returned bad=%d",bad));
-  conn->state = bad?CONN_BAD:CONN_READY;
+  if(bad) {
+    conn->state = CONN_BAD;
+    evtimer_add(conn->ep->cnn->soon,&now);
+    return;
+  }
+  make_ready(conn);
   try_link(conn->ep);
 }
 
 static void resolved(const char *host,void *data) {
   struct connection *cn = (struct connection *)data;
 
-  // XXX failed DNS
-  ref_release(&(cn->r));
+  if(cn->state!=CONN_AWAITDNS) { /* tidied away meanwhile */
+    ref_release(&(cn->r));
+    return;
+  }
   if(!host) {
     log_warn(("DNS failed"));
     cn->state = CONN_FAILEDDNS;
     cn->last_used = microtime();
+    ref_release(&(cn->r));
     return;
   }
   log_debug(("DNS answer"));
   cn->evcon = evhttp_connection_base_new(cn->ep->cnn->cli->eb,0,host,
                                          cn->ep->port);
   // XXX failed connect
-  cn->state = CONN_READY;
-  cn->last_used = microtime();
+  make_ready(cn);
   cn->ep->cnn->n_new++;
   cn->ep->cnn->dns_time += microtime() - cn->dns_start;
+  cn->ep->n_setup++;
+  cn->ep->setup_total += microtime() - cn->dns_start;
   try_link(cn->ep);
+  ref_release(&(cn->r));
 }
 
 static void try_resolve(struct endpoint *ep) {
@@ -215,9 +308,17 @@ static void free_connection(void *priv) {
 
 static void try_new(struct endpoint *ep) {
   struct connection *conn;
-  int i;
+  int coming,want;
 
-  for(i=0;ep->rqq && ep->n_conn<MAX_CONN;i++) {
+  coming = 0;
+  for(conn=ep->conn;conn;conn=conn->next) {
+    if(conn->state==CONN_NEW || conn->state==CONN_AWAITDNS) { coming++; }
+  }
+  want = ep->n_queued-coming;
+  if(want<ep->lim.warm_conns-ep->n_conn) {
+    want = ep->lim.warm_conns-ep->n_conn;
+  }
+  for(;want>0 && ep->n_conn<ep->lim.max_conns;want--) {
     log_debug(("New connection"));
     conn = safe_malloc(sizeof(struct connection));
     ref_create(&(conn->r));
@@ -225,17 +326,19 @@ static void try_new(struct endpoint *ep) {
     conn->state = CONN_NEW;
     conn->ep = ep;
     conn->evcon = 0;
-    conn->last_used = 0;
+    conn->last_used = microtime();
+    conn->uses = 0;
+    conn->doomed = 0;
+    conn->next_idle = 0;
     conn->next = ep->conn;
     ep->conn = conn;
     ep->n_conn++;
-    ep->n_paused--;
   }
   try_resolve(ep);
 }
 
 void get_connection(struct connections *cnn,
-                    const char *host,int port,
+                    const char *host,int port,int background,
                     conn_cb callback,void *priv) {
   struct endpoint *ep;
   struct conn_request *crq;
@@ -245,10 +348,9 @@ void get_connection(struct connections *cnn,
   ep = get_endpoint(cnn,host,port);
   crq->callback = callback;
   crq->priv = priv;
-  crq->next = ep->rqq;
   crq->start = microtime();
-  ep->rqq = crq;
-  ep->n_paused++;
+  crq_push(&(ep->q[!!background]),crq);
+  ep->n_queued++;
   try_link(ep);
   try_new(ep);
 }
@@ -257,23 +359,53 @@ struct evhttp_connection * evconnection(struct connection *conn) {
   return conn->evcon;
 }
 
-// XXX dispose of ancient connections in any state
-#define TOO_OLD      5000000
-#define TOO_ANCIENT 60000000
+/* Doomed are: bad ones; stuck ones; and idle ones, least recently used
+ * first, for as long as there are more than warm_conns.
+ */
+static void doom(struct endpoint *ep) {
+  struct connection *c;
+  int64_t now,idle,stuck;
+  int spare,old;
+
+  now = microtime();
+  idle = ep->lim.idle_ms*1000;
+  stuck = ep->lim.stuck_ms*1000;
+  spare = ep->n_conn-ep->lim.warm_conns;
+  for(c=ep->conn;c;c=c->next) {
+    c->doomed = (c->state == CONN_BAD) ||
+                (c->state != CONN_READY && c->last_used+stuck < now) ||
+                ep->cnn->closing;
+    if(c->doomed) { spare--; }
+  }
+  old = 0;
+  for(c=ep->idle;c;c=c->next_idle) {
+    if(!c->doomed && c->last_used+idle < now) { old++; }
+  }
+  if(spare<0) { spare = 0; }
+  for(c=ep->idle;c;c=c->next_idle) {
+    if(c->doomed || c->last_used+idle >= now) { continue; }
+    if(old-->spare) { continue; }
+    c->doomed = 1;
+  }
+}
+
 static void tidy_endpoint(struct endpoint *ep) {
-  struct connection *c,*new;
+  struct connection *c,**cp;
   uint64_t now;
 
   now = microtime();
-  new = 0;
-  while(ep->conn) {
-    c = ep->conn;
-    ep->conn = c->next;
-    if((c->state == CONN_BAD) ||
-       (c->state == CONN_READY && c->last_used+TOO_OLD < now) ||
-       (c->last_used+TOO_ANCIENT < now || ep->cnn->closing)) {
+  doom(ep);
+  for(cp=&(ep->idle);*cp;) {
+    if((*cp)->doomed) { *cp = (*cp)->next_idle; }
+    else { cp = &((*cp)->next_idle); }
+  }
+  for(cp=&(ep->conn);*cp;) {
+    c = *cp;
+    if(c->doomed) {
       /* dispose */
       log_debug(("freeing connection"));
+      *cp = c->next;
+      c->state = CONN_BAD;
       ref_release(&(c->r));
       ep->n_conn--;
     } else {
@@ -281,36 +413,48 @@ static void tidy_endpoint(struct endpoint *ep) {
       if(c->state == CONN_FAILEDDNS && c->last_used+DNS_WAIT <now) {
         c->state = CONN_NEW;
       }
-      c->next = new;
-      new = c;
+      cp = &(c->next);
     }
   }
-  if(!ep->cnn->closing) { try_resolve(ep); }
-  ep->conn = new;
-  if(!ep->cnn->closing) { try_new(ep); }
-  if(!ep->conn && !ep->rqq) {
+  if(!ep->cnn->closing) {
+    try_resolve(ep);
+    try_new(ep);
+  }
+  if(!ep->conn && !ep->n_queued &&
+     (ep->cnn->closing || !ep->configured)) {
     free_endpoint(ep);
   }
 }
 
-#define ANCIENT_REQ 15000000
 static void expire_ancient(struct endpoint *ep) {
-  struct conn_request **rqp,*rq;
+  struct conn_request *crq,*next,*expired;
   int64_t now;
+  int i;
 
   now = microtime();
-  rqp = &(ep->rqq);
-  while(*rqp) {
-    if((*rqp)->start+ANCIENT_REQ < now) { /* ancient */
-      log_debug(("freeing ancient request"));
-      rq = *rqp;
-      *rqp = (*rqp)->next;
-      rq->callback(0,rq->priv);
-      free(rq);
-    } else { /* modern */
-      rqp = &((*rqp)->next);
+  expired = 0;
+  for(i=0;i<2;i++) {
+    crq = ep->q[i].head;
+    ep->q[i].head = ep->q[i].tail = 0;
+    for(;crq;crq=next) {
+      next = crq->next;
+      if(crq->start+ep->lim.queue_ms*1000 < now) { /* ancient */
+        crq->next = expired;
+        expired = crq;
+        ep->n_queued--;
+        ep->n_expired++;
+      } else { /* modern */
+        crq_push(&(ep->q[i]),crq);
+      }
     }
   }
+  /* Only now: they may well queue up again */
+  for(;expired;expired=next) {
+    log_debug(("freeing ancient request"));
+    next = expired->next;
+    expired->callback(0,expired->priv);
+    free(expired);
+  }
 }
 
 static void tidy(evutil_socket_t fd,short what,void *arg) {
@@ -329,6 +473,7 @@ static void cnn_on_release(void *priv) {
 
   log_debug(("connections released"));
   event_del(cnn->timer);
+  event_del(cnn->soon);
   cnn->free_cb(cnn->free_priv);
 }
 
@@ -337,7 +482,9 @@ static void cnn_on_free(void *priv) {
 
   log_debug(("connections freed"));
   event_free(cnn->timer);
-  free(cnn);  
+  event_free(cnn->soon);
+  assoc_release(cnn->limits);
+  free(cnn);
 }
 
 struct connections * cnn_make(struct httpclient *cli) {
@@ -350,10 +497,13 @@ struct connections * cnn_make(struct httpclient *cli) {
   cnn->n_new = 0;
   cnn->closing = 0;
   cnn->cli = cli;
+  cnn_default_limits(&(cnn->lim));
+  cnn->limits = assoc_create(type_free,0,type_free,0);
   ref_create(&(cnn->r));
   ref_on_release(&(cnn->r),cnn_on_release,cnn);
   ref_on_free(&(cnn->r),cnn_on_free,cnn);
   cnn->timer = event_new(cli->eb,-1,EV_PERSIST,tidy,cnn);
+  cnn->soon = evtimer_new(cli->eb,tidy,cnn);
   event_add(cnn->timer,&timer_period);
   return cnn;
 }
@@ -367,7 +517,84 @@ void cnn_free(struct connections *cnn,cnn_free_cb cb,void *priv) {
   ref_release(&(cnn->r));
 }
 
+void cnn_default_limits(struct cnn_limits *lim) {
+  lim->max_conns = DEFAULT_MAX_CONNS;
+  lim->warm_conns = 0;
+  lim->idle_ms = DEFAULT_IDLE_MS;
+  lim->stuck_ms = DEFAULT_STUCK_MS;
+  lim->queue_ms = DEFAULT_QUEUE_MS;
+}
+
+/* For one endpoint ("host" or "host:port"), or for all of them (0). One
+ * named with warm connections is resolved and made ready straight away;
+ * for all of them, warm_conns only applies once an endpoint is in use.
+ */
+void cnn_set_limits(struct connections *cnn,const char *endpoint,
+                    struct cnn_limits *lim) {
+  struct cnn_limits *copy;
+  char *host,*colon;
+  int port;
+
+  if(!endpoint) {
+    cnn->lim = *lim;
+    return;
+  }
+  copy = safe_malloc(sizeof(struct cnn_limits));
+  *copy = *lim;
+  assoc_set(cnn->limits,strdup(endpoint),copy);
+  if(!lim->warm_conns) { return; }
+  host = strdup(endpoint);
+  port = 80;
+  colon = strrchr(host,':');
+  if(colon) {
+    *colon = '\0';
+    port = atoi(colon+1);
+  }
+  log_info(("warming up %"PRId64" connections to %s:%d",
+            lim->warm_conns,host,port));
+  try_new(get_endpoint(cnn,host,port));
+  free(host);
+}
+
 void cnn_stats(struct connections *cnn,int64_t *n_new,int64_t *dns_time) {
   if(n_new) { *n_new = cnn->n_new; }
   if(dns_time) { *dns_time = cnn->dns_time; }
 }
+
+static double avg_ms(int64_t total,int64_t n) {
+  return n?total/1000.0/n:0.0;
+}
+
+void cnn_endpoint_stats(struct connections *cnn,struct jpf_value *out) {
+  struct endpoint *ep;
+  struct connection *c;
+  struct jpf_value *v;
+  int active,idle;
+  char *key;
+
+  for(ep=cnn->epp;ep;ep=ep->next) {
+    active = idle = 0;
+    for(c=ep->conn;c;c=c->next) {
+      if(c->state==CONN_INUSE) { active++; }
+      if(c->state==CONN_READY) { idle++; }
+    }
+    v = jpfv_assoc();
+    jpfv_assoc_add(v,"conns",jpfv_number_int(ep->n_conn));
+    jpfv_assoc_add(v,"active",jpfv_number_int(active));
+    jpfv_assoc_add(v,"idle",jpfv_number_int(idle));
+    jpfv_assoc_add(v,"queued",jpfv_number_int(ep->n_queued));
+    jpfv_assoc_add(v,"requests",jpfv_number_int(ep->n_served));
+    jpfv_assoc_add(v,"reuse_perc",
+                   jpfv_number(ep->n_served?
+                               100.0*ep->n_reused/ep->n_served:0.0));
+    jpfv_assoc_add(v,"wait_ms_avg",
+                   jpfv_number(avg_ms(ep->wait_total,ep->n_served)));
+    jpfv_assoc_add(v,"wait_ms_max",jpfv_number(ep->wait_max/1000.0));
+    jpfv_assoc_add(v,"setup_ms_avg",
+                   jpfv_number(avg_ms(ep->setup_total,ep->n_setup)));
+    jpfv_assoc_add(v,"expired",jpfv_number_int(ep->n_expired));
+    key = make_string("%s:%d",ep->host,ep->port);
+    jpfv_assoc_add(out,key,v);
+    free(key);
+  }
+}
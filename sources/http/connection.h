@@ -1,17 +1,26 @@
 #ifndef HTTP_CONN_H
 #define HTTP_CONN_H
 
+#include <inttypes.h>
+
 struct connections;
 struct connection;
+struct jpf_value;
 
 #include "client.h"
 
+/* Pool sizing and timeouts, for all endpoints or just one */
+struct cnn_limits {
+  int64_t max_conns,warm_conns;
+  int64_t idle_ms,stuck_ms,queue_ms;
+};
+
 typedef void (*conn_cb)(struct connection *conn,void *priv);
 
 void unget_connection(struct connection *conn,int bad);
 
 void get_connection(struct connections *cnn,
-                    const char *host,int port,
+                    const char *host,int port,int background,
                     conn_cb callback,void *priv);
 
 typedef void (*cnn_free_cb)(void *);
@@ -20,6 +29,11 @@ struct evhttp_connection * evconnection(struct connection *conn);
 struct connections * cnn_make(struct httpclient *cli);
 void cnn_free(struct connections *cnn,cnn_free_cb cb,void *priv);
 
+void cnn_default_limits(struct cnn_limits *lim);
+void cnn_set_limits(struct connections *cnn,const char *endpoint,
+                    struct cnn_limits *lim);
+
 void cnn_stats(struct connections *cnn,int64_t *n_new,int64_t *dns_time);
+void cnn_endpoint_stats(struct connections *cnn,struct jpf_value *out);
 
 #endif
@@ -15,31 +15,48 @@
 #include "client.h"
 #include "../../request.h"
 #include "../../util/misc.h"
+#include "../../util/buffer.h"
 #include "../../util/logging.h"
 #include "../../source.h"
+#include "../../inflight.h"
+#include "../../jpf/jpf.h"
 
 #define PREFIX "http://"
 
 CONFIG_LOGGING(http)
 
+/* Unless the route's caches say otherwise */
 #define HTTPBLOCKSIZE 65536
 
 struct http {
   struct httpclient *cli;
 
   /* stats */
-  int64_t dns_time;
+  int64_t dns_time,requests,ranges;
 };
 
+/* The part of a request handled by this source. It waits on each of its
+ * blocks: these may be fetched on its behalf or on behalf of some other
+ * request which wanted the same block at the same time.
+ */
 struct httpwholereq {
   struct source *ds;
+  struct request *rq;
   int count,failed_errno;
 };
 
-struct httpreq {
+/* A single GET, for one or more runs of blocks. Lives in the arena of
+ * the request which asked for it, and holds that request.
+ */
+struct httpfetch {
+  struct source *ds;
   struct request *rq;
-  struct httpwholereq *wr;
-  int64_t offset,length;
+  char *spec;
+  int64_t version;
+  struct ranges todo; /* blocks not yet completed */
+  /* block split across pieces of the body, being put together */
+  struct buffer *gather;
+  int64_t gather_at,gather_got;
 };
 
 static struct http * http_open(struct event_base *base,
@@ -49,90 +66,239 @@ static struct http * http_open(struct event_base *base,
   out = safe_malloc(sizeof(struct http));
   out->cli = httpclient_create(base,dbase);
   out->dns_time = 0;
+  out->requests = out->ranges = 0;
   return out;
 }
 
-static void read_done(int success,char *data,int64_t len,int eof,
-                      void *priv,struct http_stats *stats) {
-  struct httpreq *hr = (struct httpreq *)priv;
-  struct http *ht;
+static void wr_done(struct httpwholereq *wr) {
   struct request *rq;
-  struct chunk *ck;
-  struct httpwholereq *wr;
   int failed_errno;
 
-  rq = hr->rq;
-  wr = hr->wr;
-  ht = (struct http *)(wr->ds->priv);
-  ht->dns_time += stats->dns_time;
-  log_debug(("got http result"));
-  if(success) {
-    log_debug(("got http success"));
-    ck = rq_chunk(wr->ds,data,hr->offset,len,eof,0);
-    rq_found_data(rq,ck); 
+  if(--wr->count) { return; }
+  log_debug(("all done"));
+  rq = wr->rq;
+  failed_errno = wr->failed_errno;
+  src_release(wr->ds); /* wr is in rq's arena */
+  if(failed_errno) {
+    log_debug(("at least one subrequest failed errno=%d",failed_errno));
+    rq_error(rq,failed_errno);
   } else {
-    // XXX better errors for logging/stats
-    log_debug(("got http failure"));
-    wr->failed_errno = EIO;
+    rq_run_next(rq); 
   }
   rq_release(rq);
-  free(hr);
-  if(!--wr->count) {
-    log_debug(("all done"));
-    failed_errno = wr->failed_errno;
-    src_release(wr->ds);
-    free(wr);
-    if(failed_errno) {
-      log_debug(("at least one subrequest failed errno=%d",failed_errno));
-      rq_error(rq,failed_errno);
-    } else {
-      rq_run_next(rq); 
+}
+
+static void block_done(struct chunk *ck,int failed_errno,void *priv) {
+  struct httpwholereq *wr = (struct httpwholereq *)priv;
+
+  if(ck) { rq_found_data(wr->rq,ck); }
+  if(failed_errno) { wr->failed_errno = failed_errno; }
+  wr_done(wr);
+}
+
+static void complete(struct httpfetch *hf,struct buffer *b,char *data,
+                     int64_t bk,int64_t len,int eof) {
+  inflight_complete(src_inflight(hf->ds),hf->spec,hf->version,bk,
+                    hf->ds,b,data,len,eof,0);
+}
+
+/* Pieces of a part arrive in order, so at most one block at a time is
+ * put together from them, at the price of a copy. Returns it once whole.
+ */
+static struct buffer * gather(struct httpfetch *hf,int64_t bk,int64_t bend,
+                              int64_t offset,char *data,int64_t len) {
+  struct buffer *b;
+  int64_t from,to;
+
+  if(hf->gather && hf->gather_at!=bk) {
+    buffer_release(hf->gather);
+    hf->gather = 0;
+  }
+  if(!hf->gather) {
+    if(offset>bk) { return 0; } /* missed its start */
+    hf->gather = buffer_create(bend-bk);
+    hf->gather_at = bk;
+    hf->gather_got = 0;
+  }
+  from = bk+hf->gather_got;
+  if(offset>from) { return 0; } /* gap: will fail, and be fetched again */
+  to = offset+len;
+  if(to>bend) { to = bend; }
+  memcpy(buffer_data(hf->gather)+hf->gather_got,data+(from-offset),to-from);
+  hf->gather_got += to-from;
+  if(hf->gather_got<bend-bk) { return 0; }
+  b = hf->gather;
+  hf->gather = 0;
+  return b;
+}
+
+/* Each piece of the body goes to the reply as soon as it arrives, and
+ * completes the blocks inside it, sharing the piece's buffer. Blocks split
+ * across pieces are gathered. A block ending at EOF is complete at EOF,
+ * if we know where that is.
+ */
+static void part_done(int64_t offset,struct buffer *b,char *data,
+                      int64_t len,int64_t total,void *priv) {
+  struct httpfetch *hf = (struct httpfetch *)priv;
+  struct buffer *g;
+  struct ranges done;
+  struct rangei ri;
+  int64_t x,y,bk,next,bend,end;
+
+  log_debug(("got piece %"PRId64"+%"PRId64,offset,len));
+  end = offset+len;
+  rq_found_early(hf->rq,b,data,offset,len,end==total);
+  ranges_init(&done);
+  ranges_start(&(hf->todo),&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(bk=x;bk<y && bk<end;bk=next) {
+      sl_block(hf->rq->route,bk,HTTPBLOCKSIZE,&next);
+      if(next<=offset) { continue; }
+      bend = next;
+      if(total>=0 && bend>total) { bend = total; }
+      if(bk>=offset && bend<=end) {
+        complete(hf,b,data+(bk-offset),bk,bend-bk,bend==total);
+        ranges_add(&done,bk,next);
+      } else if((g=gather(hf,bk,bend,offset,data,len))) {
+        complete(hf,g,buffer_data(g),bk,bend-bk,bend==total);
+        buffer_release(g);
+        ranges_add(&done,bk,next);
+      }
+    }
+  }
+  ranges_difference(&(hf->todo),&done);
+  ranges_free(&done);
+}
+
+/* Blocks left over are past EOF, or failed */
+static void fetch_done(int success,int64_t total,void *priv,
+                       struct http_stats *stats) {
+  struct httpfetch *hf = (struct httpfetch *)priv;
+  struct http *ht;
+  struct buffer *b;
+  struct rangei ri;
+  int64_t x,y,bk,next;
+
+  ht = (struct http *)(hf->ds->priv);
+  ht->dns_time += stats->dns_time;
+  rq_trace_note(hf->rq,"connect_us",stats->dns_time);
+  rq_trace_note(hf->rq,"transfer_us",stats->xfer_time);
+  rq_trace_note(hf->rq,"http_retries",stats->retries);
+  log_debug(("got http result success=%d",success));
+  if(hf->gather) {
+    /* Didn't know where EOF was until the end */
+    if(success && hf->gather_at+hf->gather_got==total) {
+      complete(hf,hf->gather,buffer_data(hf->gather),hf->gather_at,
+               hf->gather_got,1);
+      sl_block(hf->rq->route,hf->gather_at,HTTPBLOCKSIZE,&next);
+      ranges_remove(&(hf->todo),hf->gather_at,next);
     }
+    buffer_release(hf->gather);
   }
+  b = buffer_create(0);
+  ranges_start(&(hf->todo),&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    for(bk=x;bk<y;bk=next) {
+      sl_block(hf->rq->route,bk,HTTPBLOCKSIZE,&next);
+      if(success && total>=0 && bk>=total) {
+        inflight_complete(src_inflight(hf->ds),hf->spec,hf->version,bk,
+                          hf->ds,b,buffer_data(b),0,1,0);
+      } else {
+        // XXX better errors for logging/stats
+        inflight_complete(src_inflight(hf->ds),hf->spec,hf->version,bk,
+                          hf->ds,0,0,0,0,EIO);
+      }
+    }
+  }
+  buffer_release(b);
+  ranges_free(&(hf->todo));
+  src_release(hf->ds);
+  rq_release(hf->rq);
 }
 
-static void do_request(struct http *ht,struct httpwholereq *wr,
-                       struct request *rq,
-                       int64_t offset,int64_t length) {
-  struct httpreq *hr;
+static void do_fetch(struct http *ht,struct source *ds,struct request *rq,
+                     struct ranges *blocks) {
+  struct httpfetch *hf;
 
-  log_debug(("requesting %"PRId64"+%"PRId64,offset,length));
-  hr = safe_malloc(sizeof(struct httpreq));
-  hr->wr = wr;
-  hr->rq = rq;
-  hr->offset = offset;
-  hr->length = length;
+  if(log_do_debug) {
+    char *r = ranges_print(blocks);
+    log_debug(("requesting %s",r));
+    free(r);
+  }
+  hf = rq_alloc(rq,sizeof(struct httpfetch));
+  hf->ds = ds;
+  src_acquire(ds);
+  hf->rq = rq;
   rq_acquire(rq);
-  http_request(ht->cli,rq->spec,offset,length,read_done,hr);
+  rq_trace_note(rq,"http_requests",1);
+  hf->spec = rq->spec;
+  hf->version = rq->version;
+  ranges_copy(&(hf->todo),blocks);
+  hf->gather = 0;
+  ht->requests++;
+  ht->ranges += ranges_num(blocks);
+  http_request(ht->cli,rq->spec,blocks,rq->background,part_done,fetch_done,
+               hf);
 }
 
 static void http_read(struct source *ds,struct request *rq) {
   struct http *ht = (struct http *)(ds->priv);
   struct httpwholereq *wr;
-  struct ranges blocks;
+  struct ranges blocks,fetch,group;
   struct rangei ri;
-  int64_t x,y;
+  int64_t x,y,bk,next;
+  int max;
 
   if(!strncmp(rq->spec,PREFIX,strlen(PREFIX))) {
-    wr = safe_malloc(sizeof(struct httpwholereq));
+    wr = rq_alloc(rq,sizeof(struct httpwholereq));
     ranges_copy(&blocks,&(rq->desired));
-    ranges_blockify_expand(&blocks,HTTPBLOCKSIZE);
+    sl_blockify(rq->route,&blocks,HTTPBLOCKSIZE);
     if(log_do_debug) {
       char *r1 = ranges_print(&(rq->desired));
       char *r2 = ranges_print(&blocks);
-      log_debug(("desired: %s expanded: %s size=%d",r1,r2,HTTPBLOCKSIZE));
+      log_debug(("desired: %s expanded: %s",r1,r2));
       free(r1);
       free(r2);
     }
     wr->ds = ds;
     src_acquire(ds);
-    wr->count = ranges_num(&blocks);
+    wr->rq = rq;
+    rq_acquire(rq);
+    wr->count = 1; /* Held until all waits are set up */
     wr->failed_errno = 0;
+    ranges_init(&fetch);
     ranges_start(&blocks,&ri);
     while(ranges_next(&ri,&x,&y)) {
-      do_request(ht,wr,rq,x,y-x);
+      for(bk=x;bk<y;bk=next) {
+        sl_block(rq->route,bk,HTTPBLOCKSIZE,&next);
+        wr->count++;
+        if(inflight_wait(src_inflight(ds),rq->spec,rq->version,bk,
+                         block_done,wr)) {
+          src_collect_fetch(ds,0);
+          ranges_add(&fetch,bk,next);
+        } else {
+          src_collect_fetch(ds,1);
+          rq_trace_note(rq,"coalesced_blocks",1);
+        }
+      }
+    }
+    /* As many runs to a GET as the server will take */
+    max = http_max_ranges(ht->cli,rq->spec);
+    ranges_init(&group);
+    ranges_start(&fetch,&ri);
+    while(ranges_next(&ri,&x,&y)) {
+      ranges_add(&group,x,y);
+      if(ranges_num(&group)==max) {
+        do_fetch(ht,ds,rq,&group);
+        ranges_free(&group);
+        ranges_init(&group);
+      }
     }
+    if(!ranges_empty(&group)) { do_fetch(ht,ds,rq,&group); }
+    ranges_free(&group);
+    ranges_free(&fetch);
     ranges_free(&blocks);
+    wr_done(wr);
   } else {
     rq_run_next(rq);
   } 
@@ -155,11 +321,61 @@ static void http_src_close(struct source *ds) {
 
 static void cache_stats(struct source *src,struct jpf_value *out) {
   struct http *c = (struct http *)(src->priv);
+  struct jpf_value *eps;
   int64_t n_conns_new,dns_time;
 
   cnn_stats(c->cli->cnn,&n_conns_new,&dns_time);
   jpfv_assoc_add(out,"dns_secs",jpfv_number(dns_time/1000000));
   jpfv_assoc_add(out,"conns_total",jpfv_number_int(n_conns_new));
+  jpfv_assoc_add(out,"requests_total",jpfv_number_int(c->requests));
+  jpfv_assoc_add(out,"ranges_total",jpfv_number_int(c->ranges));
+  eps = jpfv_assoc();
+  cnn_endpoint_stats(c->cli->cnn,eps);
+  jpfv_assoc_add(out,"endpoints",eps);
+}
+
+static void config_limit(struct jpf_value *conf,char *key,int64_t *out,
+                         int64_t min) {
+  struct jpf_value *v;
+
+  v = jpfv_lookup(conf,key);
+  if(!v) { return; }
+  if(jpfv_int64(v,out) || *out<min) {
+    log_error(("Bad value for '%s'",key));
+    die("Bad http config");
+  }
+}
+
+static void config_limits(struct jpf_value *conf,struct cnn_limits *lim) {
+  config_limit(conf,"max_conns",&(lim->max_conns),1);
+  config_limit(conf,"warm_conns",&(lim->warm_conns),0);
+  config_limit(conf,"idle_ms",&(lim->idle_ms),0);
+  config_limit(conf,"stuck_ms",&(lim->stuck_ms),1);
+  config_limit(conf,"queue_ms",&(lim->queue_ms),1);
+  if(lim->warm_conns>lim->max_conns) { die("warm_conns above max_conns"); }
+}
+
+/* Connection pool limits are for every server, unless overridden for one
+ * (by "host" or "host:port") under endpoints. Only servers listed there
+ * are warmed up at startup: warm_conns for every server applies to each
+ * one from its first request.
+ */
+static void configure_pool(struct http *ht,struct jpf_value *conf) {
+  struct cnn_limits all,one;
+  struct jpf_value *eps;
+  int i;
+
+  cnn_default_limits(&all);
+  config_limits(conf,&all);
+  cnn_set_limits(ht->cli->cnn,0,&all);
+  eps = jpfv_lookup(conf,"endpoints");
+  if(!eps) { return; }
+  if(eps->type!=JPFV_ASSOC) { die("Bad endpoints"); }
+  for(i=0;i<eps->v.assoc.len;i++) {
+    one = all;
+    config_limits(eps->v.assoc.v[i],&one);
+    cnn_set_limits(ht->cli->cnn,eps->v.assoc.k[i],&one);
+  }
 }
 
 // XXX limit simul requests
@@ -169,9 +385,12 @@ struct source * source_http_make(struct running *rr,
 
   ds = src_create("http");
   ds->priv = http_open(rr->eb,rr->edb);
+  configure_pool((struct http *)ds->priv,conf);
   ds->read = http_read;
   ds->write = 0;
   ds->stats = cache_stats;
   ds->close = http_src_close;
+  src_add_prefix(ds,PREFIX);
+  src_set_inflight(ds);
   return ds;
 }
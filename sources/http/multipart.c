@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "multipart.h"
+#include "../../util/misc.h"
+#include "../../util/logging.h"
+
+CONFIG_LOGGING(http);
+
+/* Boundaries are at most 70 characters: any longer line is a header we
+ * don't care about, and is truncated.
+ */
+#define MAX_LINE 256
+
+enum mp_state { MP_BOUNDARY, MP_HEADERS, MP_DATA, MP_END, MP_BAD };
+
+struct multipart {
+  enum mp_state state;
+  char *boundary; /* including leading "--" */
+  int64_t max;
+  mp_part_fn cb;
+  void *priv;
+
+  /* line being read, outside of part data */
+  char line[MAX_LINE];
+  int line_len;
+
+  /* part being read */
+  int64_t from,to,total,got;
+};
+
+int parse_content_range(const char *range,
+                        int64_t *from,int64_t *to,int64_t *len) {
+  char *q,*r;
+
+  if(strncmp(range,"bytes ",6)) { return 1; }
+  *from = strtoull(range+6,&q,10);
+  if(*q!='-') { return 1; }
+  *to = strtoull(q+1,&r,10);
+  if(*r!='/') { return 1; }
+  *len = strtoull(r+1,&q,10);
+  if(*q) { return 1; }
+  return 0;
+}
+
+static char * get_boundary(const char *content_type) {
+  const char *p,*q;
+
+  if(strncasecmp(content_type,"multipart/byteranges",20)) { return 0; }
+  for(p=strchr(content_type,';');p;p=strchr(p,';')) {
+    p++;
+    while(*p==' ' || *p=='\t') { p++; }
+    if(strncasecmp(p,"boundary=",9)) { continue; }
+    p += 9;
+    if(*p=='"') {
+      q = strchr(++p,'"');
+      if(!q) { return 0; }
+    } else {
+      for(q=p;*q && *q!=';' && *q!=' ' && *q!='\t';q++)
+        ;
+    }
+    if(q==p || q-p>70) { return 0; }
+    return make_string("--%.*s",(int)(q-p),p);
+  }
+  return 0;
+}
+
+struct multipart * mp_new(const char *content_type,int64_t max,
+                          mp_part_fn cb,void *priv) {
+  struct multipart *mp;
+  char *boundary;
+
+  boundary = get_boundary(content_type);
+  if(!boundary) { return 0; }
+  mp = safe_malloc(sizeof(struct multipart));
+  mp->state = MP_BOUNDARY;
+  mp->boundary = boundary;
+  mp->max = max;
+  mp->cb = cb;
+  mp->priv = priv;
+  mp->line_len = 0;
+  return mp;
+}
+
+void mp_free(struct multipart *mp) {
+  free(mp->boundary);
+  free(mp);
+}
+
+static int header(struct multipart *mp,char *s) {
+  if(!*s) { /* end of headers */
+    if(mp->from<0) { return -1; }
+    mp->got = 0;
+    mp->state = MP_DATA;
+    return 0;
+  }
+  if(strncasecmp(s,"content-range:",14)) { return 0; }
+  for(s+=14;*s==' ' || *s=='\t';s++)
+    ;
+  if(parse_content_range(s,&(mp->from),&(mp->to),&(mp->total))) {
+    return -1;
+  }
+  if(mp->from<0 || mp->to<mp->from || mp->to>=mp->total ||
+     mp->to-mp->from+1>mp->max) {
+    log_warn(("bad part range '%s'",s));
+    return -1;
+  }
+  return 0;
+}
+
+/* Outside part data everything is lines: boundaries, part headers, and
+ * the preamble, blank lines and padding between them, which are ignored.
+ */
+static int line(struct multipart *mp) {
+  char *s = mp->line;
+  int len = mp->line_len,blen;
+
+  while(len && (s[len-1]=='\r' || s[len-1]==' ' || s[len-1]=='\t')) {
+    len--;
+  }
+  s[len] = '\0';
+  if(mp->state==MP_HEADERS) { return header(mp,s); }
+  blen = strlen(mp->boundary);
+  if(strncmp(s,mp->boundary,blen)) { return 0; }
+  if(!s[blen]) {
+    mp->state = MP_HEADERS;
+    mp->from = -1;
+  } else if(!strcmp(s+blen,"--")) {
+    mp->state = MP_END;
+  }
+  return 0;
+}
+
+int mp_feed(struct multipart *mp,struct buffer *b,char *data,size_t len) {
+  const char *nl;
+  size_t n,m;
+
+  while(len && mp->state!=MP_BAD && mp->state!=MP_END) {
+    if(mp->state==MP_DATA) {
+      n = mp->to-mp->from+1-mp->got;
+      if(n>len) { n = len; }
+      mp->cb(mp->from+mp->got,b,data,n,mp->total,mp->priv);
+      mp->got += n;
+      if(mp->got==mp->to-mp->from+1) { mp->state = MP_BOUNDARY; }
+    } else {
+      nl = memchr(data,'\n',len);
+      n = nl?nl-data+1:len;
+      m = nl?n-1:n;
+      if(m>MAX_LINE-1-mp->line_len) { m = MAX_LINE-1-mp->line_len; }
+      memcpy(mp->line+mp->line_len,data,m);
+      mp->line_len += m;
+      if(nl) {
+        if(line(mp)) { mp->state = MP_BAD; }
+        mp->line_len = 0;
+      }
+    }
+    data += n;
+    len -= n;
+  }
+  return mp->state==MP_BAD?-1:0;
+}
+
+/* Was the closing boundary seen? */
+int mp_finished(struct multipart *mp) { return mp->state==MP_END; }
@@ -0,0 +1,31 @@
+#ifndef HTTP_MULTIPART_H
+#define HTTP_MULTIPART_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "../../util/buffer.h"
+
+/* Parser for multipart/byteranges bodies, the answer to a request for
+ * several ranges at once. It is fed the body in whatever pieces it
+ * arrives, each in a buffer, and reports the part data in each piece,
+ * with its place in the file, straight away. A part split across pieces
+ * is reported a bit at a time. Data is a view of the piece's buffer:
+ * acquire it to keep the data beyond the callback.
+ */
+
+struct multipart;
+
+typedef void (*mp_part_fn)(int64_t offset,struct buffer *b,char *data,
+                           int64_t len,int64_t total,void *priv);
+
+struct multipart * mp_new(const char *content_type,int64_t max,
+                          mp_part_fn cb,void *priv);
+void mp_free(struct multipart *mp);
+int mp_feed(struct multipart *mp,struct buffer *b,char *data,size_t len);
+int mp_finished(struct multipart *mp);
+
+int parse_content_range(const char *range,
+                        int64_t *from,int64_t *to,int64_t *len);
+
+#endif
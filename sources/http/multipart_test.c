@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "multipart.h"
+
+/* The same body fed whole, a byte at a time, and in uneven pieces should
+ * give the same parts each time, then mangled bodies should be refused.
+ * Parts are reported as they arrive: a '|' is where one was split.
+ *
+ * whole: 0/100 'hello' 50/100 'a\r\n' 90/100 'end--of-it' finished
+ * bytes: 0/100 'h|e|l|l|o' 50/100 'a|\r|\n' 90/100 'e|n|d|-|-|o|f|-|i|t' finished
+ * odd: 0/100 'hello' 50/100 'a\r\n' 90/100 'end|--|of-it' finished
+ * no range: -1
+ * too long: 0/100 'hello' 50/100 'a\r\n' -1
+ * no boundary: refused
+ *
+ * gcc -std=gnu99 -I. -Iutil sources/http/multipart_test.c \
+ *     sources/http/multipart.c util/buffer.c util/misc.c util/logging.c ...
+ */
+
+static char *body =
+  "preamble to ignore\r\n"
+  "--THIS_STRING_SEPARATES\r\n"
+  "Content-Type: application/octet-stream\r\n"
+  "Content-Range: bytes 0-4/100\r\n"
+  "\r\n"
+  "hello\r\n"
+  "--THIS_STRING_SEPARATES  \r\n"
+  "content-range:bytes 50-52/100\r\n"
+  "\r\n"
+  "a\r\n\r\n"
+  "--THIS_STRING_SEPARATES\r\n"
+  "Content-Range: bytes 90-99/100\r\n"
+  "\r\n"
+  "end--of-it\r\n"
+  "--THIS_STRING_SEPARATES--\r\n"
+  "epilogue\r\n";
+
+static char *ctype =
+  "multipart/byteranges; boundary=THIS_STRING_SEPARATES";
+
+static int64_t next;
+
+static void part(int64_t offset,struct buffer *b,char *data,int64_t len,
+                 int64_t total,void *priv) {
+  int i;
+
+  if(offset==next) {
+    printf("|");
+  } else {
+    if(next>=0) { printf("'"); }
+    printf(" %"PRId64"/%"PRId64" '",offset,total);
+  }
+  for(i=0;i<len;i++) {
+    if(data[i]=='\r') {
+      printf("\\r");
+    } else if(data[i]=='\n') {
+      printf("\\n");
+    } else {
+      putchar(data[i]);
+    }
+  }
+  next = offset+len;
+}
+
+static void feed(char *name,char *body,int *steps) {
+  struct multipart *mp;
+  struct buffer *b;
+  size_t at,n,len;
+  int i,r;
+
+  printf("%s:",name);
+  mp = mp_new(ctype,64,part,0);
+  next = -1;
+  len = strlen(body);
+  r = 0;
+  for(at=0,i=0;at<len && !r;at+=n,i++) {
+    n = steps?steps[i%4]:len;
+    if(n>len-at) { n = len-at; }
+    b = buffer_view(body+at,n,0,0);
+    r = mp_feed(mp,b,body+at,n);
+    buffer_release(b);
+  }
+  if(next>=0) { printf("'"); }
+  if(r) {
+    printf(" %d\n",r);
+  } else {
+    printf(" %s\n",mp_finished(mp)?"finished":"unfinished");
+  }
+  mp_free(mp);
+}
+
+int main() {
+  int bytes[] = { 1, 1, 1, 1 };
+  int odd[] = { 7, 1, 13, 2 };
+  char *bad;
+
+  feed("whole",body,0);
+  feed("bytes",body,bytes);
+  feed("odd",body,odd);
+  bad = strdup(body);
+  memcpy(strstr(bad,"Content-Range: bytes 0"),"X-Range",7);
+  feed("no range",bad,0);
+  free(bad);
+  bad = strdup(body);
+  memcpy(strstr(bad,"90-99"),"00-99",5);
+  feed("too long",bad,0);
+  free(bad);
+  printf("no boundary: %s\n",
+         mp_new("multipart/byteranges",64,part,0)?"accepted":"refused");
+  return 0;
+}
@@ -10,23 +10,27 @@ static void do_exit(evutil_socket_t fd,short what,void *eb) {
   event_base_loopexit((struct event_base *)eb,0);
 }
 
-static void done(int success,char *data,int64_t len,int eof,void *priv,
-                 struct http_stats *stats) {
-  char *out;
+static void part(int64_t offset,struct buffer *b,char *data,int64_t len,
+                 int64_t total,void *priv) {
+  fprintf(stderr,"part offset=%ld len=%ld '%d'\n",offset,len,data[4]);
+}
 
-  if(!success) {
-    fprintf(stderr,"ERROR: %s\n",data);
-    return;
-  }
-  fprintf(stderr,"done success=%d len=%ld '%d'\n",success,len,data[4]);
+static void done(int success,int64_t total,void *priv,
+                 struct http_stats *stats) {
+  fprintf(stderr,"done success=%d total=%ld\n",success,total);
 }
 
 char * url = "http://ftp.ensembl.org/pub/data_files/homo_sapiens/GRCh38/dna_methylation_feature/dna_methylation_feature/Fibrobl_5mC_ENCODE_Husdonalpha_RRBS_FDR_1e-4/wgEncodeHaibMethylRrbsFibroblDukeRawDataRep.bb";
 
 static void req(evutil_socket_t fd,short what,void *priv) {
   struct httpclient *cli = (struct httpclient *)priv;
+  struct ranges want;
 
-  http_request(cli,url,0,20,done,0);
+  ranges_init(&want);
+  ranges_add(&want,0,20);
+  ranges_add(&want,1000,1020);
+  http_request(cli,url,&want,0,part,done,0);
+  ranges_free(&want);
 }
 
 int main() {
@@ -36,6 +40,7 @@ int main() {
   struct event *exit_ev,*ev,*ev2;
   struct timeval three_sec = {3,0};
   struct timeval ten_sec = {10,0};
+  int i;
 
   logging_fd(2);
   log_set_level("",LOG_DEBUG);
@@ -45,12 +50,7 @@ int main() {
   exit_ev = evsignal_new(eb,SIGINT,do_exit,eb);
   event_add(exit_ev,0);
 
-  http_request(cli,url,0,20,done,0);
-  http_request(cli,url,0,20,done,0);
-  http_request(cli,url,0,20,done,0);
-  http_request(cli,url,0,20,done,0);
-  http_request(cli,url,0,20,done,0);
-  http_request(cli,url,0,20,done,0);
+  for(i=0;i<6;i++) { req(0,0,cli); }
   ev = evtimer_new(eb,req,cli);
   evtimer_add(ev,&three_sec);
   ev2 = evtimer_new(eb,req,cli);
@@ -10,6 +10,7 @@
 #include "request.h"
 #include "util/logging.h"
 #include "util/event.h"
+#include "util/pool.h"
 
 #define NUMTHREADS 128
 
@@ -32,6 +33,8 @@ struct member {
   int failed_errno;
 };
 
+static struct pool member_pool = POOL_INIT(sizeof(struct member));
+
 struct syncqueue {
   struct ref r;
   struct wqueue *qu;
@@ -76,7 +79,7 @@ static void * worker(void *data) {
     if(wqueue_should_quit(sq->qu)) { break; }
     if(!m) { log_debug(("Unexpected flag")); continue; }
     job(sq,m);
-    free(m);
+    pool_free(&member_pool,m);
   }
   return 0;
 }
@@ -122,7 +125,7 @@ static void sq_consume(void *data,void *priv) {
     log_debug(("consumer quitting"));
     ref_release_weak(&(sq->r));
   }
-  free(m);
+  pool_free(&member_pool,m);
 }
 
 struct event * sq_consumer(struct syncqueue *sq) {
@@ -135,7 +138,7 @@ static struct member * new_member_ck(union type type,
                                      struct chunk *ck,int acq,int failed_errno) {
   struct member *m;
 
-  m = safe_malloc(sizeof(struct member));
+  m = pool_alloc(&member_pool);
   m->type = type;
   if(src && src->src && acq) { src_acquire(src->src); }
   m->src = src;
@@ -254,8 +257,9 @@ struct source * syncsource_create(struct syncqueue *sq,
   src = src_create("sync");
   src->priv = ss;
   src->close = src_close;
-  src->read = src_read;
-  src->write = src_write;
+  /* Unset methods keep the source out of those chains in the sourcelist */
+  src->read = ss->read?src_read:0;
+  src->write = ss->write?src_write:0;
   src->stat = 0; // XXX support (can be sync)
   src->readlink = 0; // XXX support (can be sync)
   ss->src = src;
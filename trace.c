@@ -0,0 +1,108 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+#include "util/misc.h"
+#include "util/ranges.h"
+#include "jpf/jpf.h"
+
+struct trace {
+  int64_t start,enter;
+  struct jpf_value *stages,*events;
+  struct jpf_value *cur,*last;
+};
+
+static void add_number(struct jpf_value *v,char *key,int64_t n) {
+  struct jpf_value *w;
+
+  w = jpfv_lookup(v,key);
+  if(w) {
+    w->v.number += n;
+  } else {
+    jpfv_assoc_add(v,key,jpfv_number_int(n));
+  }
+}
+
+struct trace * trace_new(int64_t start) {
+  struct trace *t;
+
+  t = safe_malloc(sizeof(struct trace));
+  t->start = start;
+  t->enter = 0;
+  t->stages = jpfv_important_array(0);
+  t->events = jpfv_assoc();
+  t->cur = t->last = 0;
+  return t;
+}
+
+void trace_free(struct trace *t) {
+  if(t->stages) { jpfv_free(t->stages); }
+  if(t->events) { jpfv_free(t->events); }
+  free(t);
+}
+
+static struct jpf_value * find_stage(struct trace *t,char *source,char *op) {
+  struct jpf_value *s;
+  int i;
+
+  for(i=0;i<t->stages->v.array.len;i++) {
+    s = t->stages->v.array.v[i];
+    if(!strcmp(jpfv_lookup(s,"source")->v.string,source) &&
+       !strcmp(jpfv_lookup(s,"op")->v.string,op)) {
+      return s;
+    }
+  }
+  return 0;
+}
+
+void trace_enter(struct trace *t,char *source,char *op,
+                 struct ranges *wanted) {
+  char *w;
+
+  t->enter = microtime();
+  t->cur = 0;
+  if(!strcmp(op,"write")) { t->cur = find_stage(t,source,op); }
+  if(!t->cur) {
+    t->cur = jpfv_assoc();
+    jpfv_assoc_add(t->cur,"source",jpfv_string(source));
+    jpfv_assoc_add(t->cur,"op",jpfv_string(op));
+    jpfv_assoc_add(t->cur,"enter",jpfv_number_int(t->enter-t->start));
+    if(wanted) {
+      w = ranges_print(wanted);
+      jpfv_assoc_add(t->cur,"wanted",jpfv_string(w));
+      free(w);
+    }
+    jpfv_array_add(t->stages,t->cur);
+  }
+  add_number(t->cur,"calls",1);
+  t->last = t->cur;
+}
+
+void trace_leave(struct trace *t) {
+  if(!t->cur) { return; }
+  add_number(t->cur,"us",microtime()-t->enter);
+  t->cur = 0;
+}
+
+/* Goes to the latest stage: late notes still belong to it */
+void trace_note(struct trace *t,char *key,int64_t n) {
+  if(!t->last) {
+    add_number(t->events,key,n);
+    return;
+  }
+  add_number(t->last,key,n);
+}
+
+void trace_event(struct trace *t,char *name) {
+  add_number(t->events,name,microtime()-t->start);
+}
+
+/* Hands over what has been gathered: the trace is then empty */
+void trace_record(struct trace *t,struct jpf_value *out) {
+  jpfv_assoc_add(out,"events",t->events);
+  jpfv_assoc_add(out,"stages",t->stages);
+  t->events = jpfv_assoc();
+  t->stages = jpfv_important_array(0);
+  t->cur = t->last = 0;
+}
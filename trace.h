@@ -0,0 +1,25 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+#include "util/ranges.h"
+#include "jpf/jpf.h"
+
+/* Per-request record of time spent in each source, kept only when a
+ * slow log is configured. Reads get a stage each; writes are summed per
+ * source. Sources may add counters to the stage in progress with notes.
+ */
+
+struct trace;
+
+struct trace * trace_new(int64_t start);
+void trace_free(struct trace *t);
+void trace_enter(struct trace *t,char *source,char *op,
+                 struct ranges *wanted);
+void trace_leave(struct trace *t);
+void trace_note(struct trace *t,char *key,int64_t n);
+void trace_event(struct trace *t,char *name);
+void trace_record(struct trace *t,struct jpf_value *out);
+
+#endif
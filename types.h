@@ -7,6 +7,8 @@
 #include <unistd.h>
 
 #include "util/misc.h"
+#include "util/buffer.h"
+#include "util/arena.h"
 #include "util/ranges.h"
 #include "util/strbuf.h"
 #include "jpf/jpf.h"
@@ -26,6 +28,11 @@ struct sourcelist;
 struct source;
 struct chunk;
 struct request;
+struct writeback;
+struct latency;
+struct trace;
+struct slowlog;
+struct prefetch;
 
 // XXX inodes not int!
 typedef void (*src_fn)(struct source *);
@@ -46,6 +53,7 @@ struct source {
   struct source *next,**prev;
   struct sourcelist *sl;
   struct failures *fails;
+  struct inflight *inflight;
 
   char *type,*name;
   void *priv;
@@ -57,17 +65,43 @@ struct source {
   src_request_fn read;
   src_write_fn write;
   src_stats_fn stats;
+  char **prefixes; /* specs served; none means all */
+  int n_prefixes,pos;
+  int64_t block,block_from,block_to; /* geometry, if block */
 
   /* stats */
   uint64_t bytes,hits,r_time,w_time,errors,writes;
+  uint64_t originated,coalesced;
+  struct latency *r_lat,*w_lat;
+};
+
+/* A stretch of offsets [from,next's from) with its block size (0 for
+ * no preference) */
+struct geom {
+  int64_t from,block;
+};
+
+/* The sources which can serve specs starting with prefix, in order */
+struct route {
+  char *prefix;
+  int len,n_read,n_write,n_geom;
+  struct source **read,**write;
+  struct geom *geom; /* from the readers' geometries, by offset */
 };
 
 struct sourcelist {
   struct ref r;
   struct source *root;
+  struct route *routes; /* longest prefix first, "" last */
+  int n_routes;
  
   struct hits *hits; 
+  struct writeback *wb;
+  struct slowlog *slow;
+  struct prefetch *pf;
+  int64_t demand; /* requests from interfaces yet to reply */
   uint64_t bytes,n_hits,time;
+  struct latency *lat;
 };
 
 struct interface;
@@ -82,11 +116,15 @@ struct interface {
 
   /* stats */
   int64_t bytes,hits,errors;
+  struct latency *lat;
 };
 
-/* You may (should!) inspect this */
+/* You may (should!) inspect this. out points into buf, which the chunk
+ * holds a reference to.
+ */
 struct chunk {
-  char *out; // XXX don't copy
+  struct buffer *buf;
+  char *out;
   int64_t offset,length;
   int eof;
   struct chunk *next;
@@ -95,24 +133,40 @@ struct chunk {
 
 typedef void (*req_fn)(int failed_errno,char *data,void *priv);
 
+enum rq_state { RQ_READING, RQ_WRITING, RQ_FINISHED };
+
 struct request {
   struct ref r;
   struct interface *ic;
   struct sourcelist *sl;
 
   struct chunk *chunks;
-  struct source *src;
+  struct source *src; /* borrowed: the sourcelist holds it */
+  struct route *route;
+  int src_i; /* next in route's read or write chain */
 
   char *spec,*out;
+  struct buffer *out_buf; /* set if out is lent by a chunk */
   int64_t version,offset,length;
-  struct ranges desired;
+  struct ranges desired; /* may be expanded to whole blocks by sources */
+  struct ranges owed; /* of the reply itself, not yet found */
   int failed_errno;
+  int background; /* ours (a prefetch), not an interface's */
+  int answered; /* done has been called */
 
   req_fn done;
   void *priv;
+  struct arena arena; /* freed with the request: see rq_alloc */
+
+  /* driver */
+  enum rq_state state;
+  int driving,again;
+  struct writeback *wb; /* set once writeback has started our writes */
   
   /* stats */
   uint64_t start,p_start;
+  int64_t replied; /* us from start to reply */
+  struct trace *trace; /* only if there's a slow log */
 };
 
 #endif
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include "arena.h"
+
+#define BLOCK_MIN 2048
+
+struct arena_block {
+  struct arena_block *next;
+  char data[] __attribute__((aligned(16)));
+};
+
+void arena_init(struct arena *a) {
+  a->cur = a->first;
+  a->end = a->first+ARENA_INLINE;
+  a->blocks = 0;
+}
+
+void arena_free(struct arena *a) {
+  struct arena_block *b;
+
+  while(a->blocks) {
+    b = a->blocks->next;
+    free(a->blocks);
+    a->blocks = b;
+  }
+  arena_init(a);
+}
+
+void * arena_alloc(struct arena *a,size_t len) {
+  struct arena_block *b;
+  size_t size;
+  char *out;
+
+  len = (len+15)&~(size_t)15;
+  if(a->cur+len > a->end) {
+    size = len > BLOCK_MIN ? len : BLOCK_MIN;
+    b = safe_malloc(sizeof(struct arena_block)+size);
+    b->next = a->blocks;
+    a->blocks = b;
+    a->cur = b->data;
+    a->end = b->data+size;
+  }
+  out = a->cur;
+  a->cur += len;
+  return out;
+}
+
+char * arena_strdup(struct arena *a,const char *s) {
+  size_t len;
+  char *out;
+
+  len = strlen(s)+1;
+  out = arena_alloc(a,len);
+  memcpy(out,s,len);
+  return out;
+}
@@ -0,0 +1,27 @@
+#ifndef UTIL_ARENA_H
+#define UTIL_ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator for things which live exactly as long as some owner
+ * (eg a request). Nothing is freed individually: arena_free releases
+ * the lot. The first few hundred bytes come from inside the arena
+ * itself, so small users never call malloc. Not thread safe.
+ */
+
+#define ARENA_INLINE 256
+
+/* Only here to allow embedding, don't peek */
+struct arena_block;
+struct arena {
+  char *cur,*end;
+  struct arena_block *blocks;
+  char first[ARENA_INLINE] __attribute__((aligned(16)));
+};
+
+void arena_init(struct arena *a);
+void arena_free(struct arena *a);
+void * arena_alloc(struct arena *a,size_t len);
+char * arena_strdup(struct arena *a,const char *s);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "misc.h"
+#include "buffer.h"
+#include "pool.h"
+
+struct buffer {
+  int refs;
+  char *data;
+  int64_t len;
+  buffer_free_fn fn;
+  void *priv;
+};
+
+static struct pool buffer_pool = POOL_INIT(sizeof(struct buffer));
+
+static void free_malloced(char *data,void *priv) { free(data); }
+
+struct buffer * buffer_view(char *data,int64_t len,
+                            buffer_free_fn fn,void *priv) {
+  struct buffer *b;
+
+  b = pool_alloc(&buffer_pool);
+  b->refs = 1;
+  b->data = data;
+  b->len = len;
+  b->fn = fn;
+  b->priv = priv;
+  return b;
+}
+
+struct buffer * buffer_adopt(char *data,int64_t len) {
+  return buffer_view(data,len,free_malloced,0);
+}
+
+struct buffer * buffer_create(int64_t len) {
+  return buffer_adopt(safe_malloc(len),len);
+}
+
+char * buffer_data(struct buffer *b) { return b->data; }
+int64_t buffer_len(struct buffer *b) { return b->len; }
+
+void buffer_acquire(struct buffer *b) { b->refs++; }
+
+void buffer_release(struct buffer *b) {
+  if(--b->refs) { return; }
+  if(b->fn) { b->fn(b->data,b->priv); }
+  pool_free(&buffer_pool,b);
+}
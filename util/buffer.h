@@ -0,0 +1,28 @@
+#ifndef UTIL_BUFFER_H
+#define UTIL_BUFFER_H
+
+#include <stdint.h>
+
+/* A buffer is a refcounted handle onto a run of bytes which some part
+ * of the system produced (a malloc, a view into an mmap, etc). They are
+ * passed around instead of copying the bytes. The creator says how the
+ * bytes go away when the last reference is released.
+ *
+ * Counts are not locked: buffers can be handed between threads but not
+ * shared between them.
+ */
+
+struct buffer;
+
+typedef void (*buffer_free_fn)(char *data,void *priv);
+
+struct buffer * buffer_create(int64_t len);
+struct buffer * buffer_adopt(char *data,int64_t len);
+struct buffer * buffer_view(char *data,int64_t len,
+                            buffer_free_fn fn,void *priv);
+char * buffer_data(struct buffer *b);
+int64_t buffer_len(struct buffer *b);
+void buffer_acquire(struct buffer *b);
+void buffer_release(struct buffer *b);
+
+#endif
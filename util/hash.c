@@ -56,8 +56,8 @@ struct hash * make_hash(char *msg) {
   return out;
 }
 
-uint64_t hash_mod(struct hash *h,int n) {
-  unsigned int val = 0;
+uint64_t hash_mod(struct hash *h,int64_t n) {
+  uint64_t val = 0;
   int i;
 
   for(i=0;i<8 && i<h->len;i++)
@@ -141,6 +141,81 @@ uint32_t str_hash(const char *key) {
   return data_hash(key,strlen(key));
 }
 
+/* murmur3_x64_128, reading the input as little-endian whatever the host
+ * so that hashes stored on disk are portable.
+ */
+#define ROT64(x, y) ((x << y) | (x >> (64 - y)))
+
+uint64_t le64_get(const unsigned char *p) {
+  uint64_t v = 0;
+  int i;
+
+  for(i=7;i>=0;i--) { v = (v<<8)|p[i]; }
+  return v;
+}
+
+void le64_put(unsigned char *p,uint64_t v) {
+  int i;
+
+  for(i=0;i<8;i++) { p[i] = v&0xFF; v >>= 8; }
+}
+
+static uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+void hash128(const void *key,size_t len,uint64_t seed,struct hash128 *out) {
+  static const uint64_t c1 = 0x87c37b91114253d5ULL;
+  static const uint64_t c2 = 0x4cf5ad432745937fULL;
+  const unsigned char *data = (const unsigned char *)key;
+  const unsigned char *tail;
+  uint64_t h1 = seed, h2 = seed, k1, k2;
+  size_t i,nblocks = len / 16;
+
+  for(i=0;i<nblocks;i++) {
+    k1 = le64_get(data+i*16);
+    k2 = le64_get(data+i*16+8);
+    k1 *= c1; k1 = ROT64(k1,31); k1 *= c2; h1 ^= k1;
+    h1 = ROT64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+    k2 *= c2; k2 = ROT64(k2,33); k2 *= c1; h2 ^= k2;
+    h2 = ROT64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+  }
+
+  tail = data + nblocks*16;
+  k1 = k2 = 0;
+  switch(len & 15) {
+  case 15: k2 ^= ((uint64_t)tail[14]) << 48;
+  case 14: k2 ^= ((uint64_t)tail[13]) << 40;
+  case 13: k2 ^= ((uint64_t)tail[12]) << 32;
+  case 12: k2 ^= ((uint64_t)tail[11]) << 24;
+  case 11: k2 ^= ((uint64_t)tail[10]) << 16;
+  case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;
+  case  9: k2 ^= ((uint64_t)tail[ 8]);
+    k2 *= c2; k2 = ROT64(k2,33); k2 *= c1; h2 ^= k2;
+  case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;
+  case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;
+  case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;
+  case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;
+  case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;
+  case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;
+  case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;
+  case  1: k1 ^= ((uint64_t)tail[ 0]);
+    k1 *= c1; k1 = ROT64(k1,31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+  out->h[0] = h1;
+  out->h[1] = h2;
+}
+
 struct hash * hash_str(const char *hashs) {
   struct hash *h;
   char c;
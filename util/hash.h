@@ -1,13 +1,20 @@
 #ifndef UTIL_HASH_H
 #define UTIL_HASH_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct hash;
 
+struct hash128 {
+  uint64_t h[2];
+};
+
 unsigned char * hash_data(struct hash *h);
 unsigned int hash_len(struct hash *h);
 void write_hash(char *msg,unsigned char *ptr,unsigned int len);
 struct hash * make_hash(char *msg);
-uint64_t hash_mod(struct hash *h,int n);
+uint64_t hash_mod(struct hash *h,int64_t n);
 int hash_cmp(struct hash *h,void *mem,int len);
 void free_hash(struct hash *h);
 char * print_hex(unsigned char *val,unsigned int len);
@@ -17,4 +24,8 @@ uint32_t str_hash(const char *key);
 struct hash * hash_str(const char *hashs);
 struct hash * hash_bin(void *mem,int len);
 
+void hash128(const void *key,size_t len,uint64_t seed,struct hash128 *out);
+uint64_t le64_get(const unsigned char *p);
+void le64_put(unsigned char *p,uint64_t v);
+
 #endif
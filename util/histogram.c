@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "misc.h"
+#include "histogram.h"
+
+#define SUB_BITS 5
+#define SUB (1<<SUB_BITS)
+#define MAX_EXP 40
+#define NBUCKETS (SUB*(MAX_EXP-SUB_BITS+1))
+
+struct histogram {
+  uint64_t count,sum,max;
+  uint64_t counts[NBUCKETS];
+};
+
+static int bucket(uint64_t v) {
+  int e;
+
+  if(v < SUB) { return v; }
+  if(v >= ((uint64_t)1)<<MAX_EXP) { return NBUCKETS-1; }
+  e = 63-__builtin_clzll(v);
+  return SUB + (e-SUB_BITS)*SUB + (int)((v>>(e-SUB_BITS))-SUB);
+}
+
+/* Largest value which lands in bucket b */
+static uint64_t bucket_top(int b) {
+  int e;
+
+  if(b < SUB) { return b; }
+  b -= SUB;
+  e = b/SUB;
+  return ((((uint64_t)(SUB+b%SUB+1))<<e)-1);
+}
+
+struct histogram * histogram_create(void) {
+  struct histogram *h;
+
+  h = safe_malloc(sizeof(struct histogram));
+  memset(h,0,sizeof(struct histogram));
+  return h;
+}
+
+void histogram_free(struct histogram *h) { free(h); }
+
+void histogram_record(struct histogram *h,uint64_t v) {
+  h->counts[bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if(v > h->max) { h->max = v; }
+}
+
+void histogram_copy(struct histogram *to,struct histogram *from) {
+  memcpy(to,from,sizeof(struct histogram));
+}
+
+/* then must be an earlier copy of now. The max of the difference is
+ * only known to bucket precision.
+ */
+void histogram_diff(struct histogram *out,struct histogram *now,
+                    struct histogram *then) {
+  int i;
+
+  out->count = now->count - then->count;
+  out->sum = now->sum - then->sum;
+  out->max = 0;
+  for(i=0;i<NBUCKETS;i++) {
+    out->counts[i] = now->counts[i] - then->counts[i];
+    if(out->counts[i]) { out->max = bucket_top(i); }
+  }
+  if(out->max > now->max) { out->max = now->max; }
+}
+
+uint64_t histogram_count(struct histogram *h) { return h->count; }
+uint64_t histogram_max(struct histogram *h) { return h->max; }
+
+uint64_t histogram_mean(struct histogram *h) {
+  if(!h->count) { return 0; }
+  return h->sum/h->count;
+}
+
+/* Upper bound of the bucket holding the perc-th percentile */
+uint64_t histogram_percentile(struct histogram *h,double perc) {
+  uint64_t target,seen,top;
+  int i;
+
+  if(!h->count) { return 0; }
+  target = (uint64_t)(h->count*perc/100.0+0.999999);
+  if(target < 1) { target = 1; }
+  if(target > h->count) { target = h->count; }
+  seen = 0;
+  for(i=0;i<NBUCKETS;i++) {
+    seen += h->counts[i];
+    if(seen >= target) {
+      top = bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
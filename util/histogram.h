@@ -0,0 +1,25 @@
+#ifndef UTIL_HISTOGRAM_H
+#define UTIL_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear histogram of non-negative integers (usually microseconds).
+ * Each power of two is split into 32 equal buckets, so any value is
+ * reported to within about 3%. Recording is constant time. Values
+ * beyond about 2^40 are counted in the top bucket.
+ */
+
+struct histogram;
+
+struct histogram * histogram_create(void);
+void histogram_free(struct histogram *h);
+void histogram_record(struct histogram *h,uint64_t v);
+void histogram_copy(struct histogram *to,struct histogram *from);
+void histogram_diff(struct histogram *out,struct histogram *now,
+                    struct histogram *then);
+uint64_t histogram_count(struct histogram *h);
+uint64_t histogram_mean(struct histogram *h);
+uint64_t histogram_max(struct histogram *h);
+uint64_t histogram_percentile(struct histogram *h,double perc);
+
+#endif
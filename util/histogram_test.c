@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "misc.h"
+#include "histogram.h"
+
+/* Each reported percentile should be at or just above the exact one.
+ *
+ * uniform  n=100000 p50 ok p90 ok p99 ok p999 ok max=99999
+ * skewed   n=100000 p50 ok p90 ok p99 ok p999 ok max=9999999
+ * interval n=1000 p50=5119 p99=5119 max=5119
+ *
+ * (5000 falls in the bucket [4992,5119])
+ */
+
+static void check(char *name,struct histogram *h,uint64_t *sorted,int n) {
+  double percs[] = { 50, 90, 99, 99.9 };
+  char *names[] = { "p50", "p90", "p99", "p999" };
+  uint64_t want,got;
+  int i,idx;
+
+  printf("%-8s n=%"PRIu64,name,histogram_count(h));
+  for(i=0;i<4;i++) {
+    idx = (int)(n*percs[i]/100.0+0.999999)-1;
+    want = sorted[idx];
+    got = histogram_percentile(h,percs[i]);
+    /* Within a bucket: 1/32 of the value */
+    if(got >= want && got <= want+want/32+1) {
+      printf(" %s ok",names[i]);
+    } else {
+      printf(" %s BAD (want %"PRIu64" got %"PRIu64")",names[i],want,got);
+    }
+  }
+  printf(" max=%"PRIu64"\n",histogram_max(h));
+}
+
+static int cmp(const void *a,const void *b) {
+  uint64_t x = *(uint64_t *)a,y = *(uint64_t *)b;
+
+  return (x>y)-(x<y);
+}
+
+int main() {
+  struct histogram *h,*mark,*iv;
+  uint64_t *v;
+  int i,n = 100000;
+
+  v = safe_malloc(n*sizeof(uint64_t));
+  h = histogram_create();
+  for(i=0;i<n;i++) { v[i] = i; }
+  for(i=0;i<n;i++) { histogram_record(h,v[n-1-i]); }
+  check("uniform",h,v,n);
+  histogram_free(h);
+
+  /* 99% fast, 1% very slow */
+  h = histogram_create();
+  for(i=0;i<n;i++) {
+    v[i] = (i < n-n/100) ? 100+i%50 : 1000000+(i%1000)*9000;
+  }
+  v[n-1] = 9999999;
+  for(i=0;i<n;i++) { histogram_record(h,v[i]); }
+  qsort(v,n,sizeof(uint64_t),cmp);
+  check("skewed",h,v,n);
+
+  mark = histogram_create();
+  iv = histogram_create();
+  histogram_copy(mark,h);
+  for(i=0;i<1000;i++) { histogram_record(h,5000); }
+  histogram_diff(iv,h,mark);
+  printf("interval n=%"PRIu64" p50=%"PRIu64" p99=%"PRIu64" max=%"PRIu64"\n",
+         histogram_count(iv),histogram_percentile(iv,50),
+         histogram_percentile(iv,99),histogram_max(iv));
+  histogram_free(h);
+  histogram_free(mark);
+  histogram_free(iv);
+  free(v);
+  return 0;
+}
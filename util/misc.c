@@ -287,6 +287,48 @@ int write_all(int fd,void *b,size_t count) {
   return 0;
 }
 
+int pwrite_all(int fd,void *b,size_t count,off_t offset) {
+  unsigned char *buf = (unsigned char *)b;
+  ssize_t r;
+  int n;
+
+  for(n=0;count && n<1000;) {
+    r = pwrite(fd,buf,count,offset);
+    if(r<0) {
+      if(errno==EAGAIN || errno==EINTR) { n++; continue; }
+      return -1;
+    }
+    if(r==0) { n++; continue; }
+    n = 0;
+    buf += r;
+    count -= r;
+    offset += r;
+  }
+  return count?-1:0;
+}
+
+/* Bytes read, short only at EOF */
+ssize_t pread_all(int fd,void *b,size_t count,off_t offset) {
+  unsigned char *buf = (unsigned char *)b;
+  ssize_t r,t = 0;
+  int n;
+
+  for(n=0;count && n<1000;) {
+    r = pread(fd,buf,count,offset);
+    if(r<0) {
+      if(errno==EAGAIN || errno==EINTR) { n++; continue; }
+      return -1;
+    }
+    if(r==0) { return t; }
+    n = 0;
+    buf += r;
+    count -= r;
+    offset += r;
+    t += r;
+  }
+  return t;
+}
+
 // XXX not int!
 int read_all(int fd,void *b,size_t count) {
   unsigned char *buf = (unsigned char *)b;
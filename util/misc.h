@@ -47,6 +47,8 @@ void fsync_async(int fd,void (*cb)(void *),void *);
 char * iso_localtime(time_t t);
 int write_all(int fd,void *buf,size_t count);
 int read_all(int fd,void *buf,size_t count);
+int pwrite_all(int fd,void *buf,size_t count,off_t offset);
+ssize_t pread_all(int fd,void *buf,size_t count,off_t offset);
 int read_file(char *filename,char **out);
 int write_file(char *filename,char *out);
 
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "pool.h"
+
+#ifdef NO_POOLS
+
+void * pool_alloc(struct pool *p) { return safe_malloc(p->size); }
+void pool_free(struct pool *p,void *data) { free(data); }
+
+#else
+
+#define POOL_MAX 32
+#define SLAB_BYTES 16384
+#define BATCH 64
+
+struct free_obj {
+  struct free_obj *next;
+  struct free_obj *next_batch; /* only in the depot */
+};
+
+struct local {
+  struct free_obj *first;
+  int n;
+};
+
+static int next_id = 0;
+static __thread struct local locals[POOL_MAX];
+
+/* Ids are handed out on first use, from any thread */
+static int pool_id(struct pool *p) {
+  int id;
+
+  if(p->id) { return p->id; }
+  id = __sync_add_and_fetch(&next_id,1);
+  if(id >= POOL_MAX) { die("Too many pools"); }
+  __sync_bool_compare_and_swap(&(p->id),0,id);
+  return p->id;
+}
+
+static void new_slab(struct pool *p,struct local *l) {
+  struct free_obj *o;
+  size_t size;
+  char *slab;
+  int i,n;
+
+  size = p->size;
+  if(size < sizeof(struct free_obj)) { size = sizeof(struct free_obj); }
+  size = (size+15)&~(size_t)15;
+  n = SLAB_BYTES/size;
+  if(n < 1) { n = 1; }
+  slab = safe_malloc(n*size);
+  for(i=n-1;i>=0;i--) {
+    o = (struct free_obj *)(slab+i*size);
+    o->next = l->first;
+    l->first = o;
+  }
+  l->n += n;
+}
+
+static void from_depot(struct pool *p,struct local *l) {
+  struct free_obj *batch;
+
+  pthread_mutex_lock(&(p->lock));
+  batch = (struct free_obj *)p->depot;
+  if(batch) { p->depot = batch->next_batch; }
+  pthread_mutex_unlock(&(p->lock));
+  if(batch) {
+    l->first = batch;
+    l->n = BATCH;
+  } else {
+    new_slab(p,l);
+  }
+}
+
+static void to_depot(struct pool *p,struct local *l) {
+  struct free_obj *batch,*o;
+  int i;
+
+  batch = l->first;
+  for(i=1,o=batch;i<BATCH;i++) { o = o->next; }
+  l->first = o->next;
+  l->n -= BATCH;
+  o->next = 0;
+  pthread_mutex_lock(&(p->lock));
+  batch->next_batch = (struct free_obj *)p->depot;
+  p->depot = batch;
+  pthread_mutex_unlock(&(p->lock));
+}
+
+void * pool_alloc(struct pool *p) {
+  struct local *l;
+  struct free_obj *o;
+
+  l = &(locals[pool_id(p)]);
+  if(!l->first) { from_depot(p,l); }
+  o = l->first;
+  l->first = o->next;
+  l->n--;
+  return o;
+}
+
+void pool_free(struct pool *p,void *data) {
+  struct local *l;
+  struct free_obj *o = (struct free_obj *)data;
+
+  l = &(locals[pool_id(p)]);
+  o->next = l->first;
+  l->first = o;
+  if(++l->n > 2*BATCH) { to_depot(p,l); }
+}
+
+#endif
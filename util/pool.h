@@ -0,0 +1,32 @@
+#ifndef UTIL_POOL_H
+#define UTIL_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Fixed-size object pools for small structures allocated on every
+ * request. Objects are carved from slabs which are never returned to the
+ * system. Each thread keeps its own free list, so the common case takes
+ * no lock. Objects may be freed by a different thread from the one which
+ * allocated them (eg chunks made by syncsource workers): a thread with
+ * too many free objects passes a batch to a shared depot, and a thread
+ * with none takes a batch from there before making a new slab.
+ *
+ * Declare pools statically with POOL_INIT. Build with -DNO_POOLS to use
+ * plain malloc/free, eg under valgrind.
+ */
+
+/* Only here to allow static allocation, don't peek */
+struct pool {
+  int id;
+  size_t size;
+  pthread_mutex_t lock;
+  void *depot;
+};
+
+#define POOL_INIT(size) { 0, (size), PTHREAD_MUTEX_INITIALIZER, 0 }
+
+void * pool_alloc(struct pool *p);
+void pool_free(struct pool *p,void *data);
+
+#endif
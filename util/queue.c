@@ -2,12 +2,15 @@
 
 #include "misc.h"
 #include "queue.h"
+#include "pool.h"
 
 struct member {
   void *data;
   struct member *next;
 };
 
+static struct pool member_pool = POOL_INIT(sizeof(struct member));
+
 struct queue {
   struct ref r;
   int n;
@@ -50,7 +53,7 @@ struct queue * queue_create(type_free_cb freev,void *priv) {
 void queue_add(struct queue *q,void *data) {
   struct member *m;
 
-  m = safe_malloc(sizeof(struct member));
+  m = pool_alloc(&member_pool);
   m->data = data;
   m->next = 0;
   *(q->lastp) = m;
@@ -68,7 +71,7 @@ void * queue_remove(struct queue *q) {
   q->first = m->next;
   if(!q->first) { q->lastp = &(q->first); }
   data = m->data;
-  free(m);
+  pool_free(&member_pool,m);
   return data; 
 }
 
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "misc.h"
 #include "strbuf.h"
@@ -7,117 +8,135 @@
 
 /* ALL RANGES ARE SEMI-OPEN */
 
-struct range {
-  int64_t a,b;
-  struct range *next;
-};
+static struct range * vec(struct ranges *rr) {
+  return rr->v?rr->v:rr->in;
+}
 
 void ranges_init(struct ranges *rr) {
-  rr->r = 0;
+  rr->n = 0;
+  rr->size = RANGES_INLINE;
+  rr->v = 0;
 }
 
 void ranges_free(struct ranges *rr) {
-  struct range *r;
-
-  while(rr->r) {
-    r = rr->r->next;
-    free(rr->r);
-    rr->r = r;
+  if(rr->v) { free(rr->v); }
+  ranges_init(rr);
+}
+
+/* Make room for n more */
+static void reserve(struct ranges *rr,int n) {
+  if(rr->n+n <= rr->size) { return; }
+  while(rr->n+n > rr->size) { rr->size *= 2; }
+  if(rr->v) {
+    rr->v = safe_realloc(rr->v,rr->size*sizeof(struct range));
+  } else {
+    rr->v = safe_malloc(rr->size*sizeof(struct range));
+    memcpy(rr->v,rr->in,rr->n*sizeof(struct range));
   }
 }
 
-static void add(struct range **rr,int64_t a,int64_t b) {
-  struct range *r;
+/* Replace v[i..j) with the n ranges at with */
+static void splice(struct ranges *rr,int i,int j,struct range *with,int n) {
+  struct range *v;
 
-  r = safe_malloc(sizeof(struct range));
-  r->a = a;
-  r->b = b;
-  r->next = *rr;
-  *rr = r;
+  if(n > j-i) { reserve(rr,n-(j-i)); }
+  v = vec(rr);
+  if(n != j-i) {
+    memmove(v+i+n,v+j,(rr->n-j)*sizeof(struct range));
+  }
+  memcpy(v+i,with,n*sizeof(struct range));
+  rr->n += n-(j-i);
 }
 
-static int unify(int64_t *xa,int64_t *xb,int64_t ya,int64_t yb) {
-  /* Fail: xa x x x x x [xb] ya y y y y y [yb], or vice versa */
-  if(ya>*xb || *xa>yb) { return 0; }
-  if(ya<*xa) { *xa = ya; }
-  if(yb>*xb) { *xb = yb; }
-  return 1; 
-}
+/* First range with b >= x (touching counts) or b > x (strict) */
+static int lower(struct ranges *rr,int64_t x,int strict) {
+  struct range *v = vec(rr);
+  int lo = 0,hi = rr->n,mid;
 
-/* Completely disjoint ranges are copied. Others are merged into incoming */
-void ranges_add(struct ranges *rr,int64_t a,int64_t b) {
-  struct range *new = 0,*old; 
-
-  while(rr->r) {
-    old = rr->r;
-    rr->r = old->next;
-    if(!unify(&a,&b,old->a,old->b)) {
-      old->next = new;
-      new = old;
+  while(lo < hi) {
+    mid = (lo+hi)/2;
+    if(v[mid].b < x || (strict && v[mid].b == x)) {
+      lo = mid+1;
     } else {
-      free(old);
+      hi = mid;
     }
   }
-  add(&new,a,b);
-  rr->r = new;
+  return lo;
 }
 
-static int chop(struct range **rr,int64_t c) {
-  struct range *r;
+/* First range from i with a > x (touching counts) or a >= x (strict) */
+static int upper(struct ranges *rr,int i,int64_t x,int strict) {
+  struct range *v = vec(rr);
+  int lo = i,hi = rr->n,mid;
 
-  for(r=*rr;r;r=r->next) {
-    if(r->a < c && r->b > c) {
-      add(rr,c,r->b);
-      r->b = c;
-      return 1;
+  while(lo < hi) {
+    mid = (lo+hi)/2;
+    if(v[mid].a < x || (!strict && v[mid].a == x)) {
+      lo = mid+1;
+    } else {
+      hi = mid;
     }
   }
-  return 0;
+  return lo;
+}
+
+void ranges_add(struct ranges *rr,int64_t a,int64_t b) {
+  struct range *v,r;
+  int i,j;
+
+  if(a >= b) { return; }
+  i = lower(rr,a,0);
+  j = upper(rr,i,b,0);
+  v = vec(rr);
+  r.a = a;
+  r.b = b;
+  if(j > i) {
+    /* Absorb everything which overlaps or touches */
+    if(v[i].a < r.a) { r.a = v[i].a; }
+    if(v[j-1].b > r.b) { r.b = v[j-1].b; }
+  }
+  splice(rr,i,j,&r,1);
 }
 
 void ranges_remove(struct ranges *rr,int64_t a,int64_t b) {
-  struct range *old,*new = 0;
-
-  chop(&(rr->r),a); 
-  chop(&(rr->r),b);
-  /* After those chops, interval will either be all in or all out */
-  while(rr->r) {
-    old = rr->r;
-    rr->r = old->next;
-    if(a>=old->b || b<=old->a) {
-      old->next = new;
-      new = old;
-    } else {
-      free(old);
-    }
+  struct range *v,keep[2];
+  int i,j,n = 0;
+
+  if(a >= b) { return; }
+  i = lower(rr,a,1);
+  j = upper(rr,i,b,1);
+  if(j <= i) { return; }
+  v = vec(rr);
+  if(v[i].a < a) {
+    keep[n].a = v[i].a;
+    keep[n++].b = a;
+  }
+  if(v[j-1].b > b) {
+    keep[n].a = b;
+    keep[n++].b = v[j-1].b;
   }
-  rr->r = new;
+  splice(rr,i,j,keep,n);
 }
 
 void ranges_start(struct ranges *rr,struct rangei *ri) {
   ri->rr = rr;
-  ri->r = 0;
+  ri->i = 0;
 }
 
 int ranges_next(struct rangei *ri,int64_t *a,int64_t *b) {
-  if(ri->r) { ri->r = ri->r->next; } else { ri->r = ri->rr->r; }
-  if(!ri->r) { return 0; }
-  *a = ri->r->a;
-  *b = ri->r->b;
+  struct range *v;
+
+  if(ri->i >= ri->rr->n) { return 0; }
+  v = vec(ri->rr);
+  *a = v[ri->i].a;
+  *b = v[ri->i].b;
+  ri->i++;
   return 1;
 }
 
-int ranges_num(struct ranges *rr) { // XXX do it efficiently
-  struct rangei ri;
-  int out = 0;
-  int64_t x,y;
-  
-  ranges_start(rr,&ri);
-  while(ranges_next(&ri,&x,&y)) { out++; }
-  return out;
-}
+int ranges_num(struct ranges *rr) { return rr->n; }
 
-int ranges_empty(struct ranges *rr) { return !(rr->r); }
+int ranges_empty(struct ranges *rr) { return !rr->n; }
 
 void ranges_merge(struct ranges *a,struct ranges *b) {
   struct rangei ri;
@@ -130,8 +149,11 @@ void ranges_merge(struct ranges *a,struct ranges *b) {
 }
 
 void ranges_copy(struct ranges *dst,struct ranges *src) {
-  ranges_init(dst);
-  ranges_merge(dst,src);  
+  *dst = *src;
+  if(src->v) {
+    dst->v = safe_malloc(src->size*sizeof(struct range));
+    memcpy(dst->v,src->v,src->n*sizeof(struct range));
+  }
 }
 
 void ranges_difference(struct ranges *a,struct ranges *b) {
@@ -144,36 +166,40 @@ void ranges_difference(struct ranges *a,struct ranges *b) {
   }
 }
 
+/* Rounding outwards keeps order but may make neighbours meet */
 void ranges_blockify_expand(struct ranges *a,int size) {
-  struct ranges out;
-  struct rangei ri;
+  struct range *v = vec(a);
   int64_t x,y;
+  int i,n = 0;
 
-  ranges_init(&out);
-  ranges_start(a,&ri);
-  while(ranges_next(&ri,&x,&y)) {
-    ranges_add(&out,(x/size)*size,((y+size-1)/size)*size);
+  for(i=0;i<a->n;i++) {
+    x = (v[i].a/size)*size;
+    y = ((v[i].b+size-1)/size)*size;
+    if(n && x <= v[n-1].b) {
+      if(y > v[n-1].b) { v[n-1].b = y; }
+    } else {
+      v[n].a = x;
+      v[n++].b = y;
+    }
   }
-  ranges_free(a);
-  *a = out;
+  a->n = n;
 }
 
+/* Rounding inwards keeps order and only widens gaps */
 void ranges_blockify_reduce(struct ranges *a,int size) {
-  struct ranges out;
-  struct rangei ri;
+  struct range *v = vec(a);
   int64_t x,y;
+  int i,n = 0;
 
-  ranges_init(&out);
-  ranges_start(a,&ri);
-  while(ranges_next(&ri,&x,&y)) {
-    x = (x+size-1)/size;
-    y = y/size;
+  for(i=0;i<a->n;i++) {
+    x = (v[i].a+size-1)/size;
+    y = v[i].b/size;
     if(y>x) {
-      ranges_add(&out,x*size,y*size);
+      v[n].a = x*size;
+      v[n++].b = y*size;
     }
   }
-  ranges_free(a);
-  *a = out;
+  a->n = n;
 }
 
 char * ranges_print(struct ranges *rr) {
@@ -1,16 +1,29 @@
 #ifndef UTIL_RANGES_H
 #define UTIL_RANGES_H
 
+#include <stdint.h>
+
 /* ALL RANGES ARE SEMI-OPEN */
 
+/* A set of intervals, kept sorted and disjoint (touching intervals are
+ * merged) in a vector. The first few live inside the struct itself so
+ * small sets never touch the heap. Iteration is in ascending order.
+ */
+
+#define RANGES_INLINE 4
+
 /* Only here to allow stack-allocation, don't peek */
-struct range;
+struct range {
+  int64_t a,b;
+};
 struct ranges {
-  struct range *r;
+  int n,size;
+  struct range *v; /* 0 while the intervals fit in in[] */
+  struct range in[RANGES_INLINE];
 };
 struct rangei {
   struct ranges *rr;
-  struct range *r;
+  int i;
 };
 
 void ranges_init(struct ranges *rr);
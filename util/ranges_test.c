@@ -1,17 +1,131 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "misc.h"
 #include "strbuf.h"
 #include "ranges.h"
 
-/* [1,10],[20,30]
- * [4,27]
+#include <inttypes.h>
+
+/* [1,10),[20,30)
+ * [4,27)
  * [0,4096),[31744,65536)
  * [0,62464)
  * (empty)
+ * random: ok
+ *
+ * followed by timings for the benchmark workloads.
  */
 
+#define SPAN 512
+
+/* Compare against a bitmap over [0,SPAN) */
+static int check(struct ranges *rr,char *bits) {
+  struct rangei ri;
+  int64_t x,y,last = -1;
+  char seen[SPAN];
+  int i;
+
+  memset(seen,0,SPAN);
+  ranges_start(rr,&ri);
+  while(ranges_next(&ri,&x,&y)) {
+    if(x >= y || x <= last) { return 1; } /* empty, unsorted or touching */
+    for(i=x;i<y;i++) { seen[i] = 1; }
+    last = y;
+  }
+  return memcmp(seen,bits,SPAN);
+}
+
+static void random_test(void) {
+  struct ranges a,b;
+  char bits[SPAN],ebits[SPAN];
+  int i,j,x,y,add,block;
+
+  srand(1);
+  for(i=0;i<200;i++) {
+    ranges_init(&a);
+    memset(bits,0,SPAN);
+    for(j=0;j<100;j++) {
+      x = rand()%SPAN;
+      y = x+rand()%(SPAN/8);
+      if(y > SPAN) { y = SPAN; }
+      add = rand()%3;
+      if(add) { ranges_add(&a,x,y); } else { ranges_remove(&a,x,y); }
+      memset(bits+x,add?1:0,y-x);
+      if(check(&a,bits)) { printf("random: BAD at %d/%d\n",i,j); return; }
+      if(j%10==0) {
+        ranges_copy(&b,&a);
+        block = 1+rand()%16;
+        ranges_blockify_expand(&b,block);
+        ranges_remove(&b,SPAN,SPAN+block);
+        memset(ebits,0,SPAN);
+        for(x=0;x<SPAN;x++) {
+          if(bits[x]) {
+            y = (x/block)*block;
+            memset(ebits+y,1,(y+block>SPAN?SPAN:y+block)-y);
+          }
+        }
+        if(check(&b,ebits)) {
+          printf("random: BAD blockify at %d/%d\n",i,j);
+          return;
+        }
+        ranges_free(&b);
+      }
+    }
+    ranges_free(&a);
+  }
+  printf("random: ok\n");
+}
+
+#define ROUNDS 200000
+
+/* What a request does: one interval, blockified, then eaten by chunks */
+static void bench_request(void) {
+  struct ranges desired,blocks;
+  int64_t start,off;
+  int i,j;
+
+  start = microtime();
+  for(i=0;i<ROUNDS;i++) {
+    off = (i*7919)%1000000;
+    ranges_init(&desired);
+    ranges_add(&desired,off,off+131072);
+    ranges_copy(&blocks,&desired);
+    ranges_blockify_expand(&blocks,65536);
+    ranges_blockify_expand(&desired,4096);
+    for(j=0;j<33;j++) {
+      ranges_remove(&desired,(off/4096+j)*4096,(off/4096+j+1)*4096);
+      if(ranges_empty(&desired)) { break; }
+    }
+    ranges_free(&blocks);
+    ranges_free(&desired);
+  }
+  printf("bench request: %"PRId64"ns/request\n",
+         (microtime()-start)*1000/ROUNDS);
+}
+
+/* A fragmented set: chunks arriving out of order */
+static void bench_fragmented(void) {
+  struct ranges a;
+  int64_t start;
+  int i,j;
+
+  start = microtime();
+  for(i=0;i<ROUNDS/10;i++) {
+    ranges_init(&a);
+    ranges_add(&a,0,64*4096);
+    for(j=0;j<64;j++) {
+      ranges_remove(&a,((j*37)%64)*4096,((j*37)%64)*4096+4096);
+      ranges_num(&a);
+    }
+    ranges_free(&a);
+  }
+  printf("bench fragmented: %"PRId64"ns/set\n",
+         (microtime()-start)*1000/(ROUNDS/10));
+}
+
 int main() {
   struct ranges a,b,d;
   char *c;
@@ -67,4 +181,9 @@ int main() {
   printf("%s\n",c);
   free(c);
   ranges_free(&a);
+  /**/
+  random_test();
+  bench_request();
+  bench_fragmented();
+  return 0;
 }
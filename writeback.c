@@ -0,0 +1,176 @@
+#include <inttypes.h>
+#include <event2/event.h>
+
+#include "writeback.h"
+
+#include "util/misc.h"
+#include "util/queue.h"
+#include "util/logging.h"
+#include "request.h"
+
+CONFIG_LOGGING(writeback)
+
+struct wb_entry {
+  struct request *rq;
+  int64_t bytes;
+  uint64_t queued;
+};
+
+struct writeback {
+  struct queue *q;
+  struct event *drain;
+  int scheduled,active;
+  int64_t bytes;
+
+  /* config */
+  int max_requests,batch,max_active,drop_oldest;
+  int64_t max_bytes,budget;
+
+  /* stats */
+  uint64_t submitted,written,dropped,dropped_bytes;
+  uint64_t peak,lag_total,lag_max;
+};
+
+static void entry_free(void *target,void *priv) {
+  struct wb_entry *e = (struct wb_entry *)target;
+
+  rq_drop_writes(e->rq);
+  rq_release(e->rq);
+  free(e);
+}
+
+static void drop_entry(struct writeback *wb,struct wb_entry *e) {
+  log_debug(("dropping write of %"PRId64" bytes",e->bytes));
+  wb->dropped++;
+  wb->dropped_bytes += e->bytes;
+  entry_free(e,0);
+}
+
+static void schedule(struct writeback *wb) {
+  struct timeval now = {0,0};
+
+  if(wb->scheduled) { return; }
+  /* A timeout rather than event_active so that I/O gets a look in */
+  wb->scheduled = 1;
+  event_add(wb->drain,&now);
+}
+
+static void drain(evutil_socket_t fd,short what,void *arg) {
+  struct writeback *wb = (struct writeback *)arg;
+  struct wb_entry *e;
+  uint64_t start,lag;
+  int n;
+
+  wb->scheduled = 0;
+  start = microtime();
+  for(n=0;n<wb->batch;n++) {
+    if(wb->active >= wb->max_active || !queue_length(wb->q)) { break; }
+    if(n && microtime()-start > wb->budget) { break; }
+    e = (struct wb_entry *)queue_remove(wb->q);
+    wb->bytes -= e->bytes;
+    lag = microtime()-e->queued;
+    wb->lag_total += lag;
+    if(lag > wb->lag_max) { wb->lag_max = lag; }
+    wb->active++;
+    rq_run_writes(e->rq,wb);
+    rq_release(e->rq);
+    free(e);
+  }
+  log_debug(("started %d writes, %d queued, %d active",
+             n,queue_length(wb->q),wb->active));
+  if(queue_length(wb->q) && wb->active < wb->max_active) { schedule(wb); }
+}
+
+struct writeback * wb_new(struct event_base *eb) {
+  struct writeback *wb;
+
+  wb = safe_malloc(sizeof(struct writeback));
+  wb->q = queue_create(entry_free,0);
+  wb->drain = event_new(eb,-1,0,drain,wb);
+  wb->scheduled = wb->active = 0;
+  wb->bytes = 0;
+  wb->max_requests = 256;
+  wb->max_bytes = 64*1024*1024;
+  wb->batch = 16;
+  wb->max_active = 4;
+  wb->budget = 5000;
+  wb->drop_oldest = 1;
+  wb->submitted = wb->written = wb->dropped = wb->dropped_bytes = 0;
+  wb->peak = wb->lag_total = wb->lag_max = 0;
+  return wb;
+}
+
+void wb_free(struct writeback *wb) {
+  event_del(wb->drain);
+  event_free(wb->drain);
+  queue_release(wb->q);
+  free(wb);
+}
+
+void wb_set_limits(struct writeback *wb,int max_requests,int64_t max_bytes) {
+  wb->max_requests = max_requests;
+  wb->max_bytes = max_bytes;
+}
+
+void wb_set_batch(struct writeback *wb,int batch,int max_active,
+                  int64_t budget) {
+  wb->batch = batch;
+  wb->max_active = max_active;
+  wb->budget = budget;
+}
+
+void wb_set_drop_oldest(struct writeback *wb,int oldest) {
+  wb->drop_oldest = oldest;
+}
+
+void wb_submit(struct writeback *wb,struct request *rq,int64_t bytes) {
+  struct wb_entry *e;
+
+  e = safe_malloc(sizeof(struct wb_entry));
+  rq_acquire(rq);
+  e->rq = rq;
+  e->bytes = bytes;
+  e->queued = microtime();
+  wb->submitted++;
+  if(!wb->drop_oldest &&
+     (queue_length(wb->q) >= wb->max_requests ||
+      wb->bytes+bytes > wb->max_bytes)) {
+    drop_entry(wb,e);
+    return;
+  }
+  queue_add(wb->q,e);
+  wb->bytes += bytes;
+  /* Always keep the newest, even if it alone is over the limit */
+  while(queue_length(wb->q) > 1 &&
+        (queue_length(wb->q) > wb->max_requests ||
+         wb->bytes > wb->max_bytes)) {
+    e = (struct wb_entry *)queue_remove(wb->q);
+    wb->bytes -= e->bytes;
+    drop_entry(wb,e);
+  }
+  if(queue_length(wb->q) > wb->peak) { wb->peak = queue_length(wb->q); }
+  schedule(wb);
+}
+
+void wb_finished(struct writeback *wb,struct request *rq) {
+  wb->active--;
+  wb->written++;
+  if(queue_length(wb->q)) { schedule(wb); }
+}
+
+void wb_stats(struct writeback *wb,struct jpf_value *out) {
+  uint64_t started;
+
+  started = wb->written + wb->active;
+  jpfv_assoc_add(out,"queued",jpfv_number_int(queue_length(wb->q)));
+  jpfv_assoc_add(out,"queued_bytes",jpfv_number_int(wb->bytes));
+  jpfv_assoc_add(out,"peak",jpfv_number_int(wb->peak));
+  jpfv_assoc_add(out,"active",jpfv_number_int(wb->active));
+  jpfv_assoc_add(out,"submitted",jpfv_number_int(wb->submitted));
+  jpfv_assoc_add(out,"written",jpfv_number_int(wb->written));
+  jpfv_assoc_add(out,"dropped",jpfv_number_int(wb->dropped));
+  jpfv_assoc_add(out,"dropped_bytes",jpfv_number_int(wb->dropped_bytes));
+  jpfv_assoc_add(out,"lag_avg",
+                 jpfv_number_int(started?wb->lag_total/started:0));
+  jpfv_assoc_add(out,"lag_max",jpfv_number_int(wb->lag_max));
+}
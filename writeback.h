@@ -0,0 +1,31 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <inttypes.h>
+#include <event2/event.h>
+
+#include "types.h"
+#include "jpf/jpf.h"
+
+/* Requests which have replied and have chunks to write back to caches
+ * wait here rather than writing on the reply path. The queue is bounded
+ * in requests and bytes and when full drops either the oldest or the
+ * newest entry. It is drained from the event loop a batch at a time, with
+ * a cap on the number of requests writing at once and on the time spent
+ * starting writes in any one turn of the loop.
+ */
+
+struct writeback;
+
+struct writeback * wb_new(struct event_base *eb);
+void wb_free(struct writeback *wb);
+void wb_set_limits(struct writeback *wb,int max_requests,int64_t max_bytes);
+void wb_set_batch(struct writeback *wb,int batch,int max_active,
+                  int64_t budget);
+void wb_set_drop_oldest(struct writeback *wb,int oldest);
+
+void wb_submit(struct writeback *wb,struct request *rq,int64_t bytes);
+void wb_finished(struct writeback *wb,struct request *rq);
+void wb_stats(struct writeback *wb,struct jpf_value *out);
+
+#endif